@@ -0,0 +1,207 @@
+#include "blockchain.h"
+#include "ingest.h"
+#include "utils.h"
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <new>
+#include <sstream>
+#include <iomanip>
+
+static std::atomic<uint64_t> allocationCount{0};
+
+void* operator new(size_t size) {
+    allocationCount.fetch_add(1, std::memory_order_relaxed);
+    if (void* p = std::malloc(size ? size : 1)) return p;
+    throw std::bad_alloc();
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, size_t) noexcept { std::free(p); }
+
+struct BenchResult {
+    std::string name;
+    uint64_t iterations;
+    double nsPerOp;
+    double allocsPerOp;
+    double opsPerSec;
+};
+
+struct BenchConfig {
+    uint64_t iterations = 10000;
+    std::string filter;
+    bool json = false;
+};
+
+static BenchResult runBench(const std::string& name, uint64_t iterations, const std::function<void()>& op) {
+    for (uint64_t i = 0; i < iterations / 10 + 1; i++) op();
+    uint64_t allocsBefore = allocationCount.load();
+    auto start = std::chrono::steady_clock::now();
+    for (uint64_t i = 0; i < iterations; i++) op();
+    auto elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    uint64_t allocs = allocationCount.load() - allocsBefore;
+    double nsPerOp = elapsed / iterations;
+    return {name, iterations, nsPerOp, static_cast<double>(allocs) / iterations, nsPerOp > 0 ? 1e9 / nsPerOp : 0.0};
+}
+
+static void report(const BenchResult& r, const BenchConfig& config) {
+    if (config.json) {
+        std::cout << "{\"name\":\"" << r.name << "\",\"iterations\":" << r.iterations
+                  << ",\"ns_per_op\":" << std::fixed << std::setprecision(1) << r.nsPerOp
+                  << ",\"allocs_per_op\":" << std::setprecision(2) << r.allocsPerOp
+                  << ",\"ops_per_sec\":" << std::setprecision(0) << r.opsPerSec << "}" << std::endl;
+    } else {
+        std::cout << std::left << std::setw(24) << r.name << std::right
+                  << std::setw(12) << r.iterations << " iters"
+                  << std::fixed << std::setprecision(1) << std::setw(14) << r.nsPerOp << " ns/op"
+                  << std::setprecision(2) << std::setw(10) << r.allocsPerOp << " allocs/op"
+                  << std::setprecision(0) << std::setw(14) << r.opsPerSec << " ops/s" << std::endl;
+    }
+}
+
+// Senders whose home is shard 0, so block execution keeps every tx local.
+static std::vector<std::string> benchSenders(size_t count = 64) {
+    ShardMap map;
+    std::vector<std::string> senders;
+    for (int i = 0; senders.size() < count; i++) {
+        std::string name = "bench_sender" + std::to_string(i);
+        if (map.lookup(name) == "0") senders.push_back(name);
+    }
+    return senders;
+}
+
+static std::vector<Transaction> makeTxs(int count) {
+    std::vector<std::string> senders = benchSenders();
+    std::vector<Transaction> txs;
+    txs.reserve(count);
+    for (int i = 0; i < count; i++) {
+        txs.emplace_back(senders[i % senders.size()], "bench_receiver" + std::to_string(i), 1.0);
+    }
+    return txs;
+}
+
+struct BenchAccounts : AccountView {
+    double balanceOf(const std::string&) const override { return 100.0; }
+};
+
+// Blocks run at the current time so the benchmark txs fall inside their validity window.
+static uint64_t blockTime() {
+    return std::chrono::system_clock::now().time_since_epoch().count();
+}
+
+struct ChainBench {
+    static std::string calculateHash(const AhmiyatBlock& block) { return block.calculateHash(); }
+    static std::string signTransaction(AhmiyatChain& chain, const Transaction& tx) { return chain.signTransaction(tx); }
+    static void applyBlock(AhmiyatChain& chain, const std::string& shardId, const std::vector<Transaction>& txs) {
+        std::lock_guard<std::mutex> lock(chain.chainMutex);
+        chain.applyBlock(shardId, chain.executeBlock(shardId, txs, "bench_miner", 0.0, blockTime()));
+    }
+    static void executeBlock(AhmiyatChain& chain, const std::string& shardId, const std::vector<Transaction>& txs) {
+        std::lock_guard<std::mutex> lock(chain.chainMutex);
+        chain.executeBlock(shardId, txs, "bench_miner", 0.0, blockTime());
+    }
+    static void fund(AhmiyatChain& chain, const std::string& shardId, const std::string& address, double amount) {
+        std::lock_guard<std::mutex> lock(chain.chainMutex);
+        chain.shardBalances[shardId][address] += amount;
+    }
+};
+
+int main(int argc, char* argv[]) {
+    BenchConfig config;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--json") config.json = true;
+        else if (arg == "--iterations" && i + 1 < argc) config.iterations = std::strtoull(argv[++i], nullptr, 10);
+        else if (arg == "--filter" && i + 1 < argc) config.filter = argv[++i];
+        else {
+            std::cerr << "Usage: ./ahmiyat_bench [--json] [--iterations N] [--filter name]" << std::endl;
+            return 1;
+        }
+    }
+
+    system("mkdir -p memories");
+    setLogEnabled(false);
+    setUploadBackend([](const std::string& filePath) { return "QmBench" + std::to_string(filePath.size()); });
+
+    std::vector<Transaction> txs = makeTxs(100);
+    MemoryFragment memory("text", "bench_fragment.txt", "Benchmark fragment", "bench", 0);
+    AhmiyatBlock block(1, txs, memory, "0", 1, 0.0, "0");
+    AhmiyatChain chain("ahmiyat_bench_db");
+    ShardManager shardManager;
+    DHT dht;
+    for (int i = 0; i < 1000; i++) dht.addPeer(Node("peer" + std::to_string(i), "127.0.0.1", 6000 + i));
+    for (const auto& sender : benchSenders()) ChainBench::fund(chain, "0", sender, 1e9);
+    // Every sender distinct, so speculative execution never conflicts.
+    std::vector<Transaction> disjointTxs;
+    for (const auto& sender : benchSenders(1024)) {
+        ChainBench::fund(chain, "0", sender, 1e9);
+        disjointTxs.emplace_back(sender, "bench_receiver", 1.0);
+        disjointTxs.back().script = "BALANCE_CHECK=10";
+    }
+    Transaction scriptTx = txs[0];
+    scriptTx.script = "BALANCE_CHECK=10";
+    BenchAccounts accounts;
+
+    uint64_t n = config.iterations;
+    std::vector<std::pair<std::string, std::function<BenchResult()>>> benches = {
+        {"tx_hash", [&] { return runBench("tx_hash", n, [&] { txs[0].getHash(); }); }},
+        {"block_hash_100tx", [&] { return runBench("block_hash_100tx", n / 10 + 1, [&] { ChainBench::calculateHash(block); }); }},
+        {"tx_hash_reused_buffer", [&] {
+            unsigned char digest[32];
+            std::string scratch;
+            size_t i = 0;
+            return runBench("tx_hash_reused_buffer", n, [&] { txs[i++ % txs.size()].messageHash(digest, scratch); });
+        }},
+        // Allocations per op should be the same for both sizes: none scale with the tx count.
+        {"validate_block_10tx", [&] {
+            AhmiyatBlock b(1, std::vector<Transaction>(txs.begin(), txs.begin() + 10), memory, "0", 1, 0.0, "0");
+            return runBench("validate_block_10tx", n / 10 + 1, [&] { b.validate(); });
+        }},
+        {"compact_tx_push", [&] {
+            CompactTxBatch pool;
+            size_t i = 0;
+            return runBench("compact_tx_push", n, [&] { pool.push(txs[i++ % txs.size()]); });
+        }},
+        {"compact_tx_unpack", [&] {
+            CompactTxBatch pool;
+            for (const auto& tx : txs) pool.push(tx);
+            size_t i = 0;
+            return runBench("compact_tx_unpack", n, [&] { pool.unpack(i++ % pool.size()); });
+        }},
+        {"validate_block_100tx", [&] { return runBench("validate_block_100tx", n / 10 + 1, [&] { block.validate(); }); }},
+        {"block_serialize_100tx", [&] { return runBench("block_serialize_100tx", n / 10 + 1, [&] { block.serialize(); }); }},
+        {"mine_difficulty_1", [&] {
+            AhmiyatBlock b(1, txs, memory, "0", 1, 0.0, "0");
+            return runBench("mine_difficulty_1", n / 100 + 1, [&] { b.mineBlock(0.0); });
+        }},
+        {"mine_difficulty_2", [&] {
+            AhmiyatBlock b(1, txs, memory, "0", 2, 0.0, "0");
+            return runBench("mine_difficulty_2", n / 1000 + 1, [&] { b.mineBlock(0.0); });
+        }},
+        {"sign_tx", [&] { return runBench("sign_tx", n / 10 + 1, [&] { ChainBench::signTransaction(chain, txs[0]); }); }},
+        {"assign_shard", [&] { return runBench("assign_shard", n, [&] { shardManager.assignShard(txs[0]); }); }},
+        {"apply_block_100tx", [&] { return runBench("apply_block_100tx", n / 10 + 1, [&] { ChainBench::applyBlock(chain, "0", txs); }); }},
+        {"mpsc_queue_push_pop", [&] {
+            MpscQueue<std::string> queue;
+            std::string out;
+            return runBench("mpsc_queue_push_pop", n, [&] {
+                queue.push(txs[0].sender);
+                queue.pop(out);
+            });
+        }},
+        {"execute_block_1024tx_disjoint", [&] {
+            return runBench("execute_block_1024tx_disjoint", n / 100 + 1, [&] { ChainBench::executeBlock(chain, "0", disjointTxs); });
+        }},
+        {"script_balance_check", [&] { return runBench("script_balance_check", n, [&] { scriptTx.executeScript(accounts, 0); }); }},
+        {"dht_find_peers", [&] { return runBench("dht_find_peers", n / 10 + 1, [&] { dht.findPeers("peer0", 10); }); }},
+    };
+
+    for (auto& [name, bench] : benches) {
+        if (!config.filter.empty() && name.find(config.filter) == std::string::npos) continue;
+        report(bench(), config);
+    }
+    return 0;
+}
@@ -0,0 +1,73 @@
+#include "blockcache.h"
+#include "blockchain.h"
+
+BlockCache::BlockCache(size_t capacity) : capacityBytes(capacity) {}
+
+bool BlockCache::find(const std::string& hash, Entry& entry) {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = entries.find(hash);
+    if (it == entries.end()) {
+        misses++;
+        return false;
+    }
+    hits++;
+    lru.splice(lru.begin(), lru, it->second);
+    entry.compact = it->second->compact;
+    entry.block = it->second->block;
+    return true;
+}
+
+std::shared_ptr<const AhmiyatBlock> BlockCache::get(const std::string& hash) {
+    Entry entry;
+    if (!find(hash, entry)) return nullptr;
+    if (entry.block) return entry.block;
+    return std::make_shared<const AhmiyatBlock>(entry.compact->expand());
+}
+
+std::string BlockCache::getRecord(const std::string& hash) {
+    Entry entry;
+    if (!find(hash, entry)) return "";
+    return entry.block ? entry.block->encode() : entry.compact->encode();
+}
+
+void BlockCache::put(const std::string& hash, const AhmiyatBlock& block) {
+    Entry entry{hash, nullptr, nullptr, 0};
+    try {
+        entry.compact = std::make_shared<const CompactBlock>(block);
+        entry.bytes = entry.compact->bytes();
+    } catch (const std::runtime_error&) {
+        entry.block = std::make_shared<const AhmiyatBlock>(block);
+        entry.bytes = block.encode().size();
+    }
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = entries.find(hash);
+    if (it != entries.end()) {
+        usedBytes -= it->second->bytes;
+        lru.erase(it->second);
+        entries.erase(it);
+    }
+    if (entry.bytes > capacityBytes) return;
+    usedBytes += entry.bytes;
+    lru.push_front(std::move(entry));
+    entries[hash] = lru.begin();
+    while (usedBytes > capacityBytes && !lru.empty()) {
+        usedBytes -= lru.back().bytes;
+        entries.erase(lru.back().hash);
+        lru.pop_back();
+    }
+}
+
+size_t BlockCache::size() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return entries.size();
+}
+
+size_t BlockCache::bytes() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return usedBytes;
+}
+
+double BlockCache::hitRate() const {
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    return hits + misses ? static_cast<double>(hits) / (hits + misses) : 0.0;
+}
@@ -0,0 +1,45 @@
+#ifndef BLOCKCACHE_H
+#define BLOCKCACHE_H
+
+#include <string>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+
+class AhmiyatBlock;
+class CompactBlock;
+
+// Size-bounded LRU of block bodies keyed by block hash. Bodies are kept as
+// CompactBlocks, so each cached block's tx bytes and addresses sit in its
+// own arena and go away on eviction; get() expands a copy outside the lock.
+// A block whose txs cannot be compacted is kept as it is.
+class BlockCache {
+private:
+    struct Entry {
+        std::string hash;
+        std::shared_ptr<const CompactBlock> compact;
+        std::shared_ptr<const AhmiyatBlock> block;
+        size_t bytes;
+    };
+    std::list<Entry> lru;
+    std::unordered_map<std::string, std::list<Entry>::iterator> entries;
+    size_t capacityBytes;
+    size_t usedBytes = 0;
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    mutable std::mutex cacheMutex;
+    bool find(const std::string& hash, Entry& entry);
+
+public:
+    explicit BlockCache(size_t capacityBytes);
+    std::shared_ptr<const AhmiyatBlock> get(const std::string& hash);
+    // The stored record of a cached block, encoded from its compact form; "" on a miss.
+    std::string getRecord(const std::string& hash);
+    void put(const std::string& hash, const AhmiyatBlock& block);
+    size_t size() const;
+    size_t bytes() const;
+    double hitRate() const;
+};
+
+#endif
@@ -1,10 +1,19 @@
 #include "blockchain.h"
+#include "metrics.h"
+#include "trace.h"
+#include "executor.h"
 #include <openssl/sha.h>
 #include <openssl/ecdsa.h>
 #include <openssl/obj_mac.h>
+#include <openssl/hmac.h>
+#include <openssl/bn.h>
 #include <curl/curl.h>
 #include <random>
+#include <map>
+#include <charconv>
+#include <cstdio>
 #include <algorithm>
+#include <iterator>
 #include <chrono>
 #include <stdexcept>
 #include <fstream>
@@ -18,6 +27,111 @@ extern void log(const std::string& message);
 extern std::string uploadToIPFS(const std::string& filePath);
 extern std::string generateZKProof(const std::string& data);
 
+const uint8_t BLOCK_RECORD_VERSION = 7;
+
+std::string blockKey(const std::string& hash) {
+    return "blk:" + hash;
+}
+
+std::string heightKey(const std::string& shardId, uint64_t height) {
+    std::string key = "hgt:" + shardId + ":";
+    for (int i = 7; i >= 0; i--) key.push_back(static_cast<char>((height >> (8 * i)) & 0xff));
+    return key;
+}
+
+static const size_t MAX_BLOCK_RECORD_BYTES = 32 * 1024 * 1024;
+
+// Block timestamps are system_clock ticks; scripts and time locks use Unix seconds.
+static uint64_t blockSeconds(uint64_t timestamp) {
+    return std::chrono::duration_cast<std::chrono::seconds>(std::chrono::system_clock::duration(timestamp)).count();
+}
+
+static void appendHex(std::string& out, const unsigned char* bytes, size_t size) {
+    static const char digits[] = "0123456789abcdef";
+    for (size_t i = 0; i < size; i++) {
+        out.push_back(digits[bytes[i] >> 4]);
+        out.push_back(digits[bytes[i] & 0x0f]);
+    }
+}
+
+template <typename T>
+static void appendNumber(std::string& out, T value) {
+    char number[24];
+    out.append(number, std::to_chars(number, number + sizeof(number), value).ptr - number);
+}
+
+static bool hasLeadingZeroNibbles(const unsigned char* digest, int count) {
+    if (count > 2 * SHA256_DIGEST_LENGTH) return false;
+    for (int i = 0; i < count; i++) {
+        int nibble = i % 2 ? digest[i / 2] & 0x0f : digest[i / 2] >> 4;
+        if (nibble) return false;
+    }
+    return true;
+}
+
+static int hexValue(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F') return c - 'A' + 10;
+    return -1;
+}
+
+std::string hashToHex(const Hash256& hash) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex(64, '0');
+    for (size_t i = 0; i < hash.size(); i++) {
+        hex[2 * i] = digits[hash[i] >> 4];
+        hex[2 * i + 1] = digits[hash[i] & 0x0f];
+    }
+    return hex;
+}
+
+Hash256 hexToHash(const std::string& hex) {
+    Hash256 hash{};
+    if (hex.size() != 64) return hash;
+    for (size_t i = 0; i < hash.size(); i++) {
+        int hi = hexValue(hex[2 * i]);
+        int lo = hexValue(hex[2 * i + 1]);
+        if (hi < 0 || lo < 0) return Hash256{};
+        hash[i] = static_cast<uint8_t>((hi << 4) | lo);
+    }
+    return hash;
+}
+
+static MetricsRegistry& metrics = MetricsRegistry::instance();
+static MetricHistogram& chainLockWait = metrics.histogram("ahmiyat_chain_lock_wait_seconds", "Time spent waiting for chainMutex");
+static MetricHistogram& blockBuildLatency = metrics.histogram("ahmiyat_block_build_seconds", "Block construction and mining time");
+static MetricHistogram& blockValidateLatency = metrics.histogram("ahmiyat_block_validate_seconds", "Block validation time");
+static MetricHistogram& blockCommitLatency = metrics.histogram("ahmiyat_block_commit_seconds", "Block append, persist and state apply time");
+static MetricHistogram& dbWriteLatency = metrics.histogram("ahmiyat_leveldb_write_seconds", "LevelDB block write time");
+static MetricHistogram& broadcastLatency = metrics.histogram("ahmiyat_broadcast_seconds", "Block broadcast fan-out time");
+static MetricGauge& mempoolDepth = metrics.gauge("ahmiyat_mempool_depth", "Pending transactions awaiting a block");
+static MetricGauge& mempoolBytes = metrics.gauge("ahmiyat_mempool_bytes", "Memory held by pending transactions");
+static MetricCounter& mempoolFull = metrics.counter("ahmiyat_mempool_full_total", "Transactions turned away because the mempool was full");
+static MetricCounter& blocksCommitted = metrics.counter("ahmiyat_blocks_committed_total", "Blocks appended to the local chain");
+static MetricCounter& scriptGasUsed = metrics.counter("ahmiyat_script_gas_total", "Gas consumed by transaction scripts");
+static MetricCounter& txsSpeculated = metrics.counter("ahmiyat_txs_speculated_total", "Transactions executed speculatively in parallel");
+static MetricCounter& txsReexecuted = metrics.counter("ahmiyat_txs_reexecuted_total", "Speculative transactions re-executed after a conflict");
+
+// Shard-labelled mining metrics, looked up in the registry once per shard.
+struct ShardMiningMetrics {
+    MetricCounter* attempts;
+    MetricGauge* hashRate;
+};
+static const ShardMiningMetrics& shardMiningMetrics(const std::string& shardId) {
+    static std::mutex cacheMutex;
+    static std::unordered_map<std::string, ShardMiningMetrics> cache;
+    std::lock_guard<std::mutex> lock(cacheMutex);
+    auto it = cache.find(shardId);
+    if (it == cache.end()) {
+        MetricLabels labels = {{"shard", shardId}};
+        it = cache.emplace(shardId, ShardMiningMetrics{
+            &metrics.counter("ahmiyat_mining_attempts_total", "Proof-of-work hash attempts", labels),
+            &metrics.gauge("ahmiyat_hash_rate", "Hash attempts per second of the last mining job", labels)}).first;
+    }
+    return it->second;
+}
+
 bool Transaction::validate() const {
     if (sender.empty() || receiver.empty() || sender == receiver) return false;
     if (amount < 0 || fee < 0 || amount > 21000000.0 || fee > amount) return false;
@@ -41,25 +155,75 @@ std::string Transaction::toString() const {
 
 std::string Transaction::getHash() const {
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)toString().c_str(), toString().length(), hash);
-    std::stringstream ss;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        ss << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
+    std::string scratch;
+    messageHash(hash, scratch);
+    std::string hex;
+    appendHex(hex, hash, SHA256_DIGEST_LENGTH);
+    return hex;
+}
+
+void Transaction::encode(ByteWriter& writer) const {
+    writer.putBytes(sender);
+    writer.putBytes(receiver);
+    writer.putF64(amount);
+    writer.putF64(fee);
+    writer.putBytes(script);
+    writer.putBytes(signature);
+    writer.putBytes(shardId);
+    writer.putU64(timestamp);
+    writer.putU32(static_cast<uint32_t>(witness.size()));
+    for (const auto& entry : witness) writer.putBytes(entry);
+}
+
+Transaction Transaction::decode(ByteReader& reader, bool withWitness) {
+    Transaction tx;
+    tx.sender = reader.getBytes();
+    tx.receiver = reader.getBytes();
+    tx.amount = reader.getF64();
+    tx.fee = reader.getF64();
+    tx.script = reader.getBytes();
+    tx.signature = reader.getBytes();
+    tx.shardId = reader.getBytes();
+    tx.timestamp = reader.getU64();
+    if (withWitness) {
+        uint32_t count = reader.getU32();
+        if (count > reader.remaining()) throw std::runtime_error("Corrupt transaction record");
+        tx.witness.reserve(count);
+        for (uint32_t i = 0; i < count; i++) tx.witness.push_back(reader.getBytes());
     }
-    return ss.str();
+    return tx;
+}
+
+void Transaction::messageHash(unsigned char out[32]) const {
+    std::string scratch;
+    messageHash(out, scratch);
+}
+
+// Byte-for-byte the preimage toString() builds: std::to_string formats doubles with "%f".
+// Takes the fields rather than a Transaction so CompactBlock can hash without unpacking.
+static void txMessageHash(std::string_view sender, std::string_view receiver, double amount, double fee,
+                          std::string_view script, std::string_view shardId, uint64_t timestamp,
+                          unsigned char out[32], std::string& scratch) {
+    char number[64];
+    scratch.clear();
+    scratch.append(sender).append(receiver);
+    scratch.append(number, std::snprintf(number, sizeof(number), "%f", amount));
+    scratch.append(number, std::snprintf(number, sizeof(number), "%f", fee));
+    scratch.append(script).append(shardId);
+    appendNumber(scratch, timestamp);
+    SHA256((const unsigned char*)scratch.data(), scratch.size(), out);
 }
 
-bool Transaction::executeScript(const std::unordered_map<std::string, double>& balances) {
+void Transaction::messageHash(unsigned char out[32], std::string& scratch) const {
+    txMessageHash(sender, receiver, amount, fee, script, shardId, timestamp, out, scratch);
+}
+
+bool Transaction::executeScript(const AccountView& accounts, uint64_t now) const {
     if (script.empty()) return true;
-    if (script.find("BALANCE_CHECK") != std::string::npos) {
-        try {
-            double required = std::stod(script.substr(script.find("=") + 1));
-            return balances.count(sender) && balances.at(sender) >= required;
-        } catch (...) {
-            return false;
-        }
-    }
-    return true;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    messageHash(digest);
+    ScriptContext context{&sender, &receiver, amount, fee, now, digest, &witness};
+    return ScriptEngine::run(*ScriptEngine::instance().prepare(script), context, accounts).ok;
 }
 
 MemoryFragment::MemoryFragment(std::string t, std::string fp, std::string desc, std::string o, int lt) 
@@ -80,23 +244,48 @@ void MemoryFragment::saveToFile() {
     }
 }
 
-std::string AhmiyatBlock::calculateHash() const {
-    std::stringstream ss;
-    ss << index << timestamp;
+void AhmiyatBlock::hashPrefix(std::string& out) const {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    std::string scratch;
+    out.clear();
+    out.reserve(48 + transactions.size() * 2 * SHA256_DIGEST_LENGTH + memory.ipfsHash.size() + previousHash.size());
+    appendNumber(out, index);
+    appendNumber(out, timestamp);
     for (const auto& tx : transactions) {
-        ss << tx.getHash();
+        tx.messageHash(digest, scratch);
+        appendHex(out, digest, SHA256_DIGEST_LENGTH);
+        for (const auto& entry : tx.witness) out.append(entry);
     }
-    ss << memory.ipfsHash << previousHash << memoryProof << stakeWeight << shardId;
+    out.append(memory.ipfsHash).append(previousHash);
+}
 
-    std::string input = ss.str();
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)input.c_str(), input.length(), hash);
+// stakeWeight uses "%g", the default ostream formatting of a double.
+void AhmiyatBlock::hashSuffix(std::string& out) const {
+    char number[64];
+    out.clear();
+    out.append(number, std::snprintf(number, sizeof(number), "%g", stakeWeight));
+    out.append(shardId);
+    appendNumber(out, shardMapVersion);
+    out.append(stateRoot);
+    for (const auto& receipt : outgoingReceipts) out.append(receipt.id);
+    for (const auto& receipt : incomingReceipts) out.append(receipt.id);
+    out.append(shardMapChange);
+}
 
-    std::stringstream hashStream;
-    for (int i = 0; i < SHA256_DIGEST_LENGTH; i++) {
-        hashStream << std::hex << std::setw(2) << std::setfill('0') << (int)hash[i];
-    }
-    return hashStream.str();
+std::string AhmiyatBlock::calculateHash() const {
+    std::string prefix, suffix;
+    hashPrefix(prefix);
+    hashSuffix(suffix);
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, prefix.data(), prefix.size());
+    SHA256_Update(&ctx, memoryProof.data(), memoryProof.size());
+    SHA256_Update(&ctx, suffix.data(), suffix.size());
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_Final(digest, &ctx);
+    std::string hex;
+    appendHex(hex, digest, SHA256_DIGEST_LENGTH);
+    return hex;
 }
 
 bool AhmiyatBlock::isMemoryProofValid(int difficulty) {
@@ -114,34 +303,121 @@ bool AhmiyatBlock::validate() const {
 }
 
 AhmiyatBlock::AhmiyatBlock(int idx, const std::vector<Transaction>& txs, const MemoryFragment& mem, 
-                           std::string prevHash, int diff, double stake, std::string sh) 
-    : index(idx), transactions(txs), memory(mem), previousHash(prevHash), difficulty(diff), 
-      stakeWeight(stake), shardId(sh) {
-    timestamp = std::chrono::system_clock::now().time_since_epoch().count();
-    mineBlock(stake);
-    if (!validate()) throw std::runtime_error("Invalid block created");
+                           std::string prevHash, int diff, double stake, std::string sh,
+                           uint64_t mapVersion,
+                           const std::vector<CrossShardReceipt>& outgoing,
+                           const std::vector<CrossShardReceipt>& incoming,
+                           const std::string& postStateRoot,
+                           const std::string& mapChange,
+                           uint64_t time,
+                           MiningJob* job)
+    : AhmiyatBlock(idx, std::vector<Transaction>(txs), mem, std::move(prevHash), diff, stake, std::move(sh), mapVersion,
+                   outgoing, incoming, postStateRoot, mapChange, time, job) {}
+
+AhmiyatBlock::AhmiyatBlock(int idx, std::vector<Transaction>&& txs, const MemoryFragment& mem,
+                           std::string prevHash, int diff, double stake, std::string sh,
+                           uint64_t mapVersion,
+                           const std::vector<CrossShardReceipt>& outgoing,
+                           const std::vector<CrossShardReceipt>& incoming,
+                           const std::string& postStateRoot,
+                           const std::string& mapChange,
+                           uint64_t time,
+                           MiningJob* job)
+    : index(idx), memory(mem), previousHash(std::move(prevHash)), difficulty(diff),
+      stakeWeight(stake), shardId(std::move(sh)), shardMapVersion(mapVersion), stateRoot(postStateRoot),
+      outgoingReceipts(outgoing), incomingReceipts(incoming), shardMapChange(mapChange) {
+    timestamp = time ? time : std::chrono::system_clock::now().time_since_epoch().count();
+    transactions.swap(txs);
+    try {
+        mineBlock(stake, job);
+        if (!validate()) throw std::runtime_error("Invalid block created");
+    } catch (...) {
+        transactions.swap(txs);
+        throw;
+    }
 }
 
-void AhmiyatBlock::mineBlock(double minerStake) {
-    std::random_device rd;
-    std::mt19937 gen(rd());
-    std::uniform_int_distribution<> dis(0, 255);
+AhmiyatBlock AhmiyatBlock::genesis(const std::vector<Transaction>& txs, const MemoryFragment& mem, int diff,
+                                   uint64_t mapVersion, const std::string& postStateRoot) {
+    AhmiyatBlock block;
+    block.timestamp = GENESIS_TIMESTAMP;
+    block.transactions = txs;
+    block.memory = mem;
+    block.previousHash = "0";
+    block.difficulty = diff;
+    block.shardId = "0";
+    block.shardMapVersion = mapVersion;
+    block.stateRoot = postStateRoot;
+    uint64_t nonce = 0;
+    do {
+        block.memoryProof = std::to_string(nonce++);
+        block.hash = block.calculateHash();
+    } while (!block.isMemoryProofValid(diff));
+    return block;
+}
 
+void AhmiyatBlock::mineBlock(double minerStake, MiningJob* job) {
+    TraceSpan span("mineBlock");
+    if (stakeWeight > 0 && minerStake < stakeWeight) {
+        throw std::runtime_error("Miner stake below block stake weight");
+    }
     int attempts = 0;
     const int maxAttempts = 1000000;
+    auto start = std::chrono::steady_clock::now();
+    auto recordAttempts = [&]() {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        const ShardMiningMetrics& shardMetrics = shardMiningMetrics(shardId);
+        shardMetrics.attempts->inc(attempts);
+        if (job) job->attempts += attempts;
+        if (seconds > 0) shardMetrics.hashRate->set(attempts / seconds);
+    };
+    std::string prefix, suffix;
+    hashPrefix(prefix);
+    hashSuffix(suffix);
+    SHA256_CTX base;
+    SHA256_Init(&base);
+    SHA256_Update(&base, prefix.data(), prefix.size());
+    // Nonces are drawn from a generator seeded by the block's contents, so mining the same block twice gives the same proof.
+    unsigned char seed[SHA256_DIGEST_LENGTH];
+    {
+        SHA256_CTX seeded = base;
+        SHA256_Update(&seeded, suffix.data(), suffix.size());
+        SHA256_Final(seed, &seeded);
+    }
+    uint64_t seedValue;
+    std::memcpy(&seedValue, seed, sizeof(seedValue));
+    std::mt19937_64 gen(seedValue);
+    std::uniform_int_distribution<uint64_t> dis;
+    char nonce[24];
+    char* nonceEnd;
+    unsigned char digest[SHA256_DIGEST_LENGTH];
     do {
-        memoryProof = std::to_string(dis(gen));
-        hash = calculateHash();
+        if (job && (attempts & 0xff) == 0 && job->cancelled) {
+            recordAttempts();
+            throw MiningCancelled();
+        }
+        nonceEnd = std::to_chars(nonce, nonce + sizeof(nonce), dis(gen)).ptr;
+        SHA256_CTX ctx = base;
+        SHA256_Update(&ctx, nonce, nonceEnd - nonce);
+        SHA256_Update(&ctx, suffix.data(), suffix.size());
+        SHA256_Final(digest, &ctx);
         attempts++;
-        if (attempts > maxAttempts) throw std::runtime_error("Mining failed: too many attempts");
-    } while (!isMemoryProofValid(difficulty) || (minerStake < stakeWeight && stakeWeight > 0));
+        if (attempts > maxAttempts) {
+            recordAttempts();
+            throw std::runtime_error("Mining failed: too many attempts");
+        }
+    } while (!hasLeadingZeroNibbles(digest, difficulty));
+    memoryProof.assign(nonce, nonceEnd);
+    hash.clear();
+    appendHex(hash, digest, SHA256_DIGEST_LENGTH);
+    recordAttempts();
     log("Block mined in shard " + shardId + " - Hash: " + hash.substr(0, 16));
 }
 
-std::string AhmiyatBlock::getHash() const { return hash; }
-std::string AhmiyatBlock::getPreviousHash() const { return previousHash; }
+const std::string& AhmiyatBlock::getHash() const { return hash; }
+const std::string& AhmiyatBlock::getPreviousHash() const { return previousHash; }
 double AhmiyatBlock::getStakeWeight() const { return stakeWeight; }
-std::string AhmiyatBlock::getShardId() const { return shardId; }
+const std::string& AhmiyatBlock::getShardId() const { return shardId; }
 const std::vector<Transaction>& AhmiyatBlock::getTransactions() const { return transactions; }
 
 std::string AhmiyatBlock::serialize() const {
@@ -157,22 +433,190 @@ std::string AhmiyatBlock::serialize() const {
     return ss.str();
 }
 
-std::string ShardManager::assignShard(const Transaction& tx, int maxShards) {
-    std::lock_guard<std::mutex> lock(loadMutex);
-    unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)tx.sender.c_str(), tx.sender.length(), hash);
-    std::string shardId = std::to_string(hash[0] % maxShards);
-    
-    if (shardLoads[shardId] > 1000) {
-        for (int i = 0; i < maxShards; i++) {
-            std::string altShard = std::to_string(i);
-            if (shardLoads[altShard] < shardLoads[shardId]) {
-                shardId = altShard;
-                break;
-            }
+std::string AhmiyatBlock::encode() const {
+    std::string record;
+    record.reserve(256 + transactions.size() * 256);
+    ByteWriter writer(record);
+    encodeHead(writer);
+    writer.putU32(static_cast<uint32_t>(transactions.size()));
+    for (const auto& tx : transactions) tx.encode(writer);
+    encodeTail(writer);
+    return record;
+}
+
+void AhmiyatBlock::encodeHead(ByteWriter& writer) const {
+    writer.putU8(BLOCK_RECORD_VERSION);
+    writer.putU64(static_cast<uint64_t>(index));
+    writer.putU64(timestamp);
+    writer.putU32(static_cast<uint32_t>(difficulty));
+    writer.putF64(stakeWeight);
+    writer.putBytes(shardId);
+    writer.putU64(shardMapVersion);
+    writer.putBytes(stateRoot);
+    writer.putBytes(previousHash);
+    writer.putBytes(hash);
+    writer.putBytes(memoryProof);
+    writer.putBytes(memory.type);
+    writer.putBytes(memory.filePath);
+    writer.putBytes(memory.ipfsHash);
+    writer.putBytes(memory.description);
+    writer.putBytes(memory.owner);
+    writer.putU32(static_cast<uint32_t>(memory.lockTime));
+}
+
+void AhmiyatBlock::encodeTail(ByteWriter& writer) const {
+    writer.putU32(static_cast<uint32_t>(outgoingReceipts.size()));
+    for (const auto& receipt : outgoingReceipts) receipt.encode(writer);
+    writer.putU32(static_cast<uint32_t>(incomingReceipts.size()));
+    for (const auto& receipt : incomingReceipts) receipt.encode(writer);
+    writer.putBytes(shardMapChange);
+}
+
+AhmiyatBlock AhmiyatBlock::decode(const std::string& record) {
+    ByteReader reader(record);
+    uint8_t version = reader.getU8();
+    if (version < 1 || version > BLOCK_RECORD_VERSION) throw std::runtime_error("Unsupported block record version");
+    AhmiyatBlock block;
+    block.index = static_cast<int>(reader.getU64());
+    block.timestamp = reader.getU64();
+    block.difficulty = static_cast<int>(reader.getU32());
+    block.stakeWeight = reader.getF64();
+    block.shardId = reader.getBytes();
+    block.shardMapVersion = version >= 3 ? reader.getU64() : 1;
+    if (version >= 5) block.stateRoot = reader.getBytes();
+    block.previousHash = reader.getBytes();
+    block.hash = reader.getBytes();
+    block.memoryProof = reader.getBytes();
+    block.memory.type = reader.getBytes();
+    block.memory.filePath = reader.getBytes();
+    block.memory.ipfsHash = reader.getBytes();
+    block.memory.description = reader.getBytes();
+    block.memory.owner = reader.getBytes();
+    block.memory.lockTime = static_cast<int>(reader.getU32());
+    uint32_t txCount = reader.getU32();
+    if (txCount > reader.remaining()) throw std::runtime_error("Corrupt block record");
+    block.transactions.reserve(txCount);
+    for (uint32_t i = 0; i < txCount; i++) block.transactions.push_back(Transaction::decode(reader, version >= 4));
+    if (version >= 2) {
+        for (auto* receipts : {&block.outgoingReceipts, &block.incomingReceipts}) {
+            uint32_t count = reader.getU32();
+            if (count > reader.remaining()) throw std::runtime_error("Corrupt block record");
+            receipts->reserve(count);
+            for (uint32_t i = 0; i < count; i++) receipts->push_back(CrossShardReceipt::decode(reader, version >= 6));
         }
     }
-    return shardId;
+    if (version >= 7) block.shardMapChange = reader.getBytes();
+    return block;
+}
+
+CompactBlock::CompactBlock(const AhmiyatBlock& block) {
+    for (const auto& tx : block.transactions) txs.push(tx);
+    shell.index = block.index;
+    shell.timestamp = block.timestamp;
+    shell.memory = block.memory;
+    shell.previousHash = block.previousHash;
+    shell.hash = block.hash;
+    shell.difficulty = block.difficulty;
+    shell.memoryProof = block.memoryProof;
+    shell.stakeWeight = block.stakeWeight;
+    shell.shardId = block.shardId;
+    shell.shardMapVersion = block.shardMapVersion;
+    shell.stateRoot = block.stateRoot;
+    shell.outgoingReceipts = block.outgoingReceipts;
+    shell.incomingReceipts = block.incomingReceipts;
+    shell.shardMapChange = block.shardMapChange;
+    shellBytes = shell.encode().size();
+}
+
+AhmiyatBlock CompactBlock::expand() const {
+    AhmiyatBlock block = shell;
+    block.transactions = txs.unpackAll();
+    return block;
+}
+
+std::string CompactBlock::encode() const {
+    std::string record, scratch;
+    record.reserve(shellBytes + txs.size() * 256);
+    ByteWriter writer(record);
+    shell.encodeHead(writer);
+    writer.putU32(static_cast<uint32_t>(txs.size()));
+    for (size_t i = 0; i < txs.size(); i++) txs.encode(i, writer, scratch);
+    shell.encodeTail(writer);
+    return record;
+}
+
+// Same preimage as AhmiyatBlock::hashPrefix, memoryProof and hashSuffix.
+std::string CompactBlock::calculateHash() const {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    std::string prefix, suffix, scratch;
+    char shard[8];
+    prefix.reserve(48 + txs.size() * 2 * SHA256_DIGEST_LENGTH + shell.memory.ipfsHash.size() +
+                   shell.previousHash.size());
+    appendNumber(prefix, shell.index);
+    appendNumber(prefix, shell.timestamp);
+    const AddressDictionary& addresses = txs.addresses();
+    for (size_t i = 0; i < txs.size(); i++) {
+        const CompactTx& tx = txs[i];
+        std::string_view shardId(shard, std::to_chars(shard, shard + sizeof(shard), tx.shard).ptr - shard);
+        txMessageHash(addresses.lookup(tx.sender), addresses.lookup(tx.receiver), tx.amount, tx.fee, tx.script,
+                      shardId, tx.timestamp, digest, scratch);
+        appendHex(prefix, digest, SHA256_DIGEST_LENGTH);
+        txs.appendWitness(i, prefix);
+    }
+    prefix.append(shell.memory.ipfsHash).append(shell.previousHash);
+    shell.hashSuffix(suffix);
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, prefix.data(), prefix.size());
+    SHA256_Update(&ctx, shell.memoryProof.data(), shell.memoryProof.size());
+    SHA256_Update(&ctx, suffix.data(), suffix.size());
+    SHA256_Final(digest, &ctx);
+    std::string hex;
+    appendHex(hex, digest, SHA256_DIGEST_LENGTH);
+    return hex;
+}
+
+std::string AhmiyatBlock::toJson() const {
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    ss << "{\"shard\":\"" << shardId << "\",\"height\":" << index << ",\"hash\":\"" << hash
+       << "\",\"previousHash\":\"" << previousHash << "\",\"timestamp\":" << timestamp
+       << ",\"difficulty\":" << difficulty << ",\"stakeWeight\":" << stakeWeight
+       << ",\"shardMapVersion\":" << shardMapVersion << ",\"stateRoot\":\"" << stateRoot
+       << "\",\"memory\":{\"type\":\"" << memory.type << "\",\"ipfsHash\":\"" << memory.ipfsHash
+       << "\",\"owner\":\"" << memory.owner << "\",\"lockTime\":" << memory.lockTime << "},\"transactions\":[";
+    for (size_t i = 0; i < transactions.size(); i++) {
+        const Transaction& tx = transactions[i];
+        ss << (i ? "," : "") << "{\"hash\":\"" << tx.getHash() << "\",\"sender\":\"" << tx.sender
+           << "\",\"receiver\":\"" << tx.receiver << "\",\"amount\":" << tx.amount << ",\"fee\":" << tx.fee
+           << ",\"timestamp\":" << tx.timestamp << "}";
+    }
+    ss << "],\"outgoingReceipts\":" << outgoingReceipts.size() << ",\"incomingReceipts\":" << incomingReceipts.size()
+       << "}";
+    return ss.str();
+}
+
+BlockHeader AhmiyatBlock::header() const {
+    BlockHeader h;
+    h.hash = hexToHash(hash);
+    h.previousHash = hexToHash(previousHash);
+    h.height = static_cast<uint64_t>(index);
+    h.timestamp = timestamp;
+    h.difficulty = difficulty;
+    h.stakeWeight = stakeWeight;
+    h.shardMapVersion = shardMapVersion;
+    h.stateRoot = hexToHash(stateRoot);
+    return h;
+}
+
+ShardManager::ShardManager() : shardMap(std::make_shared<const ShardMap>()) {}
+
+std::string ShardManager::homeShard(const std::string& address) {
+    return currentMap()->lookup(address);
+}
+
+std::string ShardManager::assignShard(const Transaction& tx) {
+    return homeShard(tx.sender);
 }
 
 void ShardManager::updateLoad(const std::string& shardId, int txCount) {
@@ -180,7 +624,26 @@ void ShardManager::updateLoad(const std::string& shardId, int txCount) {
     shardLoads[shardId] += txCount;
 }
 
-AhmiyatChain::AhmiyatChain() {
+std::unordered_map<std::string, int> ShardManager::takeLoads() {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    std::unordered_map<std::string, int> loads;
+    loads.swap(shardLoads);
+    return loads;
+}
+
+std::shared_ptr<const ShardMap> ShardManager::currentMap() {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    return shardMap;
+}
+
+void ShardManager::installMap(std::shared_ptr<const ShardMap> map) {
+    std::lock_guard<std::mutex> lock(loadMutex);
+    shardMap = std::move(map);
+}
+
+AhmiyatChain::AhmiyatChain(const std::string& dbPath)
+    : clock([]() { return static_cast<uint64_t>(std::chrono::system_clock::now().time_since_epoch().count()); }),
+      blockCache(BLOCK_CACHE_BYTES), snapshots(MAX_SHARDS), executor(miningScheduler.getSlots()) {
     keyPair = EC_KEY_new_by_curve_name(NID_secp256k1);
     if (!EC_KEY_generate_key(keyPair)) {
         log("Failed to generate ECDSA key pair");
@@ -191,23 +654,32 @@ AhmiyatChain::AhmiyatChain() {
     options.create_if_missing = true;
     options.write_buffer_size = 64 * 1024 * 1024;
     options.compression = leveldb::kSnappyCompression;
-    leveldb::Status status = leveldb::DB::Open(options, "ahmiyat_db", &db);
+    leveldb::Status status = leveldb::DB::Open(options, dbPath, &db);
     if (!status.ok()) {
         log("Failed to open LevelDB: " + status.ToString());
         exit(1);
     }
+    history.attach(db);
 
     shardDifficulties["0"] = INITIAL_DIFFICULTY;
-    if (shards["0"].empty()) {
-        std::vector<Transaction> genesisTx = {Transaction("system", "genesis", 100.0)};
-        genesisTx[0].signature = signTransaction(genesisTx[0]);
+    // A stored chain is loaded by replaying it (see restoreChain), not rebuilt here.
+    std::string genesisHash;
+    if (!db->Get(leveldb::ReadOptions(), heightKey("0", 0), &genesisHash).ok()) {
+        Transaction genesisTx("system", "genesis", 100.0);
+        genesisTx.timestamp = GENESIS_TIMESTAMP;
+        genesisTx.signature = "genesis";
         MemoryFragment genesisMemory("text", "memories/genesis.txt", "The beginning of Ahmiyat", "system", 0);
-        AhmiyatBlock genesisBlock(0, genesisTx, genesisMemory, "0", INITIAL_DIFFICULTY, 0.0, "0");
-        shards["0"].push_back(genesisBlock);
-        saveBlockToDB(genesisBlock);
+        Hash256 genesisRoot = stateTrees["0"].previewRoot({{"genesis", 100.0}});
+        auto genesisBlock = std::make_shared<const AhmiyatBlock>(AhmiyatBlock::genesis(
+            {genesisTx}, genesisMemory, INITIAL_DIFFICULTY, shardManager.currentMap()->getVersion(), hashToHex(genesisRoot)));
+        std::string record = genesisBlock->encode();
+        appendHeader(*genesisBlock);
+        saveBlockToDB(*genesisBlock, record, std::vector<bool>(genesisBlock->getTransactions().size(), true), {});
+        blockCache.put(genesisBlock->getHash(), *genesisBlock);
         shardBalances["0"]["genesis"] = 100.0;
         shardStakes["0"]["genesis"] = 0.0;
         totalMined += 100.0;
+        publishSnapshot("0", {"genesis"});
     }
 }
 
@@ -219,13 +691,24 @@ AhmiyatChain::~AhmiyatChain() {
     delete db;
 }
 
-void AhmiyatChain::broadcastBlock(const AhmiyatBlock& block, const Node& sender) {
-    std::string blockData = block.serialize();
+void AhmiyatChain::broadcastBlock(const AhmiyatBlock& block, const std::string& record, const std::string& fromPeer) {
+    ScopedTimer timer(broadcastLatency);
+    TraceSpan span("broadcastBlock");
+    if (transport) {
+        transport->broadcast(record, fromPeer);
+        return;
+    }
+    if (nodes.empty()) return;
+    const Node& sender = nodes[0];
+    bool sampled = TraceContext::active();
+    int64_t height = TraceContext::height();
     std::vector<Node> peers = dht.findPeers(sender.nodeId, 10);
     std::vector<std::thread> broadcastThreads;
     for (const auto& node : peers) {
-        if (node.nodeId != sender.nodeId) {
+        if (node.nodeId != sender.nodeId && node.nodeId != fromPeer) {
             broadcastThreads.emplace_back([&, node]() {
+                TraceContext trace(sampled, block.getShardId(), height);
+                TraceSpan sendSpan("sendBlock");
                 try {
                     int sock = socket(AF_INET, SOCK_STREAM, 0);
                     if (sock < 0) throw std::runtime_error("Socket creation failed");
@@ -238,7 +721,12 @@ void AhmiyatChain::broadcastBlock(const AhmiyatBlock& block, const Node& sender)
                     }
 
                     if (connect(sock, (sockaddr*)&addr, sizeof(addr)) == 0) {
-                        send(sock, blockData.c_str(), blockData.length(), 0);
+                        size_t sent = 0;
+                        while (sent < record.size()) {
+                            ssize_t n = send(sock, record.data() + sent, record.size() - sent, 0);
+                            if (n <= 0) break;
+                            sent += n;
+                        }
                         log("Broadcast to " + node.nodeId + " in shard " + block.getShardId());
                     }
                     close(sock);
@@ -250,65 +738,240 @@ void AhmiyatChain::broadcastBlock(const AhmiyatBlock& block, const Node& sender)
     }
     for (auto& t : broadcastThreads) t.join();
 }
-
+void AhmiyatChain::setTransport(std::shared_ptr<Transport> replacement) {
+    transport = replacement;
+}
+void AhmiyatChain::setClock(std::function<uint64_t()> replacement) {
+    clock = std::move(replacement);
+}
+uint64_t AhmiyatChain::currentTime() const {
+    return clock();
+}
+void AhmiyatChain::setSigningKey(const std::string& secret) {
+    unsigned char seed[SHA256_DIGEST_LENGTH];
+    SHA256(reinterpret_cast<const unsigned char*>(secret.data()), secret.size(), seed);
+    const EC_GROUP* group = EC_KEY_get0_group(keyPair);
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* priv = BN_bin2bn(seed, sizeof(seed), nullptr);
+    EC_POINT* pub = EC_POINT_new(group);
+    bool ok = ctx && priv && pub && BN_mod(priv, priv, EC_GROUP_get0_order(group), ctx) && !BN_is_zero(priv) &&
+              EC_POINT_mul(group, pub, priv, nullptr, nullptr, ctx) && EC_KEY_set_private_key(keyPair, priv) &&
+              EC_KEY_set_public_key(keyPair, pub);
+    EC_POINT_free(pub);
+    BN_clear_free(priv);
+    BN_CTX_free(ctx);
+    if (!ok) throw std::runtime_error("Failed to derive signing key");
+}
+// The nonce is derived from the key and the message, as RFC 6979 does, so a
+// tx signed twice gets the same signature and no signature depends on a
+// random source.
 std::string AhmiyatChain::signTransaction(const Transaction& tx) {
     unsigned char hash[SHA256_DIGEST_LENGTH];
-    SHA256((unsigned char*)tx.toString().c_str(), tx.toString().length(), hash);
-
-    unsigned char signature[1024];
-    unsigned int sigLen = 0;
-    if (!ECDSA_sign(0, hash, SHA256_DIGEST_LENGTH, signature, &sigLen, keyPair)) {
-        throw std::runtime_error("Failed to sign transaction");
-    }
+    tx.messageHash(hash);
 
-    std::stringstream sigStream;
-    for (unsigned int i = 0; i < sigLen; i++) {
-        sigStream << std::hex << std::setw(2) << std::setfill('0') << (int)signature[i];
+    const EC_GROUP* group = EC_KEY_get0_group(keyPair);
+    const BIGNUM* order = EC_GROUP_get0_order(group);
+    unsigned char secret[32], nonce[SHA256_DIGEST_LENGTH];
+    unsigned int nonceLen = 0;
+    BN_CTX* ctx = BN_CTX_new();
+    BIGNUM* k = BN_new();
+    BIGNUM* x = BN_new();
+    BIGNUM* r = BN_new();
+    BIGNUM* kinv = nullptr;
+    EC_POINT* point = EC_POINT_new(group);
+    ECDSA_SIG* sig = nullptr;
+    bool ok = ctx && k && x && r && point && BN_bn2binpad(EC_KEY_get0_private_key(keyPair), secret, sizeof(secret)) > 0;
+    for (unsigned char counter = 0; ok && !sig; counter++) {
+        // A zero k or r is astronomically unlikely; the counter moves past it.
+        unsigned char message[SHA256_DIGEST_LENGTH + 1];
+        std::memcpy(message, hash, SHA256_DIGEST_LENGTH);
+        message[SHA256_DIGEST_LENGTH] = counter;
+        ok = HMAC(EVP_sha256(), secret, sizeof(secret), message, sizeof(message), nonce, &nonceLen) &&
+             BN_bin2bn(nonce, nonceLen, k) && BN_mod(k, k, order, ctx);
+        if (!ok || BN_is_zero(k)) continue;
+        ok = EC_POINT_mul(group, point, k, nullptr, nullptr, ctx) &&
+             EC_POINT_get_affine_coordinates(group, point, x, nullptr, ctx) && BN_nnmod(r, x, order, ctx);
+        if (!ok || BN_is_zero(r)) continue;
+        BN_clear_free(kinv);
+        kinv = BN_mod_inverse(nullptr, k, order, ctx);
+        ok = kinv != nullptr;
+        if (ok) sig = ECDSA_do_sign_ex(hash, SHA256_DIGEST_LENGTH, kinv, r, keyPair);
+        ok = ok && sig;
     }
-    return sigStream.str();
+    OPENSSL_cleanse(secret, sizeof(secret));
+    BN_clear_free(kinv);
+    EC_POINT_free(point);
+    BN_free(r);
+    BN_free(x);
+    BN_clear_free(k);
+    BN_CTX_free(ctx);
+    unsigned char* der = nullptr;
+    int derLen = sig ? i2d_ECDSA_SIG(sig, &der) : 0;
+    ECDSA_SIG_free(sig);
+    if (derLen <= 0) throw std::runtime_error("Failed to sign transaction");
+    std::string signature;
+    appendHex(signature, der, derLen);
+    OPENSSL_free(der);
+    return signature;
 }
 
-void AhmiyatChain::saveBlockToDB(const AhmiyatBlock& block) {
+void AhmiyatChain::saveBlockToDB(const AhmiyatBlock& block, const std::string& record,
+                                 const std::vector<bool>& applied, const std::vector<bool>& credited) {
+    TraceSpan span("saveBlockToDB");
     leveldb::WriteBatch batch;
-    batch.Put(block.getHash(), block.serialize());
+    batch.Put(blockKey(block.getHash()), record);
+    batch.Put(heightKey(block.getShardId(), static_cast<uint64_t>(block.getIndex())), block.getHash());
+    HistoryIndex::indexBlock(batch, block, applied, credited, *shardManager.currentMap());
     leveldb::WriteOptions options;
     options.sync = false;
-    leveldb::Status status = db->Write(options, &batch);
+    leveldb::Status status;
+    {
+        ScopedTimer timer(dbWriteLatency);
+        status = db->Write(options, &batch);
+    }
     if (!status.ok()) {
         log("Error saving block to DB: " + status.ToString());
         throw std::runtime_error("DB write failed");
     }
 }
 
-void AhmiyatChain::loadChainFromDB() {
-    leveldb::Iterator* it = db->NewIterator(leveldb::ReadOptions());
-    for (it->SeekToFirst(); it->Valid(); it->Next()) {
-        log("Loaded block from DB: " + it->key().ToString());
+ImportResult AhmiyatChain::importBlock(const std::string& record, const std::string& fromPeer) {
+    TraceSpan span("importBlock");
+    std::shared_ptr<const AhmiyatBlock> block;
+    try {
+        block = std::make_shared<const AhmiyatBlock>(AhmiyatBlock::decode(record));
+    } catch (const std::exception& e) {
+        log("Undecodable block from " + (fromPeer.empty() ? std::string("peer") : fromPeer) + ": " + e.what());
     }
-    if (!it->status().ok()) {
-        log("DB read error: " + it->status().ToString());
+    bool wellFormed = block && block->validate();
+    ImportResult result = ImportResult::Invalid;
+    BlockExecution execution;
+    {
+        TimedLock lock(chainMutex, chainLockWait);
+        BlockLocation location;
+        if (wellFormed) {
+            const std::string& shardId = block->getShardId();
+            BlockHeader parent;
+            bool hasParent = blockIndex.tip(shardId, parent);
+            std::string tip = hasParent ? hashToHex(parent.hash) : "0";
+            const std::string& prevHash = block->getPreviousHash();
+            if (blockIndex.find(hexToHash(block->getHash()), location)) {
+                result = ImportResult::Duplicate;
+            } else if (prevHash != tip || static_cast<uint64_t>(block->getIndex()) != blockIndex.height(shardId)) {
+                bool knownParent = prevHash == "0" || blockIndex.find(hexToHash(prevHash), location);
+                result = knownParent ? ImportResult::Fork : ImportResult::Orphan;
+            } else if (block->getShardMapVersion() == shardManager.currentMap()->getVersion()) {
+                std::shared_ptr<const ShardMap> map = shardManager.currentMap();
+                // Scripts run at the block's time, so it may neither go back nor run ahead of us.
+                uint64_t now = blockSeconds(currentTime());
+                bool rejected = (hasParent && block->getTimestamp() < parent.timestamp) ||
+                                blockSeconds(block->getTimestamp()) > now + MAX_FUTURE_BLOCK_SECONDS;
+                // Blocks are held to this node's difficulty, or the retarget rule applied to their
+                // parent, and to its stake records, not their own claims.
+                int difficulty = block->getDifficulty();
+                rejected |= (difficulty != shardDifficulties[shardId] &&
+                             (!hasParent || difficulty != retargetedDifficulty(shardId))) ||
+                            block->getStakeWeight() > bondedStake(shardId, block->getMemory().owner) ||
+                            !knownReceipts(shardId, block->getIncomingReceipts(), *map);
+                // Only shard 0 blocks carry map changes, and only forward ones.
+                if (!block->getShardMapChange().empty()) {
+                    try {
+                        rejected |= shardId != "0" ||
+                                    ShardMap::decode(block->getShardMapChange()).getVersion() <= map->getVersion();
+                    } catch (const std::exception&) {
+                        rejected = true;
+                    }
+                }
+                for (const auto& tx : block->getTransactions()) {
+                    // Producers leave txs of other shards' senders out of the block.
+                    rejected |= isCommitted(shardId, tx.signature) || map->lookup(tx.sender) != shardId;
+                }
+                // The memory fragment's owner is the miner that collected the reward.
+                if (!rejected) {
+                    execution = executeBlock(shardId, block->getTransactions(), block->getMemory().owner,
+                                             block->getStakeWeight(), block->getTimestamp(), &block->getIncomingReceipts());
+                }
+                bool sameReceipts = execution.outgoing.size() == block->getOutgoingReceipts().size();
+                for (size_t i = 0; sameReceipts && i < execution.outgoing.size(); i++) {
+                    sameReceipts = execution.outgoing[i].id == block->getOutgoingReceipts()[i].id;
+                }
+                if (!rejected && sameReceipts && hashToHex(execution.stateRoot) == block->getStateRoot() &&
+                    commitBlock(block, record, execution)) {
+                    result = ImportResult::Imported;
+                }
+            }
+        }
+        switch (result) {
+            case ImportResult::Imported: importStats.imported++; break;
+            case ImportResult::Duplicate: importStats.duplicates++; break;
+            case ImportResult::Orphan: importStats.orphans++; break;
+            case ImportResult::Fork: importStats.forks++; break;
+            case ImportResult::Invalid: importStats.invalid++; break;
+        }
+    }
+    if (result != ImportResult::Imported) {
+        if (result != ImportResult::Duplicate && block) {
+            log("Block " + block->getHash().substr(0, 16) + " from shard " + block->getShardId() + " not imported");
+        }
+        return result;
     }
-    delete it;
+    blocksCommitted.inc();
+    if (commitListener) commitListener(block->getShardId(), block->getTransactions(), execution.applied);
+    updateReward(block->getShardId());
+    broadcastBlock(*block, record, fromPeer);
+    reshard();
+    return result;
+}
+double AhmiyatChain::bondedStake(const std::string& shardId, const std::string& minerId) {
+    auto stakes = shardStakes.find(shardId);
+    if (stakes == shardStakes.end()) return 0.0;
+    auto it = stakes->second.find(minerId);
+    return it != stakes->second.end() ? it->second : 0.0;
 }
 
-void AhmiyatChain::syncChain(const std::string& blockData) {
-    try {
-        std::string shardId = blockData.substr(blockData.rfind("|") + 1);
-        std::string hash = blockData.substr(blockData.rfind("|", blockData.rfind("|") - 1) + 1, 
-                                          blockData.rfind("|") - blockData.rfind("|", blockData.rfind("|") - 1) - 1);
-        std::lock_guard<std::mutex> lock(chainMutex);
-        if (std::find_if(shards[shardId].begin(), shards[shardId].end(), 
-                        [&](const AhmiyatBlock& b) { return b.getHash() == hash; }) == shards[shardId].end()) {
-            log("Synced new block in shard " + shardId + ": " + hash);
-        }
-    } catch (const std::exception& e) {
-        log("Sync failed: " + std::string(e.what()));
+// An imported block may only credit receipts this node knows the source
+// debited: ones waiting in the shard's inbox, or ones in the outgoing list
+// of a stored source block for a receiver that now lives here. The store is
+// asked rather than the block index so replay can check a shard's receipts
+// before the source shard has been replayed.
+bool AhmiyatChain::knownReceipts(const std::string& shardId, const std::vector<CrossShardReceipt>& incoming,
+                                 const ShardMap& map) {
+    if (incoming.size() > MAX_RECEIPTS_PER_BLOCK) return false;
+    std::vector<ReceiptStatus> status = receiptRouter.status(shardId, incoming);
+    std::unordered_set<std::string> seen;
+    for (size_t i = 0; i < incoming.size(); i++) {
+        const CrossShardReceipt& receipt = incoming[i];
+        if (!seen.insert(receipt.id).second || status[i] == ReceiptStatus::Settled) return false;
+        if (status[i] == ReceiptStatus::Pending) continue;
+        if (map.lookup(receipt.receiver) != shardId || !sentBySource(receipt)) return false;
     }
+    return true;
 }
 
+bool AhmiyatChain::sentBySource(const CrossShardReceipt& receipt) {
+    std::string hash;
+    if (!db->Get(leveldb::ReadOptions(), heightKey(receipt.fromShard, receipt.sourceHeight), &hash).ok()) return false;
+    auto source = getBlock(hash);
+    if (!source) return false;
+    const auto& outgoing = source->getOutgoingReceipts();
+    return std::any_of(outgoing.begin(), outgoing.end(), [&](const CrossShardReceipt& sent) { return sent.matches(receipt); });
+}
+
+ImportStats AhmiyatChain::getImportStats() {
+    TimedLock lock(chainMutex, chainLockWait);
+    return importStats;
+}
+std::string AhmiyatChain::getMiningStatus() {
+    return miningScheduler.toJson();
+}
+void AhmiyatChain::setShardDifficulty(const std::string& shardId, int difficulty) {
+    TimedLock lock(chainMutex, chainLockWait);
+    shardDifficulties[shardId] = difficulty;
+}
 void AhmiyatChain::updateReward(std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (shards[shardId].size() % HALVING_INTERVAL == 0 && shards[shardId].size() > 0) {
+    TimedLock lock(chainMutex, chainLockWait);
+    uint64_t height = blockIndex.height(shardId);
+    if (height % HALVING_INTERVAL == 0 && height > 0) {
         blockReward /= 2;
         stakingReward *= 1.05;
         log("Shard " + shardId + ": Block reward halved to: " + std::to_string(blockReward));
@@ -316,118 +979,695 @@ void AhmiyatChain::updateReward(std::string shardId) {
 }
 
 bool AhmiyatChain::validateBlock(const AhmiyatBlock& block) {
+    TraceSpan span("validateBlock");
     std::string shardId = block.getShardId();
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (shards[shardId].empty() && block.getPreviousHash() != "0") return false;
-    if (!shards[shardId].empty() && block.getPreviousHash() != shards[shardId].back().getHash()) return false;
+    TimedLock lock(chainMutex, chainLockWait);
+    BlockHeader parent;
+    bool hasParent = blockIndex.tip(shardId, parent);
+    if (!hasParent && block.getPreviousHash() != "0") return false;
+    if (hasParent && hexToHash(block.getPreviousHash()) != parent.hash) return false;
     if (!block.validate()) return false;
     for (const auto& tx : block.getTransactions()) {
-        if (processedTxs.count(tx.signature)) return false;
+        if (isCommitted(shardId, tx.signature)) return false;
         if (!tx.validate()) return false;
     }
     return true;
 }
 
 void AhmiyatChain::compressState(std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    std::stringstream ss;
-    for (const auto& [addr, bal] : shardBalances[shardId]) {
-        ss << addr << bal;
-    }
-    std::string proof = generateZKProof(ss.str());
+    TraceSpan span("compressState");
+    TimedLock lock(chainMutex, chainLockWait);
+    std::string proof = generateZKProof(hashToHex(stateTrees[shardId].rootHash()));
     log("Shard " + shardId + " state compressed with ZKP: " + proof.substr(0, 16));
 }
 
 std::string AhmiyatChain::assignShard(const Transaction& tx) {
-    return shardManager.assignShard(tx, MAX_SHARDS);
+    return shardManager.assignShard(tx);
 }
 
 void AhmiyatChain::processPendingTxs() {
     std::vector<Transaction> batch;
+    double stake = 0.0;
     {
-        std::lock_guard<std::mutex> lock(chainMutex);
-        while (!pendingTxs.empty()) {
-            batch.push_back(pendingTxs.front());
-            pendingTxs.pop();
-        }
+        TimedLock lock(chainMutex, chainLockWait);
+        CompactTxBatch drained = std::move(pendingTxs);
+        pendingTxs = CompactTxBatch();
+        pendingSignatures.clear();
+        mempoolDepth.set(0);
+        mempoolBytes.set(0);
+        if (drained.empty()) return;
+        batch = drained.unpackAll();
+        stake = shardStakes[batch.front().shardId][batch.front().sender];
     }
-    for (const auto& tx : batch) {
-        try {
-            std::vector<Transaction> txs = {tx};
-            MemoryFragment mem("text", "memories/pending_" + tx.getHash() + ".txt", "Pending tx", tx.sender, 0);
-            addBlock(txs, mem, tx.sender, shardStakes[tx.shardId][tx.sender]);
-        } catch (const std::exception& e) {
-            log("Failed to process tx " + tx.getHash() + ": " + e.what());
-        }
+    size_t count = batch.size();
+    try {
+        const std::string minerId = batch.front().sender;
+        MemoryFragment mem("text", "memories/pending_" + batch.front().getHash() + ".txt", "Pending txs", minerId, 0);
+        addBlock(std::move(batch), mem, minerId, stake);
+    } catch (const std::exception& e) {
+        log("Failed to process " + std::to_string(count) + " pending txs: " + e.what());
     }
 }
 
-void AhmiyatChain::addBlock(const std::vector<Transaction>& txs, const MemoryFragment& memory, std::string minerId, double stake) {
+void AhmiyatChain::setCommitListener(CommitListener listener) {
+    commitListener = listener;
+}
+
+void AhmiyatChain::addBlock(std::vector<Transaction> txs, const MemoryFragment& memory, std::string minerId, double stake) {
     if (totalMined + blockReward > MAX_SUPPLY) {
         log("Max supply reached, no more mining rewards");
         return;
     }
 
     std::unordered_map<std::string, std::vector<Transaction>> shardTxs;
-    for (auto tx : txs) {
+    {
+        TimedLock lock(chainMutex, chainLockWait);
+        txs.erase(std::remove_if(txs.begin(), txs.end(),
+                                 [&](const Transaction& tx) { return isCommitted(assignShard(tx), tx.signature); }),
+                  txs.end());
+    }
+    for (auto& tx : txs) {
         try {
             if (!tx.validate()) continue;
             std::string shardId = assignShard(tx);
             tx.shardId = shardId;
-            if (processedTxs.count(tx.signature)) continue;
             tx.signature = signTransaction(tx);
-            processedTxs.insert(tx.signature);
-            shardTxs[shardId].push_back(tx);
-            shardManager.updateLoad(shardId, 1);
+            shardTxs[shardId].push_back(std::move(tx));
         } catch (const std::exception& e) {
             log("Invalid tx: " + std::string(e.what()));
         }
     }
+    for (const auto& shardId : receiptRouter.shardsWithPending()) shardTxs[shardId];
+    {
+        // A pending map needs a shard 0 block, and each reshaped shard a block to migrate balances.
+        TimedLock lock(chainMutex, chainLockWait);
+        if (proposedShardMap) shardTxs["0"];
+        for (const auto& shardId : migratingShards) shardTxs[shardId];
+    }
 
     std::vector<std::thread> blockThreads;
     for (auto& [shardId, txsInShard] : shardTxs) {
-        blockThreads.emplace_back([&, shardId, txsInShard]() {
+        blockThreads.emplace_back([&, shardId = shardId, batch = std::move(txsInShard)]() mutable {
+            produceBlock(shardId, std::move(batch), memory, minerId, stake);
+        });
+    }
+    for (auto& t : blockThreads) t.join();
+    reshard();
+}
+
+// Mines one block for shardId on the current tip. If the job is cancelled or
+// the tip moves before commit, drops the txs a competing block already
+// included and retries on the new tip. Txs whose sender lives in another
+// shard are left out of the block and go back to the mempool once it commits.
+void AhmiyatChain::produceBlock(const std::string& shardId, std::vector<Transaction> txs, const MemoryFragment& memory,
+                                const std::string& minerId, double stake) {
+    std::vector<Transaction> misrouted;
+    // chainMutex held.
+    auto requeue = [&](std::vector<Transaction>& back) {
+        for (const auto& tx : back) {
+            if (pendingTxs.size() >= MAX_MEMPOOL_TXS) {
+                mempoolFull.inc();
+                continue;
+            }
             try {
-                AhmiyatBlock newBlock(shards[shardId].size(), txsInShard, memory, 
-                                      shards[shardId].empty() ? "0" : shards[shardId].back().getHash(), 
-                                      shardDifficulties[shardId], stake, shardId);
-                if (!validateBlock(newBlock)) {
-                    log("Invalid block rejected in shard " + shardId);
-                    return;
-                }
-                {
-                    std::lock_guard<std::mutex> lock(chainMutex);
-                    shards[shardId].push_back(newBlock);
-                    saveBlockToDB(newBlock);
+                queuePending(tx, tx.signature);
+            } catch (const std::exception& e) {
+                log("Pending tx rejected: " + std::string(e.what()));
+            }
+        }
+        back.clear();
+        mempoolDepth.set(pendingTxs.size());
+        mempoolBytes.set(pendingTxs.bytes());
+    };
+    auto requeueMisrouted = [&]() { requeue(misrouted); };
+    // Every exit that commits nothing hands the txs back to the mempool.
+    auto giveUp = [&]() {
+        TimedLock lock(chainMutex, chainLockWait);
+        requeue(txs);
+        requeueMisrouted();
+    };
+    for (int rebase = 0; rebase <= MAX_MINING_REBASES; rebase++) {
+        auto job = miningScheduler.begin(shardId);
+        size_t height;
+        std::string prevHash;
+        int difficulty;
+        uint64_t timestamp;
+        BlockExecution execution;
+        std::string mapChange;
+        {
+            TimedLock lock(chainMutex, chainLockWait);
+            // A block may only claim stake the miner has bonded in this shard.
+            double bonded = bondedStake(shardId, minerId);
+            if (stake > bonded) {
+                miningScheduler.recordIneligible();
+                log("Miner " + minerId + " claims more stake than it has bonded in shard " + shardId);
+                stake = bonded;
+            }
+            txs.erase(std::remove_if(txs.begin(), txs.end(),
+                                     [&](const Transaction& tx) { return isCommitted(shardId, tx.signature); }),
+                      txs.end());
+            // The map may have changed since the last attempt, so sort every tx again.
+            std::move(misrouted.begin(), misrouted.end(), std::back_inserter(txs));
+            misrouted.clear();
+            std::shared_ptr<const ShardMap> map = shardManager.currentMap();
+            auto home = std::stable_partition(txs.begin(), txs.end(),
+                                              [&](const Transaction& tx) { return map->lookup(tx.sender) == shardId; });
+            std::move(home, txs.end(), std::back_inserter(misrouted));
+            txs.erase(home, txs.end());
+            BlockHeader parent;
+            bool hasParent = blockIndex.tip(shardId, parent);
+            height = blockIndex.height(shardId);
+            prevHash = hasParent ? hashToHex(parent.hash) : "0";
+            difficulty = shardDifficulties[shardId];
+            job->height = height;
+            timestamp = currentTime();
+            if (hasParent) timestamp = std::max(timestamp, parent.timestamp);
+            execution = executeBlock(shardId, txs, minerId, stake, timestamp);
+            mapChange.clear();
+            if (shardId == "0" && proposedShardMap && proposedShardMap->getVersion() > execution.shardMapVersion) {
+                mapChange = proposedShardMap->encode();
+            }
+        }
+        if (txs.empty() && execution.incoming.empty() && execution.outgoing.empty() && mapChange.empty()) {
+            miningScheduler.abandon(job);
+            TimedLock lock(chainMutex, chainLockWait);
+            requeueMisrouted();
+            // Nothing left to move out under this map.
+            if (shardManager.currentMap()->getVersion() == execution.shardMapVersion) migratingShards.erase(shardId);
+            return;
+        }
+        TraceContext trace(Tracer::instance().shouldSample(), shardId, static_cast<int64_t>(height));
+        TraceSpan span("produceBlock");
+        std::shared_ptr<const AhmiyatBlock> newBlock;
+        bool committed = false;
+        try {
+            auto buildStart = std::chrono::steady_clock::now();
+            // On a throw the constructor hands txs back untouched.
+            newBlock = std::make_shared<const AhmiyatBlock>(
+                height, std::move(txs), memory, prevHash, difficulty, stake, shardId,
+                execution.shardMapVersion, execution.outgoing, execution.incoming, hashToHex(execution.stateRoot),
+                mapChange, timestamp, job.get());
+            blockBuildLatency.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - buildStart).count());
+            bool valid;
+            std::string record;
+            {
+                ScopedTimer timer(blockValidateLatency);
+                valid = validateBlock(*newBlock);
+            }
+            if (!valid) {
+                miningScheduler.finish(job, MiningOutcome::Failed);
+                log("Invalid block rejected in shard " + shardId);
+                txs = newBlock->getTransactions();
+                giveUp();
+                return;
+            }
+            bool stale;
+            {
+                ScopedTimer timer(blockCommitLatency);
+                TimedLock lock(chainMutex, chainLockWait);
+                TraceSpan commitSpan("commitBlock");
+                BlockHeader tip;
+                stale = (blockIndex.tip(shardId, tip) ? hashToHex(tip.hash) : "0") != prevHash ||
+                        shardManager.currentMap()->getVersion() != execution.shardMapVersion ||
+                        stateTrees[shardId].rootHash() != execution.parentStateRoot;
+                if (!stale) {
+                    record = newBlock->encode();
+                    committed = commitBlock(newBlock, record, execution);
+                    if (committed) requeueMisrouted();
                 }
+            }
+            if (!stale && !committed) {
+                miningScheduler.finish(job, MiningOutcome::Failed);
+                txs = newBlock->getTransactions();
+                giveUp();
+                return;
+            }
+            miningScheduler.finish(job, stale ? MiningOutcome::Stale : MiningOutcome::Won);
+            if (stale) {
+                log("Stale block in shard " + shardId + ", rebasing");
+                txs = newBlock->getTransactions();
+                continue;
+            }
+            blocksCommitted.inc();
+            if (commitListener) commitListener(shardId, newBlock->getTransactions(), execution.applied);
+            updateReward(shardId);
+            broadcastBlock(*newBlock, record, "");
+            compressState(shardId);
+            return;
+        } catch (const MiningCancelled&) {
+            miningScheduler.finish(job, MiningOutcome::Cancelled);
+            log("Mining at height " + std::to_string(height) + " in shard " + shardId + " cancelled, rebasing");
+        } catch (const std::exception& e) {
+            miningScheduler.finish(job, MiningOutcome::Failed);
+            log("Block creation failed in shard " + shardId + ": " + e.what());
+            if (committed) return;
+            if (newBlock) txs = newBlock->getTransactions();
+            giveUp();
+            return;
+        }
+    }
+    log("Gave up on a block in shard " + shardId + " after " + std::to_string(MAX_MINING_REBASES) + " rebases");
+    giveUp();
+}
 
-                double totalFee = 0.0;
-                for (const auto& tx : txsInShard) {
-                    if (!tx.executeScript(shardBalances[shardId])) continue;
-                    if (shardBalances[shardId][tx.sender] < tx.amount + tx.fee) {
-                        log("Insufficient balance for " + tx.sender + " in shard " + shardId);
-                        continue;
-                    }
-                    shardBalances[shardId][tx.sender] -= (tx.amount + tx.fee);
-                    shardBalances[shardId][tx.receiver] += tx.amount;
-                    totalFee += tx.fee;
-                }
-                shardBalances[shardId][minerId] += blockReward + totalFee;
-                if (stake > 0) shardBalances[shardId][minerId] += stakingReward;
-                totalMined += blockReward;
-                updateReward(shardId);
-                broadcastBlock(newBlock, nodes[0]);
-                compressState(shardId);
-            } catch (const std::exception& e) {
-                log("Block creation failed in shard " + shardId + ": " + e.what());
+// Result of one transaction in executeBlock, filled in by ParallelExecutor tasks.
+struct TxOutcome {
+    enum Status { Applied, Rejected, WrongShard };
+    Status status = Rejected;
+    uint64_t gasUsed = 0;
+    bool staked = false;
+    std::string toShard;
+    std::string error;
+};
+
+BlockExecution AhmiyatChain::executeBlock(const std::string& shardId, const std::vector<Transaction>& txs,
+                                          const std::string& minerId, double stake, uint64_t timestamp,
+                                          const std::vector<CrossShardReceipt>* incoming,
+                                          std::shared_ptr<const ShardMap> map) {
+    TraceSpan span("executeBlock");
+    BlockExecution execution;
+    if (!map) map = shardManager.currentMap();
+    execution.shardMapVersion = map->getVersion();
+    const auto& balances = shardBalances[shardId];
+    const uint64_t height = blockIndex.height(shardId);
+    execution.deltas.reserve(2 * txs.size() + 1);
+    std::vector<const std::string*> sources;
+    sources.reserve(txs.size());
+    for (const auto& tx : txs) sources.push_back(&tx.script);
+    auto programs = ScriptEngine::instance().prepareBatch(sources);
+    // Scripts see the block's time so every node that executes it agrees on time locks.
+    uint64_t now = blockSeconds(timestamp);
+    const std::vector<uint64_t>& unlocks = fragmentUnlocks[shardId];
+
+    // Workers only fill outcomes; logging and receipts happen in block order on commit.
+    std::vector<TxOutcome> outcomes(txs.size());
+    execution.applied.assign(txs.size(), false);
+    auto run = [&](size_t i, const AccountView& accounts, TxEffects& effects) {
+        static thread_local std::string scratch;
+        const Transaction& tx = txs[i];
+        TxOutcome& outcome = outcomes[i];
+        outcome = TxOutcome();
+        if (map->lookup(tx.sender) != shardId) {
+            outcome.status = TxOutcome::WrongShard;
+            return;
+        }
+        // Committed txs are only remembered until they expire, so expired ones can never apply.
+        uint64_t sent = blockSeconds(tx.timestamp);
+        if (sent + TX_EXPIRY_SECONDS < now || sent > now + MAX_FUTURE_BLOCK_SECONDS) {
+            outcome.error = "Tx " + tx.getHash().substr(0, 16) + " outside its validity window";
+            return;
+        }
+        if (programs[i]) {
+            unsigned char digest[SHA256_DIGEST_LENGTH];
+            tx.messageHash(digest, scratch);
+            ScriptContext context{&tx.sender, &tx.receiver, tx.amount, tx.fee, now, digest, &tx.witness, &unlocks};
+            ScriptResult result = ScriptEngine::run(*programs[i], context, accounts);
+            outcome.gasUsed = result.gasUsed;
+            if (!result.ok) {
+                outcome.error = "Script rejected tx " + tx.getHash().substr(0, 16) + ": " + result.error;
+                return;
             }
-        });
+        }
+        if (accounts.balanceOf(tx.sender) < tx.amount + tx.fee) {
+            outcome.error = "Insufficient balance for " + tx.sender + " in shard " + shardId;
+            return;
+        }
+        effects.writes.emplace_back(tx.sender, -(tx.amount + tx.fee));
+        outcome.staked = tx.receiver == STAKE_ADDRESS;
+        outcome.toShard = outcome.staked ? shardId : map->lookup(tx.receiver);
+        if (outcome.toShard == shardId && !outcome.staked) effects.writes.emplace_back(tx.receiver, tx.amount);
+        outcome.status = TxOutcome::Applied;
+    };
+    auto sendReceipt = [&](const std::string& input, const std::string& toShard, const std::string& receiver,
+                           double amount) {
+        CrossShardReceipt receipt;
+        Hash256 digest;
+        SHA256((unsigned char*)input.c_str(), input.length(), digest.data());
+        receipt.id = hashToHex(digest);
+        receipt.fromShard = shardId;
+        receipt.toShard = toShard;
+        receipt.receiver = receiver;
+        receipt.amount = amount;
+        receipt.sourceHeight = height;
+        execution.outgoing.push_back(receipt);
+    };
+    double totalFee = 0.0;
+    auto commit = [&](size_t i, const TxEffects& effects) {
+        const Transaction& tx = txs[i];
+        const TxOutcome& outcome = outcomes[i];
+        scriptGasUsed.inc(outcome.gasUsed);
+        if (outcome.status == TxOutcome::WrongShard) return;
+        if (outcome.status == TxOutcome::Rejected) {
+            log(outcome.error);
+            return;
+        }
+        for (const auto& [addr, delta] : effects.writes) execution.deltas[addr] += delta;
+        execution.applied[i] = true;
+        totalFee += tx.fee;
+        if (outcome.staked) execution.bonded[tx.sender] += tx.amount;
+        if (outcome.toShard == shardId) return;
+        sendReceipt(shardId + ":" + tx.getHash(), outcome.toShard, tx.receiver, tx.amount);
+    };
+    ExecutionStats stats = executor.run(txs.size(), balances, run, commit);
+    if (stats.workers) {
+        txsSpeculated.inc(stats.txs);
+        txsReexecuted.inc(stats.reexecuted);
+    }
+    // The first block a shard builds under a new map moves every balance the
+    // map gave to another shard there, as receipts like any other transfer.
+    BlockHeader parent;
+    if (blockIndex.tip(shardId, parent) && parent.shardMapVersion < execution.shardMapVersion) {
+        std::vector<std::string> moving;
+        for (const auto& [addr, balance] : balances) {
+            if (balance != 0.0 && map->lookup(addr) != shardId) moving.push_back(addr);
+        }
+        std::sort(moving.begin(), moving.end());
+        std::string prefix = shardId + ":migrate:" + std::to_string(execution.shardMapVersion) + ":";
+        for (const auto& addr : moving) {
+            double amount = balances.at(addr);
+            execution.deltas[addr] -= amount;
+            sendReceipt(prefix + addr, map->lookup(addr), addr, amount);
+        }
+    }
+    execution.deltas[minerId] += blockReward + totalFee + (stake > 0 ? stakingReward : 0.0);
+    execution.incoming = incoming ? *incoming : receiptRouter.peek(shardId, MAX_RECEIPTS_PER_BLOCK);
+
+    // Replays applyBlock's arithmetic so the root matches the committed state bit for bit.
+    std::unordered_map<std::string, double> after;
+    for (const auto& [addr, delta] : execution.deltas) {
+        auto it = balances.find(addr);
+        after[addr] = (it != balances.end() ? it->second : 0.0) + delta;
+    }
+    for (const auto& receipt : execution.incoming) {
+        auto it = after.find(receipt.receiver);
+        if (it == after.end()) {
+            auto base = balances.find(receipt.receiver);
+            it = after.emplace(receipt.receiver, base != balances.end() ? base->second : 0.0).first;
+        }
+        it->second += receipt.amount;
+    }
+    const SparseMerkleTree& tree = stateTrees[shardId];
+    execution.parentStateRoot = tree.rootHash();
+    execution.stateRoot = tree.previewRoot(SparseMerkleTree::Updates(after.begin(), after.end()));
+    return execution;
+}
+
+// The block's state root assumed the shard's state at execution and every
+// incoming receipt credited; applyBlock would land elsewhere if either moved.
+bool AhmiyatChain::landsOnStateRoot(const std::string& shardId, const BlockExecution& execution) {
+    if (stateTrees[shardId].rootHash() != execution.parentStateRoot) return false;
+    std::unordered_set<std::string> ids;
+    for (const auto& receipt : execution.incoming) {
+        if (!ids.insert(receipt.id).second) return false;
+    }
+    for (ReceiptStatus status : receiptRouter.status(shardId, execution.incoming)) {
+        if (status == ReceiptStatus::Settled) return false;
+    }
+    return true;
+}
+
+bool AhmiyatChain::commitBlock(const std::shared_ptr<const AhmiyatBlock>& block, const std::string& record,
+                               const BlockExecution& execution) {
+    const std::string& shardId = block->getShardId();
+    if (!landsOnStateRoot(shardId, execution)) {
+        log("State root mismatch for block " + block->getHash().substr(0, 16) + " in shard " + shardId + ", not committed");
+        return false;
+    }
+    appendHeader(*block);
+    // Every node continues from the difficulty the chain reached.
+    shardDifficulties[shardId] = block->getDifficulty();
+    // landsOnStateRoot held, so applyBlock credits every incoming receipt.
+    saveBlockToDB(*block, record, execution.applied, std::vector<bool>(execution.incoming.size(), true));
+    blockCache.put(block->getHash(), *block);
+    recordTxs(*block);
+    applyBlock(shardId, execution);
+    shardManager.updateLoad(shardId, static_cast<int>(block->getTransactions().size()));
+    blocksSinceReshard++;
+    if (block->getShardMapVersion() == shardManager.currentMap()->getVersion()) migratingShards.erase(shardId);
+    if (!block->getShardMapChange().empty()) {
+        installShardMap(std::make_shared<const ShardMap>(ShardMap::decode(block->getShardMapChange())));
+    }
+    miningScheduler.blockCommitted(shardId, block->getIndex());
+    return true;
+}
+void AhmiyatChain::appendHeader(const AhmiyatBlock& block) {
+    const std::string& shardId = block.getShardId();
+    // Callers check the height first, so a gap here is a bug; fail before anything else is written.
+    if (!blockIndex.add(shardId, block.header())) {
+        throw std::runtime_error("Block " + block.getHash().substr(0, 16) + " is not the next in shard " + shardId);
+    }
+    fragmentUnlocks[shardId].push_back(blockSeconds(block.getTimestamp()) +
+                                       static_cast<uint64_t>(block.getMemory().lockTime));
+}
+bool AhmiyatChain::isCommitted(const std::string& shardId, const std::string& signature) const {
+    auto it = recentTxs.find(shardId);
+    return it != recentTxs.end() && it->second.contains(signature);
+}
+// Remembers a committed block's txs until they expire, and forgets those
+// that expired before the block.
+void AhmiyatChain::recordTxs(const AhmiyatBlock& block) {
+    RecentTxs& recent = recentTxs[block.getShardId()];
+    uint64_t now = blockSeconds(block.getTimestamp());
+    for (const auto& tx : block.getTransactions()) {
+        uint64_t sent = blockSeconds(tx.timestamp);
+        // Txs outside the window were rejected and can never apply here.
+        if (sent + TX_EXPIRY_SECONDS < now || sent > now + MAX_FUTURE_BLOCK_SECONDS) continue;
+        recent.insert(sent + TX_EXPIRY_SECONDS, {tx.signature, tx.sender});
+    }
+    recent.expire(now);
+}
+std::vector<bool> AhmiyatChain::applyBlock(const std::string& shardId, const BlockExecution& execution,
+                                           bool routeReceipts) {
+    TraceSpan span("applyBlock");
+    auto& balances = shardBalances[shardId];
+    std::vector<std::string> touched;
+    touched.reserve(execution.deltas.size() + execution.incoming.size());
+    for (const auto& [addr, delta] : execution.deltas) {
+        balances[addr] += delta;
+        touched.push_back(addr);
+    }
+    for (const auto& [addr, amount] : execution.bonded) shardStakes[shardId][addr] += amount;
+    std::vector<bool> fresh(execution.incoming.size(), true);
+    if (routeReceipts) {
+        std::unordered_map<std::string, std::vector<CrossShardReceipt>> outbound;
+        for (const auto& receipt : execution.outgoing) outbound[receipt.toShard].push_back(receipt);
+        for (const auto& [toShard, batch] : outbound) receiptRouter.deliver(toShard, batch);
+        fresh = receiptRouter.markApplied(shardId, execution.incoming);
+    }
+    for (size_t i = 0; i < execution.incoming.size(); i++) {
+        if (!fresh[i]) continue;
+        balances[execution.incoming[i].receiver] += execution.incoming[i].amount;
+        touched.push_back(execution.incoming[i].receiver);
+    }
+    totalMined += blockReward;
+    publishSnapshot(shardId, touched);
+    return fresh;
+}
+
+void AhmiyatChain::publishSnapshot(const std::string& shardId, const std::vector<std::string>& touched) {
+    const auto& balances = shardBalances[shardId];
+    std::vector<std::pair<std::string, double>> values;
+    values.reserve(touched.size());
+    for (const auto& addr : touched) {
+        auto it = balances.find(addr);
+        values.emplace_back(addr, it != balances.end() ? it->second : 0.0);
+    }
+    SparseMerkleTree& tree = stateTrees[shardId];
+    tree.update(values);
+    BlockHeader tip;
+    bool hasTip = blockIndex.tip(shardId, tip);
+    snapshots.publish(shardId, values, blockIndex.height(shardId), shardDifficulties[shardId],
+                      hasTip ? hashToHex(tip.hash) : "", hashToHex(tree.rootHash()));
+}
+
+// Proposes a new shard map at each epoch boundary. Loads come from committed
+// blocks, and the map only takes effect once a shard 0 block carries it, so
+// every node installs the same map at the same point in the chain.
+void AhmiyatChain::reshard() {
+    TimedLock lock(chainMutex, chainLockWait);
+    if (blocksSinceReshard < RESHARD_EPOCH_BLOCKS) return;
+    blocksSinceReshard = 0;
+    std::unordered_map<std::string, int> loads = shardManager.takeLoads();
+    std::shared_ptr<const ShardMap> current = shardManager.currentMap();
+    auto next = std::make_shared<ShardMap>(*current);
+    auto accounts = [&](const std::string& shardId) -> size_t {
+        auto it = shardBalances.find(shardId);
+        return it != shardBalances.end() ? it->second.size() : 0;
+    };
+    std::set<std::string> changed;
+
+    for (const auto& range : current->getRanges()) {
+        const std::string& shardId = range.shardId;
+        if (loads[shardId] < SPLIT_TX_PER_EPOCH && accounts(shardId) < SPLIT_ACCOUNT_COUNT) continue;
+        std::string child = next->unusedShardId(MAX_SHARDS);
+        if (child.empty() || !next->split(shardId, child)) continue;
+        changed.insert(shardId);
+        changed.insert(child);
+        log("Proposing split of shard " + shardId + ", upper range to shard " + child);
+    }
+
+    // Hysteresis: a merged pair must stay well below the split thresholds.
+    for (size_t i = 0; i + 1 < next->getRanges().size(); i++) {
+        std::string left = next->getRanges()[i].shardId;
+        std::string right = next->getRanges()[i + 1].shardId;
+        if (changed.count(left) || changed.count(right)) continue;
+        if (loads[left] + loads[right] >= SPLIT_TX_PER_EPOCH / 4) continue;
+        if (accounts(left) + accounts(right) >= SPLIT_ACCOUNT_COUNT / 4) continue;
+        next->mergeNext(left);
+        changed.insert(left);
+        changed.insert(right);
+        log("Proposing merge of shard " + right + " into shard " + left);
+    }
+
+    if (changed.empty()) return;
+    proposedShardMap = next;
+}
+
+// Installs a map committed in a shard 0 block. Balances stay put: each shard
+// whose range changed moves out the accounts it lost in its next block (see
+// executeBlock). Stakes are not part of block state and move here. The map is
+// not stored separately: it lives in the shard 0 block that committed it, and
+// restoreChain reinstalls it from there.
+void AhmiyatChain::installShardMap(std::shared_ptr<const ShardMap> map) {
+    std::shared_ptr<const ShardMap> previous = shardManager.currentMap();
+    shardManager.installMap(map);
+    if (proposedShardMap && proposedShardMap->getVersion() <= map->getVersion()) proposedShardMap.reset();
+    miningScheduler.cancelAll();
+
+    std::map<std::string, std::pair<uint32_t, uint32_t>> before, after;
+    for (const auto& range : previous->getRanges()) before[range.shardId] = {range.start, range.end};
+    for (const auto& range : map->getRanges()) after[range.shardId] = {range.start, range.end};
+    std::set<std::string> changed;
+    for (const auto& [shardId, bounds] : before) {
+        auto it = after.find(shardId);
+        if (it == after.end() || it->second != bounds) changed.insert(shardId);
+    }
+    for (const auto& [shardId, bounds] : after) {
+        if (!before.count(shardId)) changed.insert(shardId);
+    }
+    // A new shard starts at the difficulty of the shard that owned its range.
+    for (const auto& range : map->getRanges()) {
+        if (!before.count(range.shardId)) {
+            shardDifficulties[range.shardId] = shardDifficulties[previous->lookupKey(range.start)];
+        }
+    }
+    for (const auto& shardId : changed) {
+        migrateStakes(shardId, *map);
+        migrateRecentTxs(shardId, *map);
+        receiptRouter.reroute(shardId, [&](const CrossShardReceipt& receipt) { return map->lookup(receipt.receiver); });
+        migratingShards.insert(shardId);
+    }
+    log("Shard map version " + std::to_string(map->getVersion()) + " installed with " +
+        std::to_string(map->shardCount()) + " shards");
+}
+
+void AhmiyatChain::migrateStakes(const std::string& fromShard, const ShardMap& map) {
+    auto it = shardStakes.find(fromShard);
+    if (it == shardStakes.end()) return;
+    auto& stakes = it->second;
+    for (auto acct = stakes.begin(); acct != stakes.end();) {
+        std::string home = map.lookup(acct->first);
+        if (home == fromShard) {
+            ++acct;
+            continue;
+        }
+        shardStakes[home][acct->first] += acct->second;
+        acct = stakes.erase(acct);
+    }
+}
+
+// Recent txs follow their senders, so the new home still rejects a replay.
+void AhmiyatChain::migrateRecentTxs(const std::string& fromShard, const ShardMap& map) {
+    auto it = recentTxs.find(fromShard);
+    if (it == recentTxs.end()) return;
+    auto moving = it->second.extract([&](const std::string& sender) { return map.lookup(sender) != fromShard; });
+    for (auto& [expiry, entry] : moving) {
+        std::string home = map.lookup(entry.sender);
+        recentTxs[home].insert(expiry, std::move(entry));
+    }
+}
+
+std::string AhmiyatChain::homeShard(const std::string& address) {
+    return shardManager.homeShard(address);
+}
+
+std::string AhmiyatChain::getBalanceProof(const std::string& address, const std::string& shardId) {
+    StateProof proof;
+    Hash256 root;
+    {
+        TimedLock lock(chainMutex, chainLockWait);
+        auto it = stateTrees.find(shardId);
+        if (it == stateTrees.end()) return "{\"error\":\"shard not found\"}";
+        proof = it->second.prove(address);
+        root = it->second.rootHash();
+    }
+    double balance = proof.hasLeaf && proof.leafKey == SparseMerkleTree::keyFor(address) ? proof.leafValue : 0.0;
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    ss << "{\"address\":\"" << address << "\",\"shard\":\"" << shardId << "\",\"balance\":" << balance
+       << ",\"root\":\"" << hashToHex(root) << "\"";
+    if (proof.hasLeaf) {
+        ss << ",\"leafKey\":\"" << hashToHex(proof.leafKey) << "\",\"leafValue\":" << proof.leafValue;
+    }
+    ss << ",\"siblings\":[";
+    for (size_t i = 0; i < proof.siblings.size(); i++) {
+        ss << (i ? "," : "") << "\"" << hashToHex(proof.siblings[i]) << "\"";
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+std::string AhmiyatChain::getBlockRecord(const std::string& hash) {
+    std::string record = blockCache.getRecord(hash);
+    if (!record.empty()) return record;
+    if (!db->Get(leveldb::ReadOptions(), blockKey(hash), &record).ok()) return "";
+    return record;
+}
+
+bool AhmiyatChain::locateBlock(const std::string& hash, BlockLocation& location) {
+    return blockIndex.find(hexToHash(hash), location);
+}
+
+bool AhmiyatChain::getHeader(const std::string& shardId, uint64_t height, BlockHeader& header) {
+    return blockIndex.headerAt(shardId, height, header);
+}
+
+std::vector<BlockHeader> AhmiyatChain::getHeaders(const std::string& shardId, uint64_t from, size_t count) {
+    return blockIndex.range(shardId, from, count);
+}
+
+std::string AhmiyatChain::getHistory(const std::string& address, const std::string& cursor, size_t limit) {
+    return HistoryIndex::toJson(address, history.query(address, cursor, limit));
+}
+
+std::string AhmiyatChain::getShardMap() {
+    std::shared_ptr<const ShardMap> map = shardManager.currentMap();
+    std::stringstream ss;
+    ss << "Shard map version " << map->getVersion() << "\n";
+    for (const auto& range : map->getRanges()) {
+        ss << range.shardId << ": " << std::hex << std::setw(8) << std::setfill('0') << range.start << "-"
+           << std::setw(8) << range.end << std::dec << "\n";
+    }
+    return ss.str();
+}
+
+std::shared_ptr<const AhmiyatBlock> AhmiyatChain::getBlock(const std::string& hash) {
+    if (auto cached = blockCache.get(hash)) return cached;
+    std::string record;
+    leveldb::Status status = db->Get(leveldb::ReadOptions(), blockKey(hash), &record);
+    if (!status.ok()) return nullptr;
+    try {
+        auto block = std::make_shared<const AhmiyatBlock>(AhmiyatBlock::decode(record));
+        blockCache.put(hash, *block);
+        return block;
+    } catch (const std::exception& e) {
+        log("Corrupt block record " + hash + ": " + e.what());
+        return nullptr;
     }
-    for (auto& t : blockThreads) t.join();
 }
 
 void AhmiyatChain::addNode(std::string nodeId, std::string ip, int port) {
-    std::lock_guard<std::mutex> lock(chainMutex);
+    TimedLock lock(chainMutex, chainLockWait);
     if (nodeId.empty() || ip.empty() || port <= 0) {
         log("Invalid node parameters");
         return;
@@ -438,33 +1678,45 @@ void AhmiyatChain::addNode(std::string nodeId, std::string ip, int port) {
 }
 
 double AhmiyatChain::getBalance(std::string address, std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (address.empty() || !shardBalances.count(shardId)) return 0.0;
-    return shardBalances[shardId][address];
+    if (address.empty()) return 0.0;
+    EpochGuard guard;
+    const ShardSnapshot* snapshot = snapshots.acquire(shardId);
+    return snapshot ? snapshot->balanceOf(address) : 0.0;
 }
 
-void AhmiyatChain::stakeCoins(std::string address, double amount, std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (amount <= 0 || address.empty() || !shardBalances.count(shardId)) return;
-    if (shardBalances[shardId][address] >= amount) {
-        shardBalances[shardId][address] -= amount;
-        shardStakes[shardId][address] += amount;
-        log(address + " staked " + std::to_string(amount) + " AHM in shard " + shardId);
+void AhmiyatChain::stakeCoins(std::string address, double amount) {
+    if (amount <= 0 || address.empty()) return;
+    try {
+        addPendingTx(Transaction(address, STAKE_ADDRESS, amount));
+    } catch (const std::exception& e) {
+        log("Stake deposit rejected: " + std::string(e.what()));
     }
 }
 
+int retargetDifficulty(int parentDifficulty, uint64_t windowNanos, double averageStake) {
+    uint64_t windowMs = windowNanos / 1000000;
+    if (windowMs < static_cast<uint64_t>(TARGET_BLOCK_TIME) || averageStake > 1000) return parentDifficulty + 1;
+    if (windowMs > 2 * static_cast<uint64_t>(TARGET_BLOCK_TIME)) return std::max(1, parentDifficulty - 1);
+    return parentDifficulty;
+}
+
+int AhmiyatChain::retargetedDifficulty(const std::string& shardId) {
+    uint64_t height = blockIndex.height(shardId);
+    BlockHeader tip;
+    if (!blockIndex.tip(shardId, tip)) return shardDifficulties[shardId];
+    if (height <= DIFFICULTY_WINDOW) return tip.difficulty;
+    BlockHeader first;
+    blockIndex.headerAt(shardId, height - DIFFICULTY_WINDOW, first);
+    return retargetDifficulty(tip.difficulty, tip.timestamp - first.timestamp, blockIndex.stakeSum(shardId) / height);
+}
+
+// Applies the retarget rule to this node's next blocks in the shard; peers
+// accept the result because they can derive it from the same headers.
 void AhmiyatChain::adjustDifficulty(std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (shards[shardId].size() <= 10) return;
-    uint64_t lastTenTime = shards[shardId].back().timestamp - shards[shardId][shards[shardId].size() - 10].timestamp;
-    double avgStake = 0;
-    for (const auto& block : shards[shardId]) avgStake += block.getStakeWeight();
-    avgStake /= shards[shardId].size();
-    if (lastTenTime < TARGET_BLOCK_TIME || avgStake > 1000) {
-        shardDifficulties[shardId]++;
-    } else if (lastTenTime > 2 * TARGET_BLOCK_TIME) {
-        shardDifficulties[shardId] = std::max(1, shardDifficulties[shardId] - 1);
-    }
+    TimedLock lock(chainMutex, chainLockWait);
+    if (blockIndex.height(shardId) <= DIFFICULTY_WINDOW) return;
+    shardDifficulties[shardId] = retargetedDifficulty(shardId);
+    publishSnapshot(shardId, {});
     log("Difficulty adjusted in shard " + shardId + " to: " + std::to_string(shardDifficulties[shardId]));
 }
 
@@ -499,11 +1751,15 @@ void AhmiyatChain::startNodeListener(int port) {
 
             listenerThreads.emplace_back([&, clientSock]() {
                 try {
-                    char buffer[4096] = {0};
-                    ssize_t bytesRead = read(clientSock, buffer, 4096);
-                    if (bytesRead > 0) {
-                        std::string data(buffer, bytesRead);
-                        syncChain(data);
+                    std::string data;
+                    char buffer[4096];
+                    ssize_t bytesRead;
+                    while ((bytesRead = read(clientSock, buffer, sizeof(buffer))) > 0) {
+                        data.append(buffer, bytesRead);
+                        if (data.size() > MAX_BLOCK_RECORD_BYTES) break;
+                    }
+                    if (!data.empty() && data.size() <= MAX_BLOCK_RECORD_BYTES) {
+                        importBlock(data);
                         processPendingTxs();
                     }
                     close(clientSock);
@@ -527,26 +1783,8 @@ void AhmiyatChain::startNodeListener(int port) {
     close(serverSock);
 }
 
-void AhmiyatChain::stressTest(int numBlocks) {
-    Wallet wallet;
-    std::vector<std::thread> testThreads;
-    for (int i = 0; i < numBlocks; i++) {
-        testThreads.emplace_back([&, i]() {
-            try {
-                std::vector<Transaction> txs = {Transaction(wallet.publicKey, "test" + std::to_string(i), 1.0)};
-                MemoryFragment mem("text", "memories/test" + std::to_string(i) + ".txt", "Test block", wallet.publicKey, 0);
-                addBlock(txs, mem, wallet.publicKey, shardStakes[assignShard(txs[0])][wallet.publicKey]);
-            } catch (const std::exception& e) {
-                log("Stress test block " + std::to_string(i) + " failed: " + e.what());
-            }
-        });
-    }
-    for (auto& t : testThreads) t.join();
-    log("Stress test completed: " + std::to_string(numBlocks) + " blocks added across shards");
-}
-
 void AhmiyatChain::proposeUpgrade(std::string proposerId, std::string description) {
-    std::lock_guard<std::mutex> lock(chainMutex);
+    TimedLock lock(chainMutex, chainLockWait);
     if (proposerId.empty() || description.empty()) return;
     std::string proposalId = proposerId + std::to_string(std::chrono::system_clock::now().time_since_epoch().count());
     governanceProposals[proposalId] = {description, 0};
@@ -554,7 +1792,7 @@ void AhmiyatChain::proposeUpgrade(std::string proposerId, std::string descriptio
 }
 
 void AhmiyatChain::voteForUpgrade(std::string voterId, std::string proposalId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
+    TimedLock lock(chainMutex, chainLockWait);
     if (!governanceProposals.count(proposalId)) return;
     for (const auto& [shardId, stakes] : shardStakes) {
         if (stakes.count(voterId)) {
@@ -565,33 +1803,33 @@ void AhmiyatChain::voteForUpgrade(std::string voterId, std::string proposalId) {
 }
 
 std::string AhmiyatChain::getShardStatus(std::string shardId) {
-    std::lock_guard<std::mutex> lock(chainMutex);
-    if (!shards.count(shardId)) return "Shard not found";
+    EpochGuard guard;
+    const ShardSnapshot* snapshot = snapshots.acquire(shardId);
+    if (!snapshot) return "Shard not found";
     std::stringstream ss;
     ss << "Shard " << shardId << ":\n";
-    ss << "Blocks: " << shards[shardId].size() << "\n";
-    ss << "Total Balance: ";
-    double total = 0;
-    for (const auto& [addr, bal] : shardBalances[shardId]) total += bal;
-    ss << total << " AHM\n";
-    ss << "Difficulty: " << shardDifficulties[shardId] << "\n";
+    ss << "Blocks: " << snapshot->blockCount << "\n";
+    ss << "Total Balance: " << snapshot->totalBalance << " AHM\n";
+    ss << "Difficulty: " << snapshot->difficulty << "\n";
+    ss << "State root: " << snapshot->stateRoot << "\n";
     return ss.str();
 }
 
 void AhmiyatChain::handleCrossShardTx(const Transaction& tx) {
-    std::lock_guard<std::mutex> lock(chainMutex);
     if (!tx.validate()) return;
-    std::string fromShard = tx.shardId;
-    std::string toShard = assignShard(Transaction(tx.receiver, tx.sender, 0));
-    if (fromShard != toShard) {
-        if (shardBalances[fromShard][tx.sender] >= tx.amount + tx.fee) {
-            shardBalances[fromShard][tx.sender] -= (tx.amount + tx.fee);
-            shardBalances[toShard][tx.receiver] += tx.amount;
-            log("Cross-shard tx from " + fromShard + " to " + toShard + ": " + std::to_string(tx.amount) + " AHM");
-        } else {
-            log("Cross-shard tx failed: insufficient balance");
-        }
-    }
+    addPendingTx(tx);
+}
+
+std::string AhmiyatChain::blockSignature(Transaction tx) {
+    tx.shardId = assignShard(tx);
+    return signTransaction(tx);
+}
+
+bool AhmiyatChain::queuePending(const Transaction& tx, const std::string& signature) {
+    if (pendingSignatures.count(signature) || isCommitted(assignShard(tx), signature)) return false;
+    pendingTxs.push(tx);
+    pendingSignatures.insert(signature);
+    return true;
 }
 
 void AhmiyatChain::addPendingTx(const Transaction& tx) {
@@ -599,7 +1837,55 @@ void AhmiyatChain::addPendingTx(const Transaction& tx) {
         log("Invalid pending tx rejected");
         return;
     }
-    std::lock_guard<std::mutex> lock(chainMutex);
-    pendingTxs.push(tx);
+    std::string signature = blockSignature(tx);
+    TimedLock lock(chainMutex, chainLockWait);
+    if (pendingTxs.size() >= MAX_MEMPOOL_TXS) {
+        mempoolFull.inc();
+        log("Mempool full, pending tx rejected");
+        return;
+    }
+    try {
+        if (!queuePending(tx, signature)) {
+            log("Duplicate pending tx rejected: " + tx.getHash());
+            return;
+        }
+    } catch (const std::exception& e) {
+        log("Pending tx rejected: " + std::string(e.what()));
+        return;
+    }
+    mempoolDepth.set(pendingTxs.size());
+    mempoolBytes.set(pendingTxs.bytes());
     log("Added pending tx: " + tx.getHash());
 }
+
+size_t AhmiyatChain::addPendingTxs(const std::vector<Transaction>& txs, size_t* duplicates) {
+    // Signing is the expensive part, so it happens before taking chainMutex.
+    std::vector<std::string> signatures;
+    signatures.reserve(txs.size());
+    for (const auto& tx : txs) signatures.push_back(blockSignature(tx));
+    size_t queued = 0, known = 0;
+    TimedLock lock(chainMutex, chainLockWait);
+    for (size_t i = 0; i < txs.size(); i++) {
+        if (pendingTxs.size() >= MAX_MEMPOOL_TXS) {
+            mempoolFull.inc(txs.size() - i);
+            break;
+        }
+        try {
+            if (queuePending(txs[i], signatures[i])) {
+                queued++;
+            } else {
+                known++;
+            }
+        } catch (const std::exception&) {
+        }
+    }
+    if (duplicates) *duplicates = known;
+    mempoolDepth.set(pendingTxs.size());
+    mempoolBytes.set(pendingTxs.bytes());
+    return queued;
+}
+
+size_t AhmiyatChain::getMempoolSize() {
+    TimedLock lock(chainMutex, chainLockWait);
+    return pendingTxs.size();
+}
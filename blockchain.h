@@ -4,16 +4,53 @@
 #include <vector>
 #include <string>
 #include <unordered_map>
+#include <unordered_set>
 #include <mutex>
 #include <set>
 #include <queue>
+#include <functional>
+#include <array>
+#include <memory>
 #include "wallet.h"
 #include "dht.h"
+#include "snapshot.h"
+#include "blockcache.h"
+#include "codec.h"
+#include "receipts.h"
+#include "shardmap.h"
+#include "script.h"
+#include "smt.h"
+#include "history.h"
+#include "blockindex.h"
+#include "recenttxs.h"
+#include "transport.h"
+#include "mining.h"
+#include "executor.h"
+#include "compacttx.h"
 #include <leveldb/db.h>
 
-const int MAX_SHARDS = 16;
+const int MAX_SHARDS = 256;
+const int RESHARD_EPOCH_BLOCKS = 64;
+const int SPLIT_TX_PER_EPOCH = 4096;
+const size_t SPLIT_ACCOUNT_COUNT = 65536;
 const int INITIAL_DIFFICULTY = 4;
 const int TARGET_BLOCK_TIME = 60000;
+// Blocks whose span the difficulty rule compares with TARGET_BLOCK_TIME (milliseconds).
+const uint64_t DIFFICULTY_WINDOW = 10;
+const size_t BLOCK_CACHE_BYTES = 64 * 1024 * 1024;
+const size_t MAX_MEMPOOL_TXS = 100000;
+const uint64_t GENESIS_TIMESTAMP = 1700000000000000000ULL;
+// Receiver of stake deposits: the amount leaves the sender's balance and is
+// bonded to the sender in its shard when the block applies, so stakes are on chain.
+const std::string STAKE_ADDRESS = "stake";
+// How far past the local clock an imported block's timestamp may be.
+const uint64_t MAX_FUTURE_BLOCK_SECONDS = 7200;
+
+std::string hashToHex(const Hash256& hash);
+Hash256 hexToHash(const std::string& hex);
+// LevelDB keys of a block record and of the (shard, height) -> hash entry.
+std::string blockKey(const std::string& hash);
+std::string heightKey(const std::string& shardId, uint64_t height);
 
 struct Transaction {
     std::string sender;
@@ -24,11 +61,18 @@ struct Transaction {
     std::string signature;
     std::string shardId;
     uint64_t timestamp;
+    std::vector<std::string> witness;
+    Transaction() : amount(0), fee(0), timestamp(0) {}
     Transaction(std::string s, std::string r, double a, double f = 0.001, std::string sh = "0");
     std::string toString() const;
-    bool executeScript(const std::unordered_map<std::string, double>& balances);
+    void messageHash(unsigned char out[32]) const;
+    // Same digest, building the preimage in a caller-owned buffer so hot loops don't allocate.
+    void messageHash(unsigned char out[32], std::string& scratch) const;
+    bool executeScript(const AccountView& accounts, uint64_t now) const;
     std::string getHash() const;
     bool validate() const;
+    void encode(ByteWriter& writer) const;
+    static Transaction decode(ByteReader& reader, bool withWitness = true);
 };
 
 struct MemoryFragment {
@@ -38,6 +82,7 @@ struct MemoryFragment {
     std::string description;
     std::string owner;
     int lockTime;
+    MemoryFragment() : lockTime(0) {}
     MemoryFragment(std::string t, std::string fp, std::string desc, std::string o, int lt = 0);
     void saveToFile();
     bool validate() const;
@@ -55,45 +100,186 @@ private:
     std::string memoryProof;
     double stakeWeight;
     std::string shardId;
+    uint64_t shardMapVersion;
+    std::string stateRoot;
+    std::vector<CrossShardReceipt> outgoingReceipts;
+    std::vector<CrossShardReceipt> incomingReceipts;
+    // Encoded shard map that takes effect when this block commits; shard 0 only.
+    std::string shardMapChange;
     std::string calculateHash() const;
+    // The hash preimage is prefix + memoryProof + suffix; mining hashes the
+    // prefix once and only the nonce and suffix per attempt.
+    void hashPrefix(std::string& out) const;
+    void hashSuffix(std::string& out) const;
+    // The record before and after the transaction list, so CompactBlock can write its own body in between.
+    void encodeHead(ByteWriter& writer) const;
+    void encodeTail(ByteWriter& writer) const;
     bool isMemoryProofValid(int difficulty);
+    AhmiyatBlock() : index(0), timestamp(0), difficulty(0), stakeWeight(0), shardMapVersion(0) {}
+    friend struct ChainBench;
+    friend class NetworkSimulator;
+    friend class CompactBlock;
 
 public:
     AhmiyatBlock(int idx, const std::vector<Transaction>& txs, const MemoryFragment& mem, 
-                 std::string prevHash, int diff, double stake, std::string sh);
-    void mineBlock(double minerStake);
-    std::string getHash() const;
-    std::string getPreviousHash() const;
+                 std::string prevHash, int diff, double stake, std::string sh,
+                 uint64_t mapVersion = 1,
+                 const std::vector<CrossShardReceipt>& outgoing = {},
+                 const std::vector<CrossShardReceipt>& incoming = {},
+                 const std::string& postStateRoot = "",
+                 const std::string& mapChange = "",
+                 uint64_t time = 0,
+                 MiningJob* job = nullptr);
+    // Takes the transactions without copying. If mining throws, txs is left
+    // as it was passed so the caller can retry with it.
+    AhmiyatBlock(int idx, std::vector<Transaction>&& txs, const MemoryFragment& mem,
+                 std::string prevHash, int diff, double stake, std::string sh,
+                 uint64_t mapVersion = 1,
+                 const std::vector<CrossShardReceipt>& outgoing = {},
+                 const std::vector<CrossShardReceipt>& incoming = {},
+                 const std::string& postStateRoot = "",
+                 const std::string& mapChange = "",
+                 uint64_t time = 0,
+                 MiningJob* job = nullptr);
+    // Throws MiningCancelled once job is cancelled; stake eligibility is checked before any hashing.
+    void mineBlock(double minerStake, MiningJob* job = nullptr);
+    const std::string& getHash() const;
+    const std::string& getPreviousHash() const;
     std::string serialize() const;
+    std::string encode() const;
+    static AhmiyatBlock decode(const std::string& record);
+    // Every node derives the same genesis: fixed timestamp and nonces searched from zero.
+    static AhmiyatBlock genesis(const std::vector<Transaction>& txs, const MemoryFragment& mem, int diff,
+                                uint64_t mapVersion, const std::string& postStateRoot);
+    BlockHeader header() const;
+    std::string toJson() const;
     double getStakeWeight() const;
-    std::string getShardId() const;
+    const std::string& getShardId() const;
+    int getIndex() const { return index; }
+    uint64_t getTimestamp() const { return timestamp; }
+    int getDifficulty() const { return difficulty; }
+    uint64_t getShardMapVersion() const { return shardMapVersion; }
+    const std::string& getStateRoot() const { return stateRoot; }
+    const MemoryFragment& getMemory() const { return memory; }
     const std::vector<Transaction>& getTransactions() const;
+    const std::vector<CrossShardReceipt>& getOutgoingReceipts() const { return outgoingReceipts; }
+    const std::vector<CrossShardReceipt>& getIncomingReceipts() const { return incomingReceipts; }
+    const std::string& getShardMapChange() const { return shardMapChange; }
     bool validate() const;
 };
 
+// A block whose transactions live in one CompactTxBatch, i.e. in an arena
+// and address dictionary of their own that are freed with it. This is the
+// form BlockCache keeps; encode() and calculateHash() read it directly and
+// match the full block's record and hash.
+class CompactBlock {
+private:
+    AhmiyatBlock shell;  // Everything but the transactions.
+    CompactTxBatch txs;
+    size_t shellBytes;
+
+public:
+    // Throws std::runtime_error if a tx's shard id is not a canonical small integer.
+    explicit CompactBlock(const AhmiyatBlock& block);
+    AhmiyatBlock expand() const;
+    std::string encode() const;
+    std::string calculateHash() const;
+    const std::string& getHash() const { return shell.getHash(); }
+    size_t txCount() const { return txs.size(); }
+    // Approximate memory held, for the cache budget.
+    size_t bytes() const { return sizeof(CompactBlock) + shellBytes + txs.bytes(); }
+};
+
 class ShardManager {
 private:
+    std::shared_ptr<const ShardMap> shardMap;
     std::unordered_map<std::string, int> shardLoads;
     std::mutex loadMutex;
 public:
-    std::string assignShard(const Transaction& tx, int maxShards);
+    ShardManager();
+    std::string homeShard(const std::string& address);
+    std::string assignShard(const Transaction& tx);
     void updateLoad(const std::string& shardId, int txCount);
+    // Returns the per-shard tx counts of the epoch just ended and starts a new one.
+    std::unordered_map<std::string, int> takeLoads();
+    std::shared_ptr<const ShardMap> currentMap();
+    void installMap(std::shared_ptr<const ShardMap> map);
 };
 
+// applied[i] is false for txs that were included but rejected, e.g. for insufficient balance.
+typedef std::function<void(const std::string& shardId, const std::vector<Transaction>& txs,
+                           const std::vector<bool>& applied)> CommitListener;
+
+enum class ImportResult { Imported, Duplicate, Orphan, Fork, Invalid };
+
+// Outcomes of blocks received from peers. There is no fork choice: a block
+// that does not extend the local tip is counted and dropped.
+struct ImportStats {
+    uint64_t imported = 0;
+    uint64_t duplicates = 0;
+    uint64_t orphans = 0;
+    uint64_t forks = 0;
+    uint64_t invalid = 0;
+};
+
+// State changes computed for a block before it is mined. Receipts are part
+// of the block; the deltas are applied only if the block commits.
+struct BlockExecution {
+    std::unordered_map<std::string, double> deltas;
+    std::vector<CrossShardReceipt> outgoing;
+    std::vector<CrossShardReceipt> incoming;
+    // Per block tx: whether it moved funds.
+    std::vector<bool> applied;
+    // Stake the block's deposits bond, per sender.
+    std::unordered_map<std::string, double> bonded;
+    uint64_t shardMapVersion = 0;
+    // Shard state root the block was executed on, and the root after it.
+    Hash256 parentStateRoot{};
+    Hash256 stateRoot{};
+};
+
+// Difficulty a block may move to from its parent's: up one when the last
+// DIFFICULTY_WINDOW blocks took under TARGET_BLOCK_TIME or the average stake
+// is high, down one (never below 1) when they took over twice that.
+int retargetDifficulty(int parentDifficulty, uint64_t windowNanos, double averageStake);
+
 class AhmiyatChain {
 private:
-    std::unordered_map<std::string, std::vector<AhmiyatBlock>> shards;
+    // Unix seconds at which each block's memory fragment unlocks, per shard and height.
+    std::unordered_map<std::string, std::vector<uint64_t>> fragmentUnlocks;
+    BlockIndex blockIndex;
+    BlockCache blockCache;
     std::unordered_map<std::string, std::unordered_map<std::string, double>> shardBalances;
     std::unordered_map<std::string, std::unordered_map<std::string, double>> shardStakes;
+    std::unordered_map<std::string, SparseMerkleTree> stateTrees;
     std::unordered_map<std::string, int> shardDifficulties;
     std::vector<Node> nodes;
     DHT dht;
     std::mutex chainMutex;
     EC_KEY* keyPair;
+    // Nanoseconds since the epoch; new blocks are stamped with it and peers' blocks checked against it.
+    std::function<uint64_t()> clock;
     leveldb::DB* db;
-    std::set<std::string> processedTxs;
-    std::queue<Transaction> pendingTxs;
+    HistoryIndex history;
+    // Per shard, committed txs that have not expired yet.
+    std::unordered_map<std::string, RecentTxs> recentTxs;
+    CompactTxBatch pendingTxs;
+    // The signatures addBlock will give the txs in pendingTxs, so a tx is queued at most once.
+    std::unordered_set<std::string> pendingSignatures;
     ShardManager shardManager;
+    SnapshotRegistry snapshots;
+    ReceiptRouter receiptRouter;
+    CommitListener commitListener;
+    int blocksSinceReshard = 0;
+    // Map computed at the last epoch boundary, waiting for a shard 0 block to carry it.
+    std::shared_ptr<const ShardMap> proposedShardMap;
+    // Shards whose range changed in the last map; each needs a block to move out accounts it no longer owns.
+    std::set<std::string> migratingShards;
+    std::shared_ptr<Transport> transport;
+    ImportStats importStats;
+    MiningScheduler miningScheduler;
+    // Sized like the miners' CPU slots; executeBlock runs under chainMutex, so blocks take turns on it.
+    ParallelExecutor executor;
 
     const std::string COIN_NAME = "Ahmiyat Coin";
     const std::string COIN_SYMBOL = "AHM";
@@ -104,32 +290,99 @@ private:
     double stakingReward = 0.1;
     std::unordered_map<std::string, std::pair<std::string, int>> governanceProposals;
 
-    void broadcastBlock(const AhmiyatBlock& block, const Node& sender);
+    void broadcastBlock(const AhmiyatBlock& block, const std::string& record, const std::string& fromPeer);
     std::string signTransaction(const Transaction& tx);
-    void saveBlockToDB(const AhmiyatBlock& block);
-    void loadChainFromDB();
-    void syncChain(const std::string& blockData);
+    // The signature addBlock gives tx, which is what isCommitted knows it by.
+    std::string blockSignature(Transaction tx);
+    // chainMutex held. Queues tx unless a copy is pending or committed; throws like CompactTxBatch::push.
+    bool queuePending(const Transaction& tx, const std::string& signature);
+    void saveBlockToDB(const AhmiyatBlock& block, const std::string& record, const std::vector<bool>& applied,
+                       const std::vector<bool>& credited);
     void updateReward(std::string shardId);
     bool validateBlock(const AhmiyatBlock& block);
     void compressState(std::string shardId);
     std::string assignShard(const Transaction& tx);
-    void processPendingTxs();
+    // Produces a block's execution at the block's timestamp; `incoming` replays a
+    // received block's receipts instead of the local inbox, and `map` a stored
+    // block's shard map instead of the current one.
+    BlockExecution executeBlock(const std::string& shardId, const std::vector<Transaction>& txs,
+                                const std::string& minerId, double stake, uint64_t timestamp,
+                                const std::vector<CrossShardReceipt>* incoming = nullptr,
+                                std::shared_ptr<const ShardMap> map = nullptr);
+    void produceBlock(const std::string& shardId, std::vector<Transaction> txs, const MemoryFragment& memory,
+                      const std::string& minerId, double stake);
+    // Writes nothing and returns false when the block would not reach its state root.
+    bool commitBlock(const std::shared_ptr<const AhmiyatBlock>& block, const std::string& record,
+                     const BlockExecution& execution);
+    bool landsOnStateRoot(const std::string& shardId, const BlockExecution& execution);
+    // Returns which incoming receipts were credited by this block. Replay
+    // passes routeReceipts = false: it checks receipts against the store and
+    // rebuilds the router afterwards, so every incoming receipt is credited.
+    std::vector<bool> applyBlock(const std::string& shardId, const BlockExecution& execution, bool routeReceipts = true);
+    double bondedStake(const std::string& shardId, const std::string& minerId);
+    bool knownReceipts(const std::string& shardId, const std::vector<CrossShardReceipt>& incoming, const ShardMap& map);
+    // True if the stored source block at the receipt's height sent it.
+    bool sentBySource(const CrossShardReceipt& receipt);
+    void appendHeader(const AhmiyatBlock& block);
+    // The retarget rule applied to the shard's tip; the tip's difficulty while the shard is too short.
+    int retargetedDifficulty(const std::string& shardId);
+    bool isCommitted(const std::string& shardId, const std::string& signature) const;
+    void recordTxs(const AhmiyatBlock& block);
+    void publishSnapshot(const std::string& shardId, const std::vector<std::string>& touched);
+    void reshard();
+    void migrateStakes(const std::string& fromShard, const ShardMap& map);
+    void migrateRecentTxs(const std::string& fromShard, const ShardMap& map);
+    void installShardMap(std::shared_ptr<const ShardMap> map);
+    friend struct ChainBench;
+    friend class NetworkSimulator;
+    friend class ChainReindexer;
 
 public:
-    AhmiyatChain();
+    explicit AhmiyatChain(const std::string& dbPath = "ahmiyat_db");
     ~AhmiyatChain();
-    void addBlock(const std::vector<Transaction>& txs, const MemoryFragment& memory, std::string minerId, double stake);
+    // Pass txs with std::move when the caller no longer needs them; they are moved through to the blocks.
+    void addBlock(std::vector<Transaction> txs, const MemoryFragment& memory, std::string minerId, double stake);
     void addNode(std::string nodeId, std::string ip, int port);
     double getBalance(std::string address, std::string shardId = "0");
-    void stakeCoins(std::string address, double amount, std::string shardId = "0");
+    // Queues a deposit to STAKE_ADDRESS; the stake is bonded once a block in the address's home shard applies it.
+    void stakeCoins(std::string address, double amount);
     void adjustDifficulty(std::string shardId);
     void startNodeListener(int port);
-    void stressTest(int numBlocks);
+    // Validates a peer's block record by re-executing it against local state
+    // and appends it if it extends the tip. Imported blocks are re-broadcast.
+    ImportResult importBlock(const std::string& record, const std::string& fromPeer = "");
+    ImportStats getImportStats();
+    // Replaces the socket fan-out in broadcastBlock, e.g. with a simulated network.
+    void setTransport(std::shared_ptr<Transport> replacement);
+    void setShardDifficulty(const std::string& shardId, int difficulty);
+    // Replaces the wall clock, e.g. with a simulation's virtual time.
+    void setClock(std::function<uint64_t()> replacement);
+    uint64_t currentTime() const;
+    // Derives the node's signing key from secret instead of a random one.
+    void setSigningKey(const std::string& secret);
+    std::string getMiningStatus();
     void proposeUpgrade(std::string proposerId, std::string description);
     void voteForUpgrade(std::string voterId, std::string proposalId);
     std::string getShardStatus(std::string shardId);
+    std::shared_ptr<const AhmiyatBlock> getBlock(const std::string& hash);
+    // Explorer lookups; served from BlockIndex and LevelDB without chainMutex.
+    std::string getBlockRecord(const std::string& hash);
+    bool locateBlock(const std::string& hash, BlockLocation& location);
+    bool getHeader(const std::string& shardId, uint64_t height, BlockHeader& header);
+    std::vector<BlockHeader> getHeaders(const std::string& shardId, uint64_t from, size_t count);
+    std::string homeShard(const std::string& address);
+    std::string getShardMap();
+    std::string getBalanceProof(const std::string& address, const std::string& shardId);
+    std::string getHistory(const std::string& address, const std::string& cursor, size_t limit = HISTORY_PAGE_SIZE);
     void handleCrossShardTx(const Transaction& tx);
     void addPendingTx(const Transaction& tx);
+    // Queues already validated txs under one lock; stops once the mempool
+    // holds MAX_MEMPOOL_TXS and returns how many were queued. Txs already
+    // pending or committed are skipped and counted in duplicates.
+    size_t addPendingTxs(const std::vector<Transaction>& txs, size_t* duplicates = nullptr);
+    size_t getMempoolSize();
+    void processPendingTxs();
+    void setCommitListener(CommitListener listener);
 };
 
 #endif
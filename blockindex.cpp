@@ -0,0 +1,105 @@
+#include "blockindex.h"
+#include "blockchain.h"
+#include <sstream>
+#include <iomanip>
+#include <algorithm>
+#include <mutex>
+
+void BlockHeader::encode(ByteWriter& writer) const {
+    writer.putRaw(hash.data(), hash.size());
+    writer.putRaw(previousHash.data(), previousHash.size());
+    writer.putU64(height);
+    writer.putU64(timestamp);
+    writer.putU32(static_cast<uint32_t>(difficulty));
+    writer.putF64(stakeWeight);
+    writer.putU64(shardMapVersion);
+    writer.putRaw(stateRoot.data(), stateRoot.size());
+}
+
+std::string BlockHeader::toJson(const std::string& shardId) const {
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    ss << "{\"shard\":\"" << shardId << "\",\"height\":" << height << ",\"hash\":\"" << hashToHex(hash)
+       << "\",\"previousHash\":\"" << hashToHex(previousHash) << "\",\"timestamp\":" << timestamp
+       << ",\"difficulty\":" << difficulty << ",\"stakeWeight\":" << stakeWeight
+       << ",\"shardMapVersion\":" << shardMapVersion << ",\"stateRoot\":\"" << hashToHex(stateRoot) << "\"}";
+    return ss.str();
+}
+
+bool BlockIndex::add(const std::string& shardId, const BlockHeader& header) {
+    std::unique_lock<std::shared_mutex> lock(indexMutex);
+    auto& headers = byShard[shardId];
+    if (header.height != headers.size()) return false;
+    headers.push_back(header);
+    stakeSums[shardId] += header.stakeWeight;
+    byHash[header.hash] = {shardId, header.height};
+    return true;
+}
+
+bool BlockIndex::find(const Hash256& hash, BlockLocation& out) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    auto it = byHash.find(hash);
+    if (it == byHash.end()) return false;
+    out = it->second;
+    return true;
+}
+
+bool BlockIndex::headerAt(const std::string& shardId, uint64_t height, BlockHeader& out) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    auto it = byShard.find(shardId);
+    if (it == byShard.end() || height >= it->second.size()) return false;
+    out = it->second[height];
+    return true;
+}
+
+std::vector<BlockHeader> BlockIndex::range(const std::string& shardId, uint64_t from, size_t count) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    std::vector<BlockHeader> headers;
+    auto it = byShard.find(shardId);
+    if (it == byShard.end() || from >= it->second.size()) return headers;
+    uint64_t end = std::min<uint64_t>(it->second.size(), from + count);
+    headers.assign(it->second.begin() + from, it->second.begin() + end);
+    return headers;
+}
+
+uint64_t BlockIndex::height(const std::string& shardId) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    auto it = byShard.find(shardId);
+    return it != byShard.end() ? it->second.size() : 0;
+}
+
+bool BlockIndex::tip(const std::string& shardId, BlockHeader& out) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    auto it = byShard.find(shardId);
+    if (it == byShard.end() || it->second.empty()) return false;
+    out = it->second.back();
+    return true;
+}
+
+double BlockIndex::stakeSum(const std::string& shardId) const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    auto it = stakeSums.find(shardId);
+    return it != stakeSums.end() ? it->second : 0.0;
+}
+
+std::vector<std::string> BlockIndex::shardIds() const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    std::vector<std::string> ids;
+    ids.reserve(byShard.size());
+    for (const auto& [shardId, headers] : byShard) {
+        if (!headers.empty()) ids.push_back(shardId);
+    }
+    return ids;
+}
+
+size_t BlockIndex::size() const {
+    std::shared_lock<std::shared_mutex> lock(indexMutex);
+    return byHash.size();
+}
+
+void BlockIndex::clear() {
+    std::unique_lock<std::shared_mutex> lock(indexMutex);
+    byHash.clear();
+    byShard.clear();
+    stakeSums.clear();
+}
@@ -0,0 +1,68 @@
+#ifndef BLOCKINDEX_H
+#define BLOCKINDEX_H
+
+#include <string>
+#include <vector>
+#include <shared_mutex>
+#include <unordered_map>
+#include <cstring>
+#include "smt.h"
+#include "codec.h"
+
+// Fixed-size per-block summary kept in memory for every block; bodies live
+// in LevelDB and the BlockCache.
+struct BlockHeader {
+    Hash256 hash;
+    Hash256 previousHash;
+    uint64_t height;
+    uint64_t timestamp;
+    int32_t difficulty;
+    double stakeWeight;
+    uint64_t shardMapVersion;
+    Hash256 stateRoot;
+
+    static const size_t ENCODED_SIZE = 32 + 32 + 8 + 8 + 4 + 8 + 8 + 32;
+    void encode(ByteWriter& writer) const;
+    std::string toJson(const std::string& shardId) const;
+};
+
+struct BlockLocation {
+    std::string shardId;
+    uint64_t height;
+};
+
+// Headers of committed blocks by hash or (shard, height). This is the chain's
+// only copy of them: AhmiyatChain reads tips and heights from here too. It has
+// its own lock so explorer queries never contend with chainMutex.
+class BlockIndex {
+private:
+    // Proof of work zeroes the leading bytes, so bucket by the trailing ones.
+    struct HashKey {
+        size_t operator()(const Hash256& h) const {
+            size_t v;
+            std::memcpy(&v, h.data() + h.size() - sizeof(v), sizeof(v));
+            return v;
+        }
+    };
+    std::unordered_map<Hash256, BlockLocation, HashKey> byHash;
+    std::unordered_map<std::string, std::vector<BlockHeader>> byShard;
+    std::unordered_map<std::string, double> stakeSums;
+    mutable std::shared_mutex indexMutex;
+
+public:
+    // Appends the shard's next header; false, leaving the index unchanged, for any other height.
+    bool add(const std::string& shardId, const BlockHeader& header);
+    bool find(const Hash256& hash, BlockLocation& out) const;
+    bool headerAt(const std::string& shardId, uint64_t height, BlockHeader& out) const;
+    std::vector<BlockHeader> range(const std::string& shardId, uint64_t from, size_t count) const;
+    // Blocks stored for shardId, which is also the height of its next block.
+    uint64_t height(const std::string& shardId) const;
+    bool tip(const std::string& shardId, BlockHeader& out) const;
+    // Stake weight summed over the shard's blocks.
+    double stakeSum(const std::string& shardId) const;
+    std::vector<std::string> shardIds() const;
+    size_t size() const;
+    void clear();
+};
+
+#endif
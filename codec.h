@@ -0,0 +1,84 @@
+#ifndef CODEC_H
+#define CODEC_H
+
+#include <string>
+#include <string_view>
+#include <cstring>
+#include <cstdint>
+#include <stdexcept>
+
+// Little-endian, length-prefixed binary encoding used for stored block
+// records and the binary ingest protocol.
+class ByteWriter {
+private:
+    std::string& out;
+
+public:
+    explicit ByteWriter(std::string& o) : out(o) {}
+    void putU8(uint8_t v) { out.push_back(static_cast<char>(v)); }
+    void putU32(uint32_t v) {
+        for (int i = 0; i < 4; i++) out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+    void putU64(uint64_t v) {
+        for (int i = 0; i < 8; i++) out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+    }
+    void putF64(double v) {
+        uint64_t bits;
+        std::memcpy(&bits, &v, sizeof(bits));
+        putU64(bits);
+    }
+    void putRaw(const void* data, size_t size) { out.append(static_cast<const char*>(data), size); }
+    void putBytes(std::string_view s) {
+        putU32(static_cast<uint32_t>(s.size()));
+        out.append(s);
+    }
+};
+
+class ByteReader {
+private:
+    const char* p;
+    const char* end;
+
+    void need(size_t n) const {
+        if (static_cast<size_t>(end - p) < n) throw std::runtime_error("Truncated record");
+    }
+
+public:
+    ByteReader(const char* data, size_t size) : p(data), end(data + size) {}
+    explicit ByteReader(const std::string& s) : p(s.data()), end(s.data() + s.size()) {}
+    uint8_t getU8() {
+        need(1);
+        return static_cast<uint8_t>(*p++);
+    }
+    uint32_t getU32() {
+        need(4);
+        uint32_t v = 0;
+        for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+        p += 4;
+        return v;
+    }
+    uint64_t getU64() {
+        need(8);
+        uint64_t v = 0;
+        for (int i = 0; i < 8; i++) v |= static_cast<uint64_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+        p += 8;
+        return v;
+    }
+    double getF64() {
+        uint64_t bits = getU64();
+        double v;
+        std::memcpy(&v, &bits, sizeof(v));
+        return v;
+    }
+    std::string getBytes() {
+        uint32_t n = getU32();
+        need(n);
+        std::string s(p, n);
+        p += n;
+        return s;
+    }
+    bool atEnd() const { return p == end; }
+    size_t remaining() const { return static_cast<size_t>(end - p); }
+};
+
+#endif
@@ -0,0 +1,210 @@
+#include "compacttx.h"
+#include "blockchain.h"
+#include "codec.h"
+#include <charconv>
+#include <cstring>
+#include <mutex>
+#include <stdexcept>
+#include <utility>
+
+AddressDictionary::AddressDictionary(AddressDictionary&& other) {
+    std::unique_lock<std::shared_mutex> lock(other.dictionaryMutex);
+    addresses = std::move(other.addresses);
+    ids = std::move(other.ids);
+    totalBytes = std::exchange(other.totalBytes, 0);
+}
+
+AddressDictionary& AddressDictionary::operator=(AddressDictionary&& other) {
+    if (this == &other) return *this;
+    std::scoped_lock lock(dictionaryMutex, other.dictionaryMutex);
+    addresses = std::move(other.addresses);
+    ids = std::move(other.ids);
+    totalBytes = std::exchange(other.totalBytes, 0);
+    return *this;
+}
+
+uint32_t AddressDictionary::intern(const std::string& address) {
+    {
+        std::shared_lock<std::shared_mutex> lock(dictionaryMutex);
+        auto it = ids.find(address);
+        if (it != ids.end()) return it->second;
+    }
+    std::unique_lock<std::shared_mutex> lock(dictionaryMutex);
+    auto it = ids.find(address);
+    if (it != ids.end()) return it->second;
+    if (addresses.size() == UINT32_MAX) throw std::runtime_error("Address dictionary full");
+    uint32_t id = static_cast<uint32_t>(addresses.size());
+    addresses.push_back(address);
+    ids.emplace(addresses.back(), id);
+    // String plus its heap bytes, and one hash node with its bucket pointer.
+    totalBytes += sizeof(std::string) + addresses.back().capacity() + sizeof(std::pair<std::string_view, uint32_t>) +
+                  3 * sizeof(void*);
+    return id;
+}
+
+// Deque elements never move, so the reference outlives the lock.
+const std::string& AddressDictionary::lookup(uint32_t id) const {
+    std::shared_lock<std::shared_mutex> lock(dictionaryMutex);
+    if (id >= addresses.size()) throw std::runtime_error("Unknown address id");
+    return addresses[id];
+}
+
+size_t AddressDictionary::size() const {
+    std::shared_lock<std::shared_mutex> lock(dictionaryMutex);
+    return addresses.size();
+}
+
+size_t AddressDictionary::bytes() const {
+    std::shared_lock<std::shared_mutex> lock(dictionaryMutex);
+    return totalBytes;
+}
+
+char* TxArena::allocate(size_t size) {
+    if (size == 0) return nullptr;
+    if (chunkUsed + size > chunkSize) {
+        chunkSize = std::max(CHUNK_BYTES, size);
+        chunks.emplace_back(new char[chunkSize]);
+        chunkUsed = 0;
+        totalBytes += chunkSize;
+    }
+    char* p = chunks.back().get() + chunkUsed;
+    chunkUsed += size;
+    return p;
+}
+
+std::string_view TxArena::store(const std::string& bytes) {
+    char* p = allocate(bytes.size());
+    if (!p) return std::string_view();
+    std::memcpy(p, bytes.data(), bytes.size());
+    return std::string_view(p, bytes.size());
+}
+
+static int hexDigit(char c) {
+    if (c >= '0' && c <= '9') return c - '0';
+    if (c >= 'a' && c <= 'f') return c - 'a' + 10;
+    return -1;
+}
+
+static bool isLowerHex(const std::string& s) {
+    if (s.empty() || s.size() % 2) return false;
+    for (char c : s) {
+        if (hexDigit(c) < 0) return false;
+    }
+    return true;
+}
+
+static uint16_t parseShard(const std::string& shardId) {
+    unsigned value = 0;
+    auto [end, ec] = std::from_chars(shardId.data(), shardId.data() + shardId.size(), value);
+    if (ec != std::errc() || end != shardId.data() + shardId.size() || value > UINT16_MAX ||
+        std::to_string(value) != shardId) {
+        throw std::runtime_error("Shard id is not a small integer: " + shardId);
+    }
+    return static_cast<uint16_t>(value);
+}
+
+void CompactTxBatch::push(const Transaction& tx) {
+    CompactTx compact;
+    compact.shard = parseShard(tx.shardId);
+    compact.sender = dictionary.intern(tx.sender);
+    compact.receiver = dictionary.intern(tx.receiver);
+    compact.amount = tx.amount;
+    compact.fee = tx.fee;
+    compact.timestamp = tx.timestamp;
+    compact.script = arena.store(tx.script);
+    if (isLowerHex(tx.signature)) {
+        compact.flags |= CompactTx::SIGNATURE_HEX;
+        char* p = arena.allocate(tx.signature.size() / 2);
+        for (size_t i = 0; i < tx.signature.size(); i += 2) {
+            p[i / 2] = static_cast<char>(hexDigit(tx.signature[i]) << 4 | hexDigit(tx.signature[i + 1]));
+        }
+        compact.signature = std::string_view(p, tx.signature.size() / 2);
+    } else {
+        compact.signature = arena.store(tx.signature);
+    }
+    if (!tx.witness.empty()) {
+        size_t total = 0;
+        for (const auto& entry : tx.witness) total += sizeof(uint32_t) + entry.size();
+        char* p = arena.allocate(total);
+        compact.witness = std::string_view(p, total);
+        for (const auto& entry : tx.witness) {
+            uint32_t length = static_cast<uint32_t>(entry.size());
+            std::memcpy(p, &length, sizeof(length));
+            std::memcpy(p + sizeof(length), entry.data(), entry.size());
+            p += sizeof(length) + entry.size();
+        }
+    }
+    txs.push_back(compact);
+}
+
+static const char hexDigits[] = "0123456789abcdef";
+
+static void appendSignature(const CompactTx& compact, std::string& out) {
+    if (!(compact.flags & CompactTx::SIGNATURE_HEX)) {
+        out.append(compact.signature);
+        return;
+    }
+    out.reserve(out.size() + compact.signature.size() * 2);
+    for (unsigned char c : compact.signature) {
+        out.push_back(hexDigits[c >> 4]);
+        out.push_back(hexDigits[c & 0x0f]);
+    }
+}
+
+// Calls f(entry) for each witness entry, in order.
+template <typename F>
+static void forEachWitness(const CompactTx& compact, F f) {
+    const char* p = compact.witness.data();
+    const char* end = p + compact.witness.size();
+    while (p < end) {
+        uint32_t length;
+        std::memcpy(&length, p, sizeof(length));
+        f(std::string_view(p + sizeof(length), length));
+        p += sizeof(length) + length;
+    }
+}
+
+Transaction CompactTxBatch::unpack(size_t index) const {
+    const CompactTx& compact = txs.at(index);
+    Transaction tx;
+    tx.sender = dictionary.lookup(compact.sender);
+    tx.receiver = dictionary.lookup(compact.receiver);
+    tx.amount = compact.amount;
+    tx.fee = compact.fee;
+    tx.timestamp = compact.timestamp;
+    tx.shardId = std::to_string(compact.shard);
+    tx.script.assign(compact.script.data(), compact.script.size());
+    appendSignature(compact, tx.signature);
+    forEachWitness(compact, [&](std::string_view entry) { tx.witness.emplace_back(entry); });
+    return tx;
+}
+
+std::vector<Transaction> CompactTxBatch::unpackAll() const {
+    std::vector<Transaction> out;
+    out.reserve(txs.size());
+    for (size_t i = 0; i < txs.size(); i++) out.push_back(unpack(i));
+    return out;
+}
+
+void CompactTxBatch::encode(size_t index, ByteWriter& writer, std::string& scratch) const {
+    const CompactTx& compact = txs.at(index);
+    char shard[8];
+    writer.putBytes(dictionary.lookup(compact.sender));
+    writer.putBytes(dictionary.lookup(compact.receiver));
+    writer.putF64(compact.amount);
+    writer.putF64(compact.fee);
+    writer.putBytes(compact.script);
+    scratch.clear();
+    appendSignature(compact, scratch);
+    writer.putBytes(scratch);
+    writer.putBytes(std::string_view(shard, std::to_chars(shard, shard + sizeof(shard), compact.shard).ptr - shard));
+    writer.putU64(compact.timestamp);
+    uint32_t count = 0;
+    forEachWitness(compact, [&](std::string_view) { count++; });
+    writer.putU32(count);
+    forEachWitness(compact, [&](std::string_view entry) { writer.putBytes(entry); });
+}
+
+void CompactTxBatch::appendWitness(size_t index, std::string& out) const {
+    forEachWitness(txs.at(index), [&](std::string_view entry) { out.append(entry); });
+}
@@ -0,0 +1,106 @@
+#ifndef COMPACTTX_H
+#define COMPACTTX_H
+
+#include <cstdint>
+#include <deque>
+#include <memory>
+#include <shared_mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+struct Transaction;
+class ByteWriter;
+
+// Intern table for the addresses of one batch. Ids are dense; the strings
+// live in a deque, so references returned by lookup stay valid, also when
+// the batch is moved. It is dropped with its batch, so the addresses of
+// drained transactions do not accumulate. Interning and lookups may run
+// concurrently; lookups only take the shared lock.
+class AddressDictionary {
+private:
+    std::deque<std::string> addresses;
+    std::unordered_map<std::string_view, uint32_t> ids;
+    size_t totalBytes = 0;
+    mutable std::shared_mutex dictionaryMutex;
+
+public:
+    AddressDictionary() = default;
+    AddressDictionary(const AddressDictionary&) = delete;
+    AddressDictionary& operator=(const AddressDictionary&) = delete;
+    AddressDictionary(AddressDictionary&& other);
+    AddressDictionary& operator=(AddressDictionary&& other);
+    uint32_t intern(const std::string& address);
+    const std::string& lookup(uint32_t id) const;
+    size_t size() const;
+    // Approximate memory held by the strings and the id table.
+    size_t bytes() const;
+};
+
+// Bump allocator for variable-length tx bytes. Nothing is freed
+// individually; the arena's chunks are released together.
+class TxArena {
+private:
+    static const size_t CHUNK_BYTES = 64 * 1024;
+    std::vector<std::unique_ptr<char[]>> chunks;
+    size_t chunkUsed = 0;
+    size_t chunkSize = 0;
+    size_t totalBytes = 0;
+
+public:
+    TxArena() = default;
+    TxArena(TxArena&&) = default;
+    TxArena& operator=(TxArena&&) = default;
+    char* allocate(size_t size);
+    std::string_view store(const std::string& bytes);
+    size_t bytes() const { return totalBytes; }
+};
+
+// 88 bytes, against ~240 for Transaction before any of its heap strings.
+// Addresses are ids in the owning batch's dictionary, the shard id a number, signatures are kept
+// as raw bytes when hex, and script, signature and witness point into the
+// owning batch's arena.
+struct CompactTx {
+    static const uint16_t SIGNATURE_HEX = 1;
+    uint32_t sender = 0;
+    uint32_t receiver = 0;
+    uint16_t shard = 0;
+    uint16_t flags = 0;
+    double amount = 0.0;
+    double fee = 0.0;
+    uint64_t timestamp = 0;
+    std::string_view script;
+    std::string_view signature;
+    // Entries stored as a native uint32 length followed by the bytes.
+    std::string_view witness;
+};
+
+// An append-only run of transactions sharing one arena and one address
+// dictionary, e.g. the mempool until its contents go into a block, or the
+// body of a cached block. Dropping the batch frees every tx's bytes and
+// addresses in one shot.
+class CompactTxBatch {
+private:
+    std::vector<CompactTx> txs;
+    TxArena arena;
+    AddressDictionary dictionary;
+
+public:
+    // Throws std::runtime_error if the shard id is not a canonical small integer.
+    void push(const Transaction& tx);
+    Transaction unpack(size_t index) const;
+    std::vector<Transaction> unpackAll() const;
+    // Writes the same bytes as unpack(index).encode(writer); scratch holds the hex signature.
+    void encode(size_t index, ByteWriter& writer, std::string& scratch) const;
+    // Appends the witness entries back to back, as the block hash preimage has them.
+    void appendWitness(size_t index, std::string& out) const;
+    const CompactTx& operator[](size_t index) const { return txs[index]; }
+    size_t size() const { return txs.size(); }
+    bool empty() const { return txs.empty(); }
+    const AddressDictionary& addresses() const { return dictionary; }
+    // Bytes held by the batch, including its arena and dictionary.
+    size_t bytes() const { return txs.capacity() * sizeof(CompactTx) + arena.bytes() + dictionary.bytes(); }
+};
+
+#endif
@@ -0,0 +1,128 @@
+#include "executor.h"
+#include <algorithm>
+#include <atomic>
+#include <thread>
+
+namespace {
+
+// Balances as of the transactions committed so far, layered over the block's pre-state.
+class LayeredView : public AccountView {
+private:
+    const BalanceMap& base;
+    const BalanceMap& written;
+
+public:
+    LayeredView(const BalanceMap& b, const BalanceMap& w) : base(b), written(w) {}
+    double balanceOf(const std::string& address) const override {
+        auto it = written.find(address);
+        if (it != written.end()) return it->second;
+        it = base.find(address);
+        return it != base.end() ? it->second : 0.0;
+    }
+};
+
+class RecordingView : public AccountView {
+private:
+    const AccountView& inner;
+    std::vector<std::string>& reads;
+
+public:
+    RecordingView(const AccountView& i, std::vector<std::string>& r) : inner(i), reads(r) {}
+    double balanceOf(const std::string& address) const override {
+        reads.push_back(address);
+        return inner.balanceOf(address);
+    }
+};
+
+void execute(const ParallelExecutor::Task& task, size_t index, const AccountView& accounts, TxEffects& effects) {
+    effects = TxEffects();
+    RecordingView recording(accounts, effects.reads);
+    task(index, recording, effects);
+}
+
+}
+
+ParallelExecutor::ParallelExecutor(unsigned threadCount)
+    : threads(threadCount ? threadCount : std::max(1u, std::thread::hardware_concurrency())) {
+    if (threads < 2) return;
+    for (size_t id = 0; id < threads; id++) workers.emplace_back(&ParallelExecutor::workerLoop, this, id);
+}
+
+ParallelExecutor::~ParallelExecutor() {
+    {
+        std::lock_guard<std::mutex> lock(poolMutex);
+        stopping = true;
+    }
+    wake.notify_all();
+    for (auto& t : workers) t.join();
+}
+
+void ParallelExecutor::workerLoop(size_t id) {
+    uint64_t seen = 0;
+    std::unique_lock<std::mutex> lock(poolMutex);
+    while (true) {
+        wake.wait(lock, [&] { return stopping || generation != seen; });
+        if (stopping) return;
+        seen = generation;
+        if (id >= wanted) continue;
+        lock.unlock();
+        pass();
+        lock.lock();
+        if (--pending == 0) finished.notify_one();
+    }
+}
+
+ExecutionStats ParallelExecutor::run(size_t count, const BalanceMap& base, const Task& task, const Commit& commit) {
+    std::lock_guard<std::mutex> runLock(runMutex);
+    ExecutionStats stats;
+    stats.txs = count;
+    BalanceMap written;
+    LayeredView committed(base, written);
+    std::vector<TxEffects> effects(count);
+
+    size_t workerCount = std::min<size_t>(workers.size(), count / PARALLEL_TXS_PER_WORKER);
+    if (count >= PARALLEL_EXECUTION_MIN_TXS && workerCount > 1) stats.workers = workerCount;
+    if (stats.workers) {
+        // Nothing is written until the workers finish, so committed is the pre-state here.
+        std::atomic<size_t> next{0};
+        std::unique_lock<std::mutex> lock(poolMutex);
+        pass = [&]() {
+            for (size_t i = next++; i < count; i = next++) {
+                try {
+                    execute(task, i, committed, effects[i]);
+                } catch (const std::exception&) {
+                    effects[i].failed = true;
+                }
+            }
+        };
+        wanted = pending = stats.workers;
+        generation++;
+        wake.notify_all();
+        finished.wait(lock, [&] { return pending == 0; });
+        pass = nullptr;
+    }
+
+    for (size_t i = 0; i < count; i++) {
+        TxEffects& current = effects[i];
+        bool valid = stats.workers && !current.failed;
+        if (valid) {
+            for (const auto& address : current.reads) {
+                if (written.count(address)) {
+                    valid = false;
+                    break;
+                }
+            }
+        }
+        if (!valid) {
+            if (stats.workers) stats.reexecuted++;
+            execute(task, i, committed, current);
+        }
+        for (const auto& [address, delta] : current.writes) {
+            auto it = written.find(address);
+            if (it == written.end()) it = written.emplace(address, committed.balanceOf(address)).first;
+            it->second += delta;
+        }
+        commit(i, current);
+    }
+    return stats;
+}
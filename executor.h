@@ -0,0 +1,74 @@
+#ifndef EXECUTOR_H
+#define EXECUTOR_H
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+#include "script.h"
+#include "snapshot.h"
+
+const size_t PARALLEL_EXECUTION_MIN_TXS = 64;
+const size_t PARALLEL_TXS_PER_WORKER = 32;
+
+// What one run of a transaction touched: the accounts whose balances it read
+// and the balance changes it makes, in the order it makes them.
+struct TxEffects {
+    std::vector<std::string> reads;
+    std::vector<std::pair<std::string, double>> writes;
+    bool failed = false;
+};
+
+struct ExecutionStats {
+    size_t txs = 0;
+    // Speculative worker threads; 0 when the block ran serially.
+    size_t workers = 0;
+    size_t reexecuted = 0;
+};
+
+// Executes a block's transactions optimistically. Every transaction first runs
+// in parallel against the block's pre-state, recording its reads and writes.
+// Results are then committed in block order: a transaction that read an
+// account written by an earlier one is re-executed against the committed
+// prefix, so the outcome is exactly that of running the block serially.
+// Credits are blind writes, so payments into the same account do not conflict.
+// The speculative pass runs on a pool of threads started once with the
+// executor; runs share the pool one at a time.
+class ParallelExecutor {
+public:
+    // Runs one transaction against accounts and records its writes in effects.
+    // May be called more than once for the same index and from worker threads.
+    typedef std::function<void(size_t index, const AccountView& accounts, TxEffects& effects)> Task;
+    // Called once per transaction, in block order, with its final effects.
+    typedef std::function<void(size_t index, const TxEffects& effects)> Commit;
+
+    // 0 threads means one per CPU core; 1 runs every block serially.
+    explicit ParallelExecutor(unsigned threads = 0);
+    ~ParallelExecutor();
+    ParallelExecutor(const ParallelExecutor&) = delete;
+    ParallelExecutor& operator=(const ParallelExecutor&) = delete;
+    ExecutionStats run(size_t count, const BalanceMap& base, const Task& task, const Commit& commit);
+    unsigned getThreads() const { return threads; }
+
+private:
+    unsigned threads;
+    std::vector<std::thread> workers;
+    std::mutex runMutex;
+    std::mutex poolMutex;
+    std::condition_variable wake;
+    std::condition_variable finished;
+    // The current run's speculative pass; workers below `wanted` run it once per generation.
+    std::function<void()> pass;
+    size_t wanted = 0;
+    size_t pending = 0;
+    uint64_t generation = 0;
+    bool stopping = false;
+    void workerLoop(size_t id);
+};
+
+#endif
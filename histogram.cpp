@@ -0,0 +1,89 @@
+#include "histogram.h"
+#include <cmath>
+#include <algorithm>
+#include <stdexcept>
+
+HdrHistogram::HdrHistogram(uint64_t highest, int significantDigits) : highestTrackableValue(highest) {
+    if (significantDigits < 1 || significantDigits > 5 || highest < 2) {
+        throw std::runtime_error("Invalid histogram configuration");
+    }
+    uint64_t largestSingleUnit = 2;
+    for (int i = 0; i < significantDigits; i++) largestSingleUnit *= 10;
+    int subBucketCountMagnitude = static_cast<int>(std::ceil(std::log2(static_cast<double>(largestSingleUnit))));
+    subBucketHalfCountMagnitude = std::max(0, subBucketCountMagnitude - 1);
+    int subBucketCount = 1 << (subBucketHalfCountMagnitude + 1);
+    subBucketHalfCount = subBucketCount / 2;
+    subBucketMask = static_cast<uint64_t>(subBucketCount - 1);
+
+    uint64_t smallestUntrackable = static_cast<uint64_t>(subBucketCount);
+    int bucketCount = 1;
+    while (smallestUntrackable <= highest) {
+        if (smallestUntrackable > UINT64_MAX / 2) {
+            bucketCount++;
+            break;
+        }
+        smallestUntrackable <<= 1;
+        bucketCount++;
+    }
+    counts.assign(static_cast<size_t>(bucketCount + 1) * subBucketHalfCount, 0);
+}
+
+int HdrHistogram::countsIndex(uint64_t value) const {
+    int bucketIndex = 64 - __builtin_clzll(value | subBucketMask) - (subBucketHalfCountMagnitude + 1);
+    int subBucketIndex = static_cast<int>(value >> bucketIndex);
+    return ((bucketIndex + 1) << subBucketHalfCountMagnitude) + (subBucketIndex - subBucketHalfCount);
+}
+
+uint64_t HdrHistogram::valueFromIndex(int index) const {
+    int bucketIndex = (index >> subBucketHalfCountMagnitude) - 1;
+    int subBucketIndex = (index & (subBucketHalfCount - 1)) + subBucketHalfCount;
+    if (bucketIndex < 0) {
+        subBucketIndex -= subBucketHalfCount;
+        bucketIndex = 0;
+    }
+    return static_cast<uint64_t>(subBucketIndex) << bucketIndex;
+}
+
+uint64_t HdrHistogram::highestEquivalentValue(uint64_t value) const {
+    int bucketIndex = 64 - __builtin_clzll(value | subBucketMask) - (subBucketHalfCountMagnitude + 1);
+    uint64_t lowest = (value >> bucketIndex) << bucketIndex;
+    return lowest + (1ULL << bucketIndex) - 1;
+}
+
+void HdrHistogram::record(uint64_t value) {
+    value = std::min(value, highestTrackableValue);
+    counts[countsIndex(value)]++;
+    total++;
+    minValue = std::min(minValue, value);
+    maxValue = std::max(maxValue, value);
+    sum += static_cast<double>(value);
+}
+
+void HdrHistogram::merge(const HdrHistogram& other) {
+    if (other.counts.size() != counts.size()) throw std::runtime_error("Histogram layouts differ");
+    for (size_t i = 0; i < counts.size(); i++) counts[i] += other.counts[i];
+    total += other.total;
+    minValue = std::min(minValue, other.minValue);
+    maxValue = std::max(maxValue, other.maxValue);
+    sum += other.sum;
+}
+
+void HdrHistogram::reset() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    minValue = UINT64_MAX;
+    maxValue = 0;
+    sum = 0.0;
+}
+
+uint64_t HdrHistogram::valueAtPercentile(double percentile) const {
+    if (total == 0) return 0;
+    percentile = std::min(std::max(percentile, 0.0), 100.0);
+    uint64_t target = std::max<uint64_t>(1, static_cast<uint64_t>(std::ceil(percentile / 100.0 * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < counts.size(); i++) {
+        seen += counts[i];
+        if (seen >= target) return std::min(highestEquivalentValue(valueFromIndex(static_cast<int>(i))), maxValue);
+    }
+    return maxValue;
+}
@@ -0,0 +1,37 @@
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include <cstdint>
+#include <vector>
+
+// Log-linear (HDR) histogram: fixed relative precision of
+// significantDigits across [1, highestTrackableValue]. Not thread-safe.
+class HdrHistogram {
+private:
+    uint64_t highestTrackableValue;
+    int subBucketHalfCountMagnitude;
+    int subBucketHalfCount;
+    uint64_t subBucketMask;
+    std::vector<uint64_t> counts;
+    uint64_t total = 0;
+    uint64_t minValue = UINT64_MAX;
+    uint64_t maxValue = 0;
+    double sum = 0.0;
+
+    int countsIndex(uint64_t value) const;
+    uint64_t valueFromIndex(int index) const;
+    uint64_t highestEquivalentValue(uint64_t value) const;
+
+public:
+    explicit HdrHistogram(uint64_t highestTrackableValue = 3600ULL * 1000000000ULL, int significantDigits = 3);
+    void record(uint64_t value);
+    void merge(const HdrHistogram& other);
+    void reset();
+    uint64_t valueAtPercentile(double percentile) const;
+    uint64_t totalCount() const { return total; }
+    uint64_t min() const { return total ? minValue : 0; }
+    uint64_t max() const { return maxValue; }
+    double mean() const { return total ? sum / total : 0.0; }
+};
+
+#endif
@@ -0,0 +1,188 @@
+#include "history.h"
+#include "blockchain.h"
+#include "codec.h"
+#include "shardmap.h"
+#include <memory>
+#include <algorithm>
+#include <sstream>
+#include <iomanip>
+
+static const std::string HISTORY_PREFIX = "h:";
+
+static std::string addressPrefix(const std::string& address) {
+    std::string prefix = HISTORY_PREFIX + address;
+    prefix.push_back('\0');
+    return prefix;
+}
+
+static void putBigEndian(std::string& out, uint64_t v, int bytes) {
+    for (int i = bytes - 1; i >= 0; i--) out.push_back(static_cast<char>((v >> (8 * i)) & 0xff));
+}
+
+static uint64_t getBigEndian(const char* p, int bytes) {
+    uint64_t v = 0;
+    for (int i = 0; i < bytes; i++) v = (v << 8) | static_cast<uint8_t>(p[i]);
+    return v;
+}
+
+static std::string toHex(const std::string& bytes) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(bytes.size() * 2);
+    for (unsigned char c : bytes) {
+        hex.push_back(digits[c >> 4]);
+        hex.push_back(digits[c & 0x0f]);
+    }
+    return hex;
+}
+
+static bool fromHex(const std::string& hex, std::string& out) {
+    if (hex.size() % 2) return false;
+    out.clear();
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        int v = 0;
+        for (int j = 0; j < 2; j++) {
+            char c = hex[i + j];
+            int d = c >= '0' && c <= '9' ? c - '0' : c >= 'a' && c <= 'f' ? c - 'a' + 10 : -1;
+            if (d < 0) return false;
+            v = v * 16 + d;
+        }
+        out.push_back(static_cast<char>(v));
+    }
+    return true;
+}
+
+std::string HistoryIndex::rowKey(const std::string& address, const std::string& shardId, uint64_t height, uint32_t index,
+                                 HistoryKind kind) {
+    std::string key = addressPrefix(address);
+    key.append(shardId);
+    key.push_back('\0');
+    putBigEndian(key, height, 8);
+    putBigEndian(key, index, 4);
+    key.push_back(static_cast<char>(kind));
+    return key;
+}
+
+static std::string encodeRow(HistoryKind kind, const std::string& blockHash, const std::string& txHash,
+                             const std::string& counterparty, double amount, double fee, uint64_t timestamp) {
+    std::string value;
+    ByteWriter writer(value);
+    writer.putU8(static_cast<uint8_t>(kind));
+    writer.putBytes(blockHash);
+    writer.putBytes(txHash);
+    writer.putBytes(counterparty);
+    writer.putF64(amount);
+    writer.putF64(fee);
+    writer.putU64(timestamp);
+    return value;
+}
+
+void HistoryIndex::indexBlock(leveldb::WriteBatch& batch, const AhmiyatBlock& block, const std::vector<bool>& applied,
+                              const std::vector<bool>& credited, const ShardMap& map) {
+    const std::string& shardId = block.getShardId();
+    uint64_t height = static_cast<uint64_t>(block.getIndex());
+    std::string blockHash = block.getHash();
+    uint32_t index = 0;
+    for (const auto& tx : block.getTransactions()) {
+        if (index >= applied.size() || !applied[index]) {
+            index++;
+            continue;
+        }
+        std::string txHash = tx.getHash();
+        batch.Put(rowKey(tx.sender, shardId, height, index, HistoryKind::Sent),
+                  encodeRow(HistoryKind::Sent, blockHash, txHash, tx.receiver, tx.amount, tx.fee, tx.timestamp));
+        if (map.lookup(tx.receiver) == shardId) {
+            batch.Put(rowKey(tx.receiver, shardId, height, index, HistoryKind::Received),
+                      encodeRow(HistoryKind::Received, blockHash, txHash, tx.sender, tx.amount, 0.0, tx.timestamp));
+        }
+        index++;
+    }
+    const auto& receipts = block.getIncomingReceipts();
+    for (size_t i = 0; i < receipts.size(); i++, index++) {
+        if (i >= credited.size() || !credited[i]) continue;
+        const CrossShardReceipt& receipt = receipts[i];
+        batch.Put(rowKey(receipt.receiver, shardId, height, index, HistoryKind::ReceiptCredited),
+                  encodeRow(HistoryKind::ReceiptCredited, blockHash, receipt.id, receipt.fromShard, receipt.amount, 0.0,
+                            block.getTimestamp()));
+    }
+}
+
+HistoryPage HistoryIndex::query(const std::string& address, const std::string& cursor, size_t limit) const {
+    HistoryPage page;
+    if (!db || address.empty()) return page;
+    limit = std::min(limit ? limit : HISTORY_PAGE_SIZE, HISTORY_MAX_PAGE_SIZE);
+    std::string prefix = addressPrefix(address);
+    std::string start = prefix;
+    std::string resume;
+    if (!cursor.empty() && fromHex(cursor, resume)) start += resume;
+
+    std::unique_ptr<leveldb::Iterator> it(db->NewIterator(leveldb::ReadOptions()));
+    it->Seek(start);
+    if (!resume.empty() && it->Valid() && it->key().ToString() == start) it->Next();
+    for (; it->Valid() && it->key().starts_with(prefix); it->Next()) {
+        if (page.entries.size() == limit) {
+            page.nextCursor = toHex(resume);
+            break;
+        }
+        leveldb::Slice key = it->key();
+        const char* suffix = key.data() + prefix.size();
+        size_t suffixLen = key.size() - prefix.size();
+        size_t sep = std::string(suffix, suffixLen).find('\0');
+        if (sep == std::string::npos || suffixLen != sep + 1 + 13) continue;
+        try {
+            HistoryEntry entry;
+            entry.shardId.assign(suffix, sep);
+            entry.height = getBigEndian(suffix + sep + 1, 8);
+            entry.index = static_cast<uint32_t>(getBigEndian(suffix + sep + 9, 4));
+            ByteReader reader(it->value().data(), it->value().size());
+            entry.kind = static_cast<HistoryKind>(reader.getU8());
+            entry.blockHash = reader.getBytes();
+            entry.txHash = reader.getBytes();
+            entry.counterparty = reader.getBytes();
+            entry.amount = reader.getF64();
+            entry.fee = reader.getF64();
+            entry.timestamp = reader.getU64();
+            page.entries.push_back(entry);
+            resume.assign(suffix, suffixLen);
+        } catch (const std::exception&) {
+            continue;
+        }
+    }
+    return page;
+}
+
+static std::string jsonEscape(const std::string& s) {
+    std::string out;
+    for (char c : s) {
+        if (c == '"' || c == '\\') {
+            out.push_back('\\');
+            out.push_back(c);
+        } else if (static_cast<unsigned char>(c) < 0x20) {
+            std::stringstream ss;
+            ss << "\\u" << std::hex << std::setw(4) << std::setfill('0') << static_cast<int>(c);
+            out += ss.str();
+        } else {
+            out.push_back(c);
+        }
+    }
+    return out;
+}
+
+std::string HistoryIndex::toJson(const std::string& address, const HistoryPage& page) {
+    static const char* kinds[] = {"sent", "received", "receipt"};
+    std::stringstream ss;
+    ss << std::setprecision(17);
+    ss << "{\"address\":\"" << jsonEscape(address) << "\",\"entries\":[";
+    for (size_t i = 0; i < page.entries.size(); i++) {
+        const HistoryEntry& e = page.entries[i];
+        ss << (i ? "," : "") << "{\"shard\":\"" << jsonEscape(e.shardId) << "\",\"height\":" << e.height
+           << ",\"index\":" << e.index << ",\"kind\":\"" << kinds[static_cast<int>(e.kind) % 3]
+           << "\",\"block\":\"" << e.blockHash << "\",\"tx\":\"" << e.txHash << "\",\"counterparty\":\""
+           << jsonEscape(e.counterparty) << "\",\"amount\":" << e.amount << ",\"fee\":" << e.fee
+           << ",\"timestamp\":" << e.timestamp << "}";
+    }
+    ss << "]";
+    if (!page.nextCursor.empty()) ss << ",\"cursor\":\"" << page.nextCursor << "\"";
+    ss << "}";
+    return ss.str();
+}
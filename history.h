@@ -0,0 +1,60 @@
+#ifndef HISTORY_H
+#define HISTORY_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+#include <leveldb/db.h>
+#include <leveldb/write_batch.h>
+
+class AhmiyatBlock;
+class ShardMap;
+
+const size_t HISTORY_PAGE_SIZE = 50;
+const size_t HISTORY_MAX_PAGE_SIZE = 500;
+
+enum class HistoryKind : uint8_t { Sent = 0, Received = 1, ReceiptCredited = 2 };
+
+// One index row: enough to describe the transfer without loading its block.
+struct HistoryEntry {
+    std::string shardId;
+    uint64_t height = 0;
+    uint32_t index = 0;
+    HistoryKind kind = HistoryKind::Sent;
+    std::string blockHash;
+    std::string txHash;
+    std::string counterparty;
+    double amount = 0.0;
+    double fee = 0.0;
+    uint64_t timestamp = 0;
+};
+
+struct HistoryPage {
+    std::vector<HistoryEntry> entries;
+    std::string nextCursor;
+};
+
+// Secondary index in the chain's LevelDB. Rows are keyed
+// h:<address>\0<shard>\0<height BE64><tx index BE32><kind>, so one address's
+// history is a single contiguous, ordered key range and no two rows of one
+// transaction share a key.
+class HistoryIndex {
+private:
+    leveldb::DB* db;
+
+public:
+    explicit HistoryIndex(leveldb::DB* database = nullptr) : db(database) {}
+    void attach(leveldb::DB* database) { db = database; }
+    // Adds the block's rows to batch so they commit atomically with the block.
+    // Only transactions flagged in applied and receipts flagged in credited get
+    // rows. A receiver homed elsewhere under the block's map gets its row when
+    // its shard credits the receipt, not here.
+    static void indexBlock(leveldb::WriteBatch& batch, const AhmiyatBlock& block, const std::vector<bool>& applied,
+                           const std::vector<bool>& credited, const ShardMap& map);
+    static std::string rowKey(const std::string& address, const std::string& shardId, uint64_t height, uint32_t index,
+                              HistoryKind kind);
+    HistoryPage query(const std::string& address, const std::string& cursor, size_t limit) const;
+    static std::string toJson(const std::string& address, const HistoryPage& page);
+};
+
+#endif
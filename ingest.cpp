@@ -0,0 +1,389 @@
+#include "ingest.h"
+#include "metrics.h"
+#include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <unordered_set>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+static MetricsRegistry& metrics = MetricsRegistry::instance();
+static MetricCounter& ingestFrames = metrics.counter("ahmiyat_ingest_frames_total", "Transaction frames received on the ingest socket");
+static MetricCounter& ingestAccepted = metrics.counter("ahmiyat_ingest_accepted_total", "Ingested transactions queued in the mempool");
+static MetricCounter& ingestRejected = metrics.counter("ahmiyat_ingest_rejected_total", "Ingested frames that were invalid, duplicate or dropped");
+static MetricGauge& ingestOutstanding = metrics.gauge("ahmiyat_ingest_outstanding_credits", "Credits granted to ingest clients and not yet used");
+
+struct IngestConnection {
+    int sock;
+    std::mutex mutex;
+    bool open = true;
+    std::atomic<int64_t> credits{0};
+    std::atomic<bool> finished{false};
+    // Batcher-only bookkeeping.
+    uint32_t owed = 0;
+    bool starved = false;
+    explicit IngestConnection(int fd) : sock(fd) {}
+};
+
+static bool readFully(int sock, char* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = read(sock, buffer, size);
+        if (n <= 0) return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+static bool writeFully(int sock, const char* buffer, size_t size) {
+    while (size > 0) {
+        ssize_t n = ::send(sock, buffer, size, MSG_NOSIGNAL);
+        if (n <= 0) return false;
+        buffer += n;
+        size -= n;
+    }
+    return true;
+}
+
+static uint32_t readU32(const char* p) {
+    uint32_t v = 0;
+    for (int i = 0; i < 4; i++) v |= static_cast<uint32_t>(static_cast<uint8_t>(p[i])) << (8 * i);
+    return v;
+}
+
+bool parseIngestAddress(const std::string& address, IngestConfig& config) {
+    if (address.empty()) return false;
+    if (address.find_first_not_of("0123456789") != std::string::npos) {
+        config.unixPath = address;
+        return true;
+    }
+    try {
+        config.port = std::stoi(address);
+    } catch (const std::exception&) {
+        return false;
+    }
+    return config.port > 0 && config.port < 65536;
+}
+
+IngestServer::IngestServer(AhmiyatChain& c, const IngestConfig& cfg) : chain(c), config(cfg) {}
+
+IngestServer::~IngestServer() {
+    stop();
+}
+
+bool IngestServer::start() {
+    if (!config.unixPath.empty()) {
+        sockaddr_un addr{};
+        if (config.unixPath.size() >= sizeof(addr.sun_path)) return false;
+        listenSock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (listenSock < 0) return false;
+        addr.sun_family = AF_UNIX;
+        config.unixPath.copy(addr.sun_path, config.unixPath.size());
+        unlink(config.unixPath.c_str());
+        if (bind(listenSock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+            log("Ingest bind failed on " + config.unixPath);
+            close(listenSock);
+            listenSock = -1;
+            return false;
+        }
+    } else {
+        listenSock = socket(AF_INET, SOCK_STREAM, 0);
+        if (listenSock < 0) return false;
+        int opt = 1;
+        setsockopt(listenSock, SOL_SOCKET, SO_REUSEADDR, &opt, sizeof(opt));
+        sockaddr_in addr{};
+        addr.sin_family = AF_INET;
+        addr.sin_port = htons(config.port);
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        socklen_t len = sizeof(addr);
+        if (bind(listenSock, (sockaddr*)&addr, sizeof(addr)) < 0 ||
+            getsockname(listenSock, (sockaddr*)&addr, &len) < 0) {
+            log("Ingest bind failed on port " + std::to_string(config.port));
+            close(listenSock);
+            listenSock = -1;
+            return false;
+        }
+        config.port = ntohs(addr.sin_port);
+    }
+    listen(listenSock, 64);
+    running = true;
+    batchThread = std::thread(&IngestServer::batchLoop, this);
+    acceptThread = std::thread(&IngestServer::acceptLoop, this);
+    log("Ingest listening on " + (config.unixPath.empty() ? "port " + std::to_string(config.port) : config.unixPath));
+    return true;
+}
+
+void IngestServer::stop() {
+    if (!running.exchange(false)) return;
+    shutdown(listenSock, SHUT_RDWR);
+    close(listenSock);
+    if (acceptThread.joinable()) acceptThread.join();
+    {
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        // readLoop closes the socket once it has marked the connection closed,
+        // so under its mutex an open connection's fd is still ours to shut down.
+        for (auto& [connection, thread] : connections) {
+            std::lock_guard<std::mutex> connectionLock(connection->mutex);
+            if (connection->open) shutdown(connection->sock, SHUT_RDWR);
+        }
+        for (auto& [connection, thread] : connections) thread.join();
+        connections.clear();
+    }
+    if (batchThread.joinable()) batchThread.join();
+    starved.clear();
+    if (!config.unixPath.empty()) unlink(config.unixPath.c_str());
+}
+
+void IngestServer::acceptLoop() {
+    while (running) {
+        int sock = accept(listenSock, nullptr, nullptr);
+        if (sock < 0) continue;
+        auto connection = std::make_shared<IngestConnection>(sock);
+        {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            stats.connections++;
+        }
+        std::lock_guard<std::mutex> lock(connectionsMutex);
+        for (auto it = connections.begin(); it != connections.end();) {
+            if (it->first->finished) {
+                it->second.join();
+                it = connections.erase(it);
+            } else {
+                ++it;
+            }
+        }
+        connections.emplace_back(connection, std::thread(&IngestServer::readLoop, this, connection));
+    }
+}
+
+void IngestServer::readLoop(std::shared_ptr<IngestConnection> connection) {
+    Frame hello;
+    hello.connection = connection;
+    hello.hello = true;
+    queue.push(std::move(hello));
+    char header[4];
+    while (running && readFully(connection->sock, header, sizeof(header))) {
+        uint32_t length = readU32(header);
+        // A frame sent without a credit, or an oversized one, ends the stream.
+        if (length == 0 || length > INGEST_MAX_FRAME_BYTES || connection->credits.fetch_sub(1) <= 0) {
+            std::lock_guard<std::mutex> lock(statsMutex);
+            stats.protocolErrors++;
+            break;
+        }
+        outstanding--;
+        Frame frame;
+        frame.connection = connection;
+        frame.payload.resize(length);
+        if (!readFully(connection->sock, &frame.payload[0], length)) break;
+        queue.push(std::move(frame));
+    }
+    {
+        std::lock_guard<std::mutex> lock(connection->mutex);
+        connection->open = false;
+        int64_t unused = connection->credits.exchange(0);
+        if (unused > 0) outstanding -= unused;
+    }
+    close(connection->sock);
+    connection->finished = true;
+}
+
+void IngestServer::batchLoop() {
+    std::vector<Frame> frames;
+    frames.reserve(config.batchSize);
+    int idleMicros = 0;
+    while (running) {
+        Frame frame;
+        while (frames.size() < config.batchSize && queue.pop(frame)) frames.push_back(std::move(frame));
+        if (frames.empty()) {
+            grantCredits();
+            idleMicros = std::min(std::max(idleMicros * 2, 50), 1000);
+            std::this_thread::sleep_for(std::chrono::microseconds(idleMicros));
+            continue;
+        }
+        idleMicros = 0;
+        processBatch(frames);
+        frames.clear();
+        grantCredits();
+    }
+}
+
+void IngestServer::processBatch(std::vector<Frame>& frames) {
+    std::vector<Transaction> txs;
+    txs.reserve(frames.size());
+    std::unordered_set<std::string> seen;
+    uint64_t received = 0, invalid = 0, duplicates = 0;
+    for (auto& frame : frames) {
+        IngestConnection& connection = *frame.connection;
+        connection.owed += frame.hello ? config.window : 1;
+        if (!connection.starved) {
+            connection.starved = true;
+            starved.push_back(frame.connection);
+        }
+        if (frame.hello) continue;
+        received++;
+        try {
+            ByteReader reader(frame.payload);
+            Transaction tx = Transaction::decode(reader);
+            if (reader.remaining() || !tx.validate()) {
+                invalid++;
+                continue;
+            }
+            if (!seen.insert(tx.getHash()).second) {
+                duplicates++;
+                continue;
+            }
+            tx.shardId = chain.homeShard(tx.sender);
+            txs.push_back(std::move(tx));
+        } catch (const std::exception&) {
+            invalid++;
+        }
+    }
+    // The chain skips txs already pending or committed, e.g. resent by a client after a reconnect.
+    size_t known = 0;
+    size_t accepted = txs.empty() ? 0 : chain.addPendingTxs(txs, &known);
+    duplicates += known;
+    ingestFrames.inc(received);
+    ingestAccepted.inc(accepted);
+    ingestRejected.inc(received - accepted);
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.frames += received;
+    stats.accepted += accepted;
+    stats.invalid += invalid;
+    stats.duplicates += duplicates;
+    stats.dropped += txs.size() - accepted - known;
+    stats.batches++;
+}
+
+void IngestServer::grantCredits() {
+    if (starved.empty()) return;
+    size_t used = chain.getMempoolSize() + outstanding.load();
+    size_t room = config.mempoolCapacity > used ? config.mempoolCapacity - used : 0;
+    uint64_t granted = 0;
+    std::vector<std::shared_ptr<IngestConnection>> waiting;
+    for (auto& connection : starved) {
+        uint32_t grant = static_cast<uint32_t>(std::min<size_t>(connection->owed, room));
+        bool open;
+        {
+            std::lock_guard<std::mutex> lock(connection->mutex);
+            open = connection->open;
+            if (open && grant) {
+                char frame[4];
+                for (int i = 0; i < 4; i++) frame[i] = static_cast<char>((grant >> (8 * i)) & 0xff);
+                connection->credits += grant;
+                outstanding += grant;
+                if (!writeFully(connection->sock, frame, sizeof(frame))) {
+                    connection->credits -= grant;
+                    outstanding -= grant;
+                    grant = 0;
+                }
+            }
+        }
+        connection->owed -= grant;
+        room -= grant;
+        granted += grant;
+        if (open && connection->owed) {
+            waiting.push_back(connection);
+        } else {
+            connection->starved = false;
+        }
+    }
+    starved.swap(waiting);
+    ingestOutstanding.set(outstanding.load());
+    if (!granted) return;
+    std::lock_guard<std::mutex> lock(statsMutex);
+    stats.creditsGranted += granted;
+}
+
+IngestStats IngestServer::getStats() const {
+    std::lock_guard<std::mutex> lock(statsMutex);
+    return stats;
+}
+
+IngestClient::~IngestClient() {
+    close();
+}
+
+bool IngestClient::connectTcp(const std::string& host, int port) {
+    close();
+    sockaddr_in addr{};
+    addr.sin_family = AF_INET;
+    addr.sin_port = htons(port);
+    if (inet_pton(AF_INET, host.c_str(), &addr.sin_addr) != 1) return false;
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool IngestClient::connectUnix(const std::string& path) {
+    close();
+    sockaddr_un addr{};
+    if (path.size() >= sizeof(addr.sun_path)) return false;
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, path.size());
+    sock = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (sock < 0) return false;
+    if (connect(sock, (sockaddr*)&addr, sizeof(addr)) < 0) {
+        close();
+        return false;
+    }
+    return true;
+}
+
+bool IngestClient::readCredits(int timeoutMs) {
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::milliseconds(timeoutMs);
+    while (sock >= 0) {
+        int wait = -1;
+        if (timeoutMs >= 0) {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline - std::chrono::steady_clock::now());
+            wait = static_cast<int>(std::max<int64_t>(0, left.count()));
+        }
+        // Once a credit is in hand, only collect grants that have already arrived.
+        pollfd pfd{sock, POLLIN, 0};
+        int ready = poll(&pfd, 1, credits ? 0 : wait);
+        if (ready <= 0) return credits > 0;
+        char frame[4];
+        if (!readFully(sock, frame, sizeof(frame))) {
+            close();
+            return false;
+        }
+        credits += readU32(frame);
+    }
+    return false;
+}
+
+bool IngestClient::send(const Transaction& tx, int timeoutMs) {
+    std::string payload;
+    ByteWriter writer(payload);
+    tx.encode(writer);
+    return sendRaw(payload, timeoutMs);
+}
+
+bool IngestClient::sendRaw(const std::string& payload, int timeoutMs) {
+    if (sock < 0) return false;
+    if (!credits && !readCredits(timeoutMs)) return false;
+    std::string frame;
+    frame.reserve(4 + payload.size());
+    ByteWriter writer(frame);
+    writer.putU32(static_cast<uint32_t>(payload.size()));
+    writer.putRaw(payload.data(), payload.size());
+    if (!writeFully(sock, frame.data(), frame.size())) {
+        close();
+        return false;
+    }
+    credits--;
+    return true;
+}
+
+void IngestClient::close() {
+    if (sock < 0) return;
+    ::close(sock);
+    sock = -1;
+}
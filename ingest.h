@@ -0,0 +1,150 @@
+#ifndef INGEST_H
+#define INGEST_H
+
+#include "blockchain.h"
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+const uint32_t INGEST_MAX_FRAME_BYTES = 64 * 1024;
+const uint32_t INGEST_WINDOW = 256;
+const size_t INGEST_BATCH_SIZE = 512;
+
+// Unbounded multi-producer, single-consumer queue (Vyukov). push never
+// blocks or locks; only the consumer thread may call pop.
+template <typename T>
+class MpscQueue {
+private:
+    struct Node {
+        std::atomic<Node*> next{nullptr};
+        T value;
+    };
+    std::atomic<Node*> head;
+    Node* tail;
+
+public:
+    MpscQueue() : head(new Node()), tail(head.load()) {}
+    ~MpscQueue() {
+        while (tail) {
+            Node* next = tail->next.load(std::memory_order_relaxed);
+            delete tail;
+            tail = next;
+        }
+    }
+    MpscQueue(const MpscQueue&) = delete;
+    MpscQueue& operator=(const MpscQueue&) = delete;
+
+    void push(T value) {
+        Node* node = new Node();
+        node->value = std::move(value);
+        Node* prev = head.exchange(node, std::memory_order_acq_rel);
+        prev->next.store(node, std::memory_order_release);
+    }
+    bool pop(T& out) {
+        Node* next = tail->next.load(std::memory_order_acquire);
+        if (!next) return false;
+        out = std::move(next->value);
+        delete tail;
+        tail = next;
+        return true;
+    }
+};
+
+struct IngestConfig {
+    int port = 0;
+    // Listens on this Unix socket instead of TCP when set.
+    std::string unixPath;
+    uint32_t window = INGEST_WINDOW;
+    size_t batchSize = INGEST_BATCH_SIZE;
+    // Credits are only granted while the mempool plus credits already handed
+    // out stay under this many transactions.
+    size_t mempoolCapacity = MAX_MEMPOOL_TXS;
+};
+
+struct IngestStats {
+    uint64_t connections = 0;
+    uint64_t frames = 0;
+    uint64_t accepted = 0;
+    uint64_t invalid = 0;
+    uint64_t duplicates = 0;
+    uint64_t dropped = 0;
+    uint64_t batches = 0;
+    uint64_t creditsGranted = 0;
+    uint64_t protocolErrors = 0;
+};
+
+struct IngestConnection;
+
+// Persistent binary transaction stream. Clients send frames of
+// [u32 length][Transaction::encode], little-endian like the block codec, and
+// may only send as many frames as they hold credits. The server grants
+// credits in [u32 count] frames: a window on connect, then one per frame
+// once the batcher has taken it, but only while the mempool has room. A
+// full mempool therefore stalls clients instead of growing memory.
+//
+// Connection threads only frame bytes and push onto a lock-free queue. A
+// single batcher thread decodes, dedupes, shards and validates each batch
+// and hands it to the chain under one chainMutex acquisition.
+class IngestServer {
+private:
+    struct Frame {
+        std::shared_ptr<IngestConnection> connection;
+        std::string payload;
+        bool hello = false;
+    };
+
+    AhmiyatChain& chain;
+    IngestConfig config;
+    int listenSock = -1;
+    std::atomic<bool> running{false};
+    std::atomic<uint64_t> outstanding{0};
+    MpscQueue<Frame> queue;
+    std::thread acceptThread;
+    std::thread batchThread;
+    std::mutex connectionsMutex;
+    std::vector<std::pair<std::shared_ptr<IngestConnection>, std::thread>> connections;
+    // Connections owed credits the mempool had no room for; batcher only.
+    std::vector<std::shared_ptr<IngestConnection>> starved;
+    mutable std::mutex statsMutex;
+    IngestStats stats;
+
+    void acceptLoop();
+    void readLoop(std::shared_ptr<IngestConnection> connection);
+    void batchLoop();
+    void processBatch(std::vector<Frame>& frames);
+    void grantCredits();
+
+public:
+    IngestServer(AhmiyatChain& chain, const IngestConfig& config);
+    ~IngestServer();
+    bool start();
+    void stop();
+    // Bound TCP port, useful when config.port was 0.
+    int getPort() const { return config.port; }
+    IngestStats getStats() const;
+};
+
+// Blocking client for the ingest protocol.
+class IngestClient {
+private:
+    int sock = -1;
+    uint32_t credits = 0;
+    bool readCredits(int timeoutMs);
+
+public:
+    ~IngestClient();
+    bool connectTcp(const std::string& host, int port);
+    bool connectUnix(const std::string& path);
+    // Waits up to timeoutMs for a credit, then sends the frame. Returns false
+    // if no credit arrived in time or the connection failed.
+    bool send(const Transaction& tx, int timeoutMs = -1);
+    bool sendRaw(const std::string& payload, int timeoutMs = -1);
+    uint32_t getCredits() const { return credits; }
+    void close();
+};
+
+bool parseIngestAddress(const std::string& address, IngestConfig& config);
+
+#endif
@@ -0,0 +1,176 @@
+#include "loadgen.h"
+#include "histogram.h"
+#include "utils.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <thread>
+
+typedef std::chrono::steady_clock Clock;
+
+static std::string txKey(const Transaction& tx) {
+    return tx.sender + ":" + std::to_string(tx.timestamp);
+}
+
+bool parseLoadGenArgs(int argc, char* argv[], LoadGenConfig& config) {
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        try {
+            if (arg == "--wallets") config.wallets = std::stoi(value);
+            else if (arg == "--txs") config.transactions = std::stoi(value);
+            else if (arg == "--rate") config.rate = std::stod(value);
+            else if (arg == "--block-interval") config.blockIntervalMs = std::stoi(value);
+            else if (arg == "--drain-timeout") config.drainTimeoutMs = std::stoi(value);
+            else return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return config.wallets >= 2 && config.transactions > 0 && config.rate > 0 && config.blockIntervalMs > 0;
+}
+
+bool fundLoadGenWallets(AhmiyatChain& chain, const std::vector<std::string>& addresses, double amount) {
+    const std::string funder = "loadgen_funder";
+    const std::string home = chain.homeShard(funder);
+    MemoryFragment memory("text", "memories/loadgen_funding.txt", "Load generator funding", funder, 0);
+    // Stamped with the chain's clock, which a simulation may have replaced.
+    // Stamped with the chain's clock, which a simulation may stop; the offset
+    // keeps consecutive zero transfers distinct even then.
+    uint64_t stamps = 0;
+    auto stamped = [&](Transaction tx) {
+        tx.timestamp = chain.currentTime() + stamps++;
+        return tx;
+    };
+    // A zero transfer gives addBlock a block to build in the funder's shard.
+    auto mine = [&]() { chain.addBlock({stamped(Transaction(funder, addresses.front(), 0.0, 0.0))}, memory, funder, 0.0); };
+    std::vector<Transaction> transfers;
+    transfers.reserve(addresses.size());
+    for (const auto& address : addresses) transfers.push_back(stamped(Transaction(funder, address, amount)));
+    double needed = 0.0;
+    for (const auto& tx : transfers) needed += tx.amount + tx.fee;
+
+    for (double balance = chain.getBalance(funder, home); balance < needed;) {
+        mine();
+        double earned = chain.getBalance(funder, home);
+        if (earned <= balance) {
+            log("Load generator funding stalled at " + std::to_string(balance) + " of " + std::to_string(needed));
+            return false;
+        }
+        balance = earned;
+    }
+    chain.addBlock(std::move(transfers), memory, funder, 0.0);
+    // Transfers to other shards arrive as receipts, credited by those shards' next blocks.
+    for (size_t funded = 0, round = 0;; round++) {
+        size_t credited = 0;
+        for (const auto& address : addresses) credited += chain.getBalance(address, chain.homeShard(address)) >= amount;
+        if (credited == addresses.size()) return true;
+        if (round > 0 && credited <= funded) {
+            log("Load generator funding stalled at " + std::to_string(credited) + " of " +
+                std::to_string(addresses.size()) + " wallets");
+            return false;
+        }
+        funded = credited;
+        mine();
+    }
+}
+
+static std::string formatLatency(const HdrHistogram& h) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(2)
+       << "p50=" << h.valueAtPercentile(50.0) / 1e6 << "ms"
+       << " p99=" << h.valueAtPercentile(99.0) / 1e6 << "ms"
+       << " p999=" << h.valueAtPercentile(99.9) / 1e6 << "ms"
+       << " max=" << h.max() / 1e6 << "ms";
+    return ss.str();
+}
+
+void runLoadGen(AhmiyatChain& chain, const LoadGenConfig& config) {
+    std::vector<Wallet> wallets(config.wallets);
+    std::vector<Transaction> txs;
+    txs.reserve(config.transactions);
+    std::unordered_map<std::string, size_t> txIndex;
+    txIndex.reserve(config.transactions);
+    for (int i = 0; i < config.transactions; i++) {
+        txs.emplace_back(wallets[i % config.wallets].publicKey, wallets[(i + 1) % config.wallets].publicKey, 1.0);
+        txIndex[txKey(txs.back())] = i;
+    }
+    std::vector<std::string> senders;
+    for (int i = 0; i < std::min(config.wallets, config.transactions); i++) senders.push_back(wallets[i].publicKey);
+    int perSender = (config.transactions + config.wallets - 1) / config.wallets;
+    if (!fundLoadGenWallets(chain, senders, perSender * (txs.front().amount + txs.front().fee))) return;
+
+    auto interval = std::chrono::nanoseconds(static_cast<int64_t>(1e9 / config.rate));
+    auto start = Clock::now() + std::chrono::milliseconds(100);
+    std::vector<Clock::time_point> scheduled(txs.size());
+    for (size_t i = 0; i < txs.size(); i++) scheduled[i] = start + interval * static_cast<int64_t>(i);
+
+    std::mutex statsMutex;
+    HdrHistogram overall;
+    std::map<std::string, HdrHistogram> shardLatency;
+    std::vector<bool> included(txs.size(), false);
+    std::atomic<size_t> includedCount{0};
+    size_t appliedCount = 0;
+    Clock::time_point lastCommit = start;
+
+    chain.setCommitListener([&](const std::string& shardId, const std::vector<Transaction>& blockTxs,
+                                const std::vector<bool>& applied) {
+        auto now = Clock::now();
+        std::lock_guard<std::mutex> lock(statsMutex);
+        for (size_t i = 0; i < blockTxs.size(); i++) {
+            auto it = txIndex.find(txKey(blockTxs[i]));
+            if (it == txIndex.end() || included[it->second]) continue;
+            included[it->second] = true;
+            includedCount++;
+            if (!applied[i]) continue;
+            uint64_t latency = std::chrono::duration_cast<std::chrono::nanoseconds>(now - scheduled[it->second]).count();
+            overall.record(latency);
+            shardLatency[shardId].record(latency);
+            appliedCount++;
+        }
+        lastCommit = now;
+    });
+
+    log("Load generator: " + std::to_string(txs.size()) + " txs from " + std::to_string(wallets.size()) +
+        " wallets at " + std::to_string(config.rate) + " tx/s");
+    std::atomic<bool> producing{true};
+
+    std::thread producer([&]() {
+        while (producing) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(config.blockIntervalMs));
+            chain.processPendingTxs();
+        }
+    });
+
+    for (size_t i = 0; i < txs.size(); i++) {
+        std::this_thread::sleep_until(scheduled[i]);
+        chain.addPendingTx(txs[i]);
+    }
+
+    auto deadline = Clock::now() + std::chrono::milliseconds(config.drainTimeoutMs);
+    while (includedCount < txs.size() && Clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+    producing = false;
+    producer.join();
+    chain.setCommitListener(nullptr);
+
+    std::lock_guard<std::mutex> lock(statsMutex);
+    double elapsed = std::chrono::duration<double>(lastCommit - start).count();
+    std::stringstream report;
+    report << std::fixed << std::setprecision(1);
+    report << "Load test: offered " << config.rate << " tx/s, included " << includedCount << "/" << txs.size()
+           << ", applied " << appliedCount << "/" << txs.size() << ", sustained "
+           << (elapsed > 0 ? appliedCount / elapsed : 0.0) << " applied tx/s, latency " << formatLatency(overall) << "\n";
+    for (const auto& [shardId, h] : shardLatency) {
+        report << "  shard " << shardId << ": " << h.totalCount() << " txs, "
+               << (elapsed > 0 ? h.totalCount() / elapsed : 0.0) << " tx/s, " << formatLatency(h) << "\n";
+    }
+    std::cout << report.str();
+    log(report.str());
+}
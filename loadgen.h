@@ -0,0 +1,30 @@
+#ifndef LOADGEN_H
+#define LOADGEN_H
+
+#include "blockchain.h"
+
+struct LoadGenConfig {
+    int wallets = 1000;
+    int transactions = 10000;
+    double rate = 500.0;
+    int blockIntervalMs = 1000;
+    int drainTimeoutMs = 60000;
+};
+
+bool parseLoadGenArgs(int argc, char* argv[], LoadGenConfig& config);
+
+// Funds each address on chain before load starts: a funder mines blocks in
+// its home shard until the rewards cover the total, then sends one transfer
+// per address and keeps mining until every cross-shard receipt is credited.
+// Returns false if the chain stops producing blocks first.
+bool fundLoadGenWallets(AhmiyatChain& chain, const std::vector<std::string>& addresses, double amount);
+
+// Open-loop load: transactions are pre-generated and submitted through
+// addPendingTx on a fixed schedule regardless of how fast blocks commit.
+// Latency is measured from the scheduled submit time to block commit, so a
+// stalled node shows up as latency instead of as a lower offered rate.
+// Senders are funded first; TPS and latency count applied transfers, and
+// included-but-rejected txs are reported separately.
+void runLoadGen(AhmiyatChain& chain, const LoadGenConfig& config);
+
+#endif
@@ -1,4 +1,11 @@
 #include "blockchain.h"
+#include "loadgen.h"
+#include "netsim.h"
+#include "ingest.h"
+#include "reindex.h"
+#include "utils.h"
+#include "metrics.h"
+#include "trace.h"
 #include <thread>
 #include <iostream>
 #include <microhttpd.h>
@@ -8,14 +15,14 @@
 #include <chrono>
 
 volatile sig_atomic_t keepRunning = 1;
+volatile sig_atomic_t traceDumpRequested = 0;
 
 void signalHandler(int sig) {
     keepRunning = 0;
 }
 
-void log(const std::string& message) {
-    std::ofstream logFile("ahmiyat.log", std::ios::app);
-    logFile << "[" << time(nullptr) << "] " << message << std::endl;
+void traceSignalHandler(int sig) {
+    traceDumpRequested = 1;
 }
 
 void runNode(AhmiyatChain& chain, int port) {
@@ -34,15 +41,111 @@ int answer_to_connection(void* cls, struct MHD_Connection* connection, const cha
                          const char* method, const char* version, const char* upload_data, 
                          size_t* upload_data_size, void** con_cls) {
     AhmiyatChain* chain = static_cast<AhmiyatChain*>(cls);
+    std::string route = std::string(url);
+    if (route != "/balance" && route != "/shard" && route != "/tx" && route != "/metrics" && route != "/trace" &&
+        route != "/shardmap" && route != "/proof" && route != "/mining" &&
+        route != "/history" && route != "/block" && route != "/headers") {
+        route = "other";
+    }
+    ScopedTimer timer(MetricsRegistry::instance().histogram("ahmiyat_api_request_seconds", "HTTP API request latency",
+                                                            {{"route", route}}));
     std::string response;
+    std::string contentType = "text/plain";
+    unsigned int status = MHD_HTTP_OK;
+    std::string etag;
+    bool immutable = false;
     if (std::string(method) == "GET") {
         if (std::string(url) == "/balance") {
             const char* addr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "address");
             const char* shard = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "shard");
-            response = std::to_string(chain->getBalance(addr ? addr : "genesis", shard ? shard : "0"));
+            std::string address = addr ? addr : "genesis";
+            response = std::to_string(chain->getBalance(address, shard ? shard : chain->homeShard(address)));
         } else if (std::string(url) == "/shard") {
             const char* shard = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "shard");
             response = chain->getShardStatus(shard ? shard : "0");
+        } else if (std::string(url) == "/proof") {
+            const char* addr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "address");
+            const char* shard = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "shard");
+            std::string address = addr ? addr : "genesis";
+            response = chain->getBalanceProof(address, shard ? shard : chain->homeShard(address));
+            contentType = "application/json";
+        } else if (std::string(url) == "/history") {
+            const char* addr = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "address");
+            const char* cursor = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "cursor");
+            const char* limit = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "limit");
+            response = chain->getHistory(addr ? addr : "", cursor ? cursor : "",
+                                         limit ? std::strtoul(limit, nullptr, 10) : HISTORY_PAGE_SIZE);
+            contentType = "application/json";
+        } else if (std::string(url) == "/block") {
+            const char* hash = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "hash");
+            const char* shard = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "shard");
+            const char* height = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "height");
+            const char* format = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+            bool json = format && std::string(format) == "json";
+            std::string blockHash = hash ? hash : "";
+            BlockHeader header;
+            if (blockHash.empty() && shard && height && chain->getHeader(shard, std::strtoull(height, nullptr, 10), header)) {
+                blockHash = hashToHex(header.hash);
+            }
+            std::string record = blockHash.empty() ? "" : chain->getBlockRecord(blockHash);
+            if (record.empty()) {
+                status = MHD_HTTP_NOT_FOUND;
+                response = "Block not found";
+            } else {
+                etag = "\"" + blockHash + (json ? "-json" : "") + "\"";
+                immutable = true;
+                if (json) {
+                    auto block = chain->getBlock(blockHash);
+                    response = block ? block->toJson() : "{}";
+                    contentType = "application/json";
+                } else {
+                    response = record;
+                    contentType = "application/octet-stream";
+                }
+            }
+        } else if (std::string(url) == "/headers") {
+            const char* shard = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "shard");
+            const char* from = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "from");
+            const char* count = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "count");
+            const char* format = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "format");
+            bool json = format && std::string(format) == "json";
+            std::string shardId = shard ? shard : "0";
+            uint64_t start = from ? std::strtoull(from, nullptr, 10) : 0;
+            size_t wanted = std::min<size_t>(count ? std::strtoul(count, nullptr, 10) : 100, 2000);
+            std::vector<BlockHeader> headers = chain->getHeaders(shardId, start, wanted);
+            if (json) {
+                response = "[";
+                for (size_t i = 0; i < headers.size(); i++) response += (i ? "," : "") + headers[i].toJson(shardId);
+                response += "]";
+                contentType = "application/json";
+            } else {
+                response.reserve(headers.size() * BlockHeader::ENCODED_SIZE);
+                ByteWriter writer(response);
+                for (const auto& h : headers) h.encode(writer);
+                contentType = "application/octet-stream";
+            }
+            if (!headers.empty()) {
+                etag = "\"" + shardId + "-" + std::to_string(start) + "-" + hashToHex(headers.back().hash) +
+                       (json ? "-json" : "") + "\"";
+                immutable = headers.size() == wanted;
+            }
+        } else if (std::string(url) == "/shardmap") {
+            response = chain->getShardMap();
+        } else if (std::string(url) == "/mining") {
+            response = chain->getMiningStatus();
+            contentType = "application/json";
+        } else if (std::string(url) == "/metrics") {
+            response = MetricsRegistry::instance().exposition();
+            contentType = "text/plain; version=0.0.4";
+        } else if (std::string(url) == "/trace") {
+            const char* sample = MHD_lookup_connection_value(connection, MHD_GET_ARGUMENT_KIND, "sample");
+            if (sample) {
+                Tracer::instance().setSampleRate(std::atoi(sample));
+                response = "Trace sampling set to 1 in " + std::to_string(Tracer::instance().getSampleRate());
+            } else {
+                response = Tracer::instance().dumpChromeJson();
+                contentType = "application/json";
+            }
         }
     } else if (std::string(method) == "POST" && std::string(url) == "/tx") {
         if (*upload_data_size) {
@@ -63,10 +166,23 @@ int answer_to_connection(void* cls, struct MHD_Connection* connection, const cha
         }
     }
 
+    if (!etag.empty()) {
+        const char* ifNoneMatch = MHD_lookup_connection_value(connection, MHD_HEADER_KIND, "If-None-Match");
+        if (ifNoneMatch && etag == ifNoneMatch) {
+            status = MHD_HTTP_NOT_MODIFIED;
+            response.clear();
+        }
+    }
     struct MHD_Response* mhd_response = MHD_create_response_from_buffer(response.length(), 
                                                                        (void*)response.c_str(), 
                                                                        MHD_RESPMEM_MUST_COPY);
-    int ret = MHD_queue_response(connection, MHD_HTTP_OK, mhd_response);
+    MHD_add_response_header(mhd_response, "Content-Type", contentType.c_str());
+    if (!etag.empty()) {
+        MHD_add_response_header(mhd_response, "ETag", etag.c_str());
+        MHD_add_response_header(mhd_response, "Cache-Control",
+                                immutable ? "public, max-age=31536000, immutable" : "no-cache");
+    }
+    int ret = MHD_queue_response(connection, status, mhd_response);
     MHD_destroy_response(mhd_response);
     return ret;
 }
@@ -82,6 +198,10 @@ void runAPI(AhmiyatChain& chain) {
     log("API server running on port 8080");
     while (keepRunning) {
         std::this_thread::sleep_for(std::chrono::seconds(1));
+        if (traceDumpRequested) {
+            traceDumpRequested = 0;
+            if (Tracer::instance().dumpToFile("ahmiyat_trace.json")) log("Trace written to ahmiyat_trace.json");
+        }
     }
     MHD_stop_daemon(daemon);
 }
@@ -116,28 +236,87 @@ void loadConfig(AhmiyatChain& chain, const std::string& configFile) {
 
 int main(int argc, char* argv[]) {
     signal(SIGINT, signalHandler);
+    signal(SIGUSR1, traceSignalHandler);
+    if (const char* sample = std::getenv("AHMIYAT_TRACE_SAMPLE")) Tracer::instance().setSampleRate(std::atoi(sample));
     if (argc < 2) {
-        log("Usage: ./ahmiyat <port>");
+        log("Usage: ./ahmiyat <port> [--ingest PORT|PATH] | ./ahmiyat loadgen [--wallets N] [--txs N] [--rate TPS] [--block-interval MS] [--drain-timeout MS]"
+            " | ./ahmiyat netsim [--nodes N,N..] [--shards N,N..] [--blocks N] [--latency MS] [--bandwidth MBPS] [--loss P] [--seed N]"
+            " | ./ahmiyat reindex [--db PATH] [--threads N] [--verify-only]");
         return 1;
     }
+    if (std::string(argv[1]) == "loadgen") {
+        LoadGenConfig config;
+        if (!parseLoadGenArgs(argc - 2, argv + 2, config)) {
+            log("Invalid loadgen arguments");
+            return 1;
+        }
+        system("mkdir -p memories");
+        AhmiyatChain ahmiyat;
+        if (!restoreChain(ahmiyat)) return 1;
+        runLoadGen(ahmiyat, config);
+        return 0;
+    }
+    if (std::string(argv[1]) == "netsim") {
+        NetSimConfig config;
+        if (!parseNetSimArgs(argc - 2, argv + 2, config)) {
+            log("Invalid netsim arguments");
+            return 1;
+        }
+        system("mkdir -p memories");
+        runNetSim(config);
+        return 0;
+    }
+    if (std::string(argv[1]) == "reindex") {
+        ReindexConfig config;
+        if (!parseReindexArgs(argc - 2, argv + 2, config)) {
+            log("Invalid reindex arguments");
+            return 1;
+        }
+        system("mkdir -p memories");
+        return runReindex(config) ? 0 : 1;
+    }
     int port = std::atoi(argv[1]);
+    IngestConfig ingestConfig;
+    bool ingest = false;
+    for (int i = 2; i < argc; i++) {
+        if (std::string(argv[i]) == "--ingest" && i + 1 < argc && parseIngestAddress(argv[i + 1], ingestConfig)) {
+            ingest = true;
+            i++;
+        } else {
+            log("Unknown argument: " + std::string(argv[i]));
+            return 1;
+        }
+    }
 
     system("mkdir -p memories");
 
     AhmiyatChain ahmiyat;
+    if (!restoreChain(ahmiyat)) return 1;
     loadConfig(ahmiyat, "config.txt");
+    IngestServer ingestServer(ahmiyat, ingestConfig);
+    std::thread pendingThread;
+    if (ingest && ingestServer.start()) {
+        // Streamed txs only reach the mempool; drain it into blocks here.
+        pendingThread = std::thread([&ahmiyat]() {
+            while (keepRunning) {
+                std::this_thread::sleep_for(std::chrono::seconds(1));
+                ahmiyat.processPendingTxs();
+            }
+        });
+    }
 
     std::thread nodeThread(runNode, std::ref(ahmiyat), port);
     std::thread minerThread(mineBlock, std::ref(ahmiyat), "Miner" + std::to_string(port));
     std::thread apiThread(runAPI, std::ref(ahmiyat));
 
     minerThread.join();
-    ahmiyat.stressTest(10);
 
     log("Balance of genesis: " + std::to_string(ahmiyat.getBalance("genesis")));
     log("Optimized node running on port " + std::to_string(port));
 
     apiThread.join();
+    if (pendingThread.joinable()) pendingThread.join();
+    ingestServer.stop();
     nodeThread.detach();
     return 0;
 }
@@ -0,0 +1,149 @@
+#include "metrics.h"
+#include <sstream>
+#include <iomanip>
+
+static void atomicAdd(std::atomic<double>& target, double delta) {
+    double current = target.load(std::memory_order_relaxed);
+    while (!target.compare_exchange_weak(current, current + delta, std::memory_order_relaxed)) {
+    }
+}
+
+int metricStripe() {
+    static std::atomic<int> nextStripe{0};
+    static thread_local int stripe = nextStripe.fetch_add(1) % METRIC_STRIPES;
+    return stripe;
+}
+
+uint64_t MetricCounter::value() const {
+    uint64_t total = 0;
+    for (const auto& cell : cells) total += cell.value.load(std::memory_order_relaxed);
+    return total;
+}
+
+void MetricGauge::add(double delta) {
+    atomicAdd(value, delta);
+}
+
+MetricHistogram::MetricHistogram(const std::vector<double>& b) : bounds(b) {
+    for (auto& stripe : stripes) {
+        stripe.buckets.reset(new std::atomic<uint64_t>[bounds.size()]);
+        for (size_t i = 0; i < bounds.size(); i++) stripe.buckets[i].store(0);
+    }
+}
+
+void MetricHistogram::observe(double seconds) {
+    Stripe& stripe = stripes[metricStripe()];
+    for (size_t i = 0; i < bounds.size(); i++) {
+        if (seconds <= bounds[i]) {
+            stripe.buckets[i].fetch_add(1, std::memory_order_relaxed);
+            break;
+        }
+    }
+    stripe.count.fetch_add(1, std::memory_order_relaxed);
+    atomicAdd(stripe.sum, seconds);
+}
+
+void MetricHistogram::collect(std::vector<uint64_t>& buckets, uint64_t& count, double& sum) const {
+    buckets.assign(bounds.size(), 0);
+    count = 0;
+    sum = 0.0;
+    for (const auto& stripe : stripes) {
+        for (size_t i = 0; i < bounds.size(); i++) buckets[i] += stripe.buckets[i].load(std::memory_order_relaxed);
+        count += stripe.count.load(std::memory_order_relaxed);
+        sum += stripe.sum.load(std::memory_order_relaxed);
+    }
+    for (size_t i = 1; i < buckets.size(); i++) buckets[i] += buckets[i - 1];
+}
+
+MetricsRegistry& MetricsRegistry::instance() {
+    static MetricsRegistry registry;
+    return registry;
+}
+
+std::vector<double> MetricsRegistry::latencyBuckets() {
+    return {0.0001, 0.0005, 0.001, 0.0025, 0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30, 60};
+}
+
+static std::string labelKey(const MetricLabels& labels) {
+    std::string key;
+    for (const auto& [name, value] : labels) {
+        if (!key.empty()) key += ",";
+        key += name + "=\"" + value + "\"";
+    }
+    return key;
+}
+
+MetricsRegistry::Family& MetricsRegistry::family(const std::string& name, const std::string& type, const std::string& help) {
+    Family& f = families[name];
+    if (f.type.empty()) {
+        f.type = type;
+        f.help = help;
+    }
+    return f;
+}
+
+MetricCounter& MetricsRegistry::counter(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto& slot = family(name, "counter", help).counters[labelKey(labels)];
+    if (!slot) slot.reset(new MetricCounter());
+    return *slot;
+}
+
+MetricGauge& MetricsRegistry::gauge(const std::string& name, const std::string& help, const MetricLabels& labels) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto& slot = family(name, "gauge", help).gauges[labelKey(labels)];
+    if (!slot) slot.reset(new MetricGauge());
+    return *slot;
+}
+
+MetricHistogram& MetricsRegistry::histogram(const std::string& name, const std::string& help, const MetricLabels& labels,
+                                            const std::vector<double>& bounds) {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    auto& slot = family(name, "histogram", help).histograms[labelKey(labels)];
+    if (!slot) slot.reset(new MetricHistogram(bounds));
+    return *slot;
+}
+
+static std::string withLabels(const std::string& name, const std::string& labels, const std::string& extra = "") {
+    std::string all = labels;
+    if (!extra.empty()) all += (all.empty() ? "" : ",") + extra;
+    return all.empty() ? name : name + "{" + all + "}";
+}
+
+std::string MetricsRegistry::exposition() const {
+    std::lock_guard<std::mutex> lock(registryMutex);
+    std::stringstream ss;
+    ss << std::setprecision(9);
+    for (const auto& [name, f] : families) {
+        ss << "# HELP " << name << " " << f.help << "\n";
+        ss << "# TYPE " << name << " " << f.type << "\n";
+        for (const auto& [labels, c] : f.counters) ss << withLabels(name, labels) << " " << c->value() << "\n";
+        for (const auto& [labels, g] : f.gauges) ss << withLabels(name, labels) << " " << g->get() << "\n";
+        for (const auto& [labels, h] : f.histograms) {
+            std::vector<uint64_t> buckets;
+            uint64_t count;
+            double sum;
+            h->collect(buckets, count, sum);
+            const auto& bounds = h->getBounds();
+            for (size_t i = 0; i < bounds.size(); i++) {
+                std::stringstream le;
+                le << "le=\"" << bounds[i] << "\"";
+                ss << withLabels(name + "_bucket", labels, le.str()) << " " << buckets[i] << "\n";
+            }
+            ss << withLabels(name + "_bucket", labels, "le=\"+Inf\"") << " " << count << "\n";
+            ss << withLabels(name + "_sum", labels) << " " << sum << "\n";
+            ss << withLabels(name + "_count", labels) << " " << count << "\n";
+        }
+    }
+    return ss.str();
+}
+
+TimedLock::TimedLock(std::mutex& mutex, MetricHistogram& waits) : lock(mutex, std::try_to_lock) {
+    if (lock.owns_lock()) {
+        waits.observe(0.0);
+        return;
+    }
+    auto start = std::chrono::steady_clock::now();
+    lock.lock();
+    waits.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+}
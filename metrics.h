@@ -0,0 +1,107 @@
+#ifndef METRICS_H
+#define METRICS_H
+
+#include <string>
+#include <vector>
+#include <map>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <chrono>
+
+const int METRIC_STRIPES = 16;
+
+typedef std::vector<std::pair<std::string, std::string>> MetricLabels;
+
+// Updates go to a per-thread stripe so concurrent writers do not share a
+// cache line; reads (scrapes) sum the stripes.
+int metricStripe();
+
+class MetricCounter {
+private:
+    struct alignas(64) Cell {
+        std::atomic<uint64_t> value{0};
+    };
+    Cell cells[METRIC_STRIPES];
+
+public:
+    void inc(uint64_t n = 1) { cells[metricStripe()].value.fetch_add(n, std::memory_order_relaxed); }
+    uint64_t value() const;
+};
+
+class MetricGauge {
+private:
+    std::atomic<double> value{0.0};
+
+public:
+    void set(double v) { value.store(v, std::memory_order_relaxed); }
+    void add(double delta);
+    double get() const { return value.load(std::memory_order_relaxed); }
+};
+
+class MetricHistogram {
+private:
+    std::vector<double> bounds;
+    struct alignas(64) Stripe {
+        std::unique_ptr<std::atomic<uint64_t>[]> buckets;
+        std::atomic<uint64_t> count{0};
+        std::atomic<double> sum{0.0};
+    };
+    Stripe stripes[METRIC_STRIPES];
+
+public:
+    explicit MetricHistogram(const std::vector<double>& bounds);
+    void observe(double seconds);
+    const std::vector<double>& getBounds() const { return bounds; }
+    void collect(std::vector<uint64_t>& buckets, uint64_t& count, double& sum) const;
+};
+
+class MetricsRegistry {
+private:
+    struct Family {
+        std::string type;
+        std::string help;
+        std::map<std::string, std::unique_ptr<MetricCounter>> counters;
+        std::map<std::string, std::unique_ptr<MetricGauge>> gauges;
+        std::map<std::string, std::unique_ptr<MetricHistogram>> histograms;
+    };
+    std::map<std::string, Family> families;
+    mutable std::mutex registryMutex;
+
+    Family& family(const std::string& name, const std::string& type, const std::string& help);
+
+public:
+    static MetricsRegistry& instance();
+    static std::vector<double> latencyBuckets();
+    // Returned references stay valid for the life of the process; cache them
+    // instead of looking up on every update.
+    MetricCounter& counter(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    MetricGauge& gauge(const std::string& name, const std::string& help, const MetricLabels& labels = {});
+    MetricHistogram& histogram(const std::string& name, const std::string& help, const MetricLabels& labels = {},
+                               const std::vector<double>& bounds = latencyBuckets());
+    // Prometheus text exposition format 0.0.4.
+    std::string exposition() const;
+};
+
+class ScopedTimer {
+private:
+    MetricHistogram& histogram;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit ScopedTimer(MetricHistogram& h) : histogram(h), start(std::chrono::steady_clock::now()) {}
+    ~ScopedTimer() {
+        histogram.observe(std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count());
+    }
+};
+
+// std::lock_guard that records how long the caller waited for the mutex.
+class TimedLock {
+private:
+    std::unique_lock<std::mutex> lock;
+
+public:
+    TimedLock(std::mutex& mutex, MetricHistogram& waits);
+};
+
+#endif
@@ -0,0 +1,118 @@
+#include "mining.h"
+#include "metrics.h"
+#include <algorithm>
+#include <sstream>
+#include <thread>
+
+static MetricsRegistry& metrics = MetricsRegistry::instance();
+static MetricCounter& wastedAttemptsTotal =
+    metrics.counter("ahmiyat_mining_wasted_attempts_total", "Hash attempts on jobs that produced no committed block");
+
+static MetricCounter& jobsWon =
+    metrics.counter("ahmiyat_mining_jobs_total", "Mining jobs by outcome", {{"outcome", "won"}});
+static MetricCounter& jobsStale =
+    metrics.counter("ahmiyat_mining_jobs_total", "Mining jobs by outcome", {{"outcome", "stale"}});
+static MetricCounter& jobsCancelled =
+    metrics.counter("ahmiyat_mining_jobs_total", "Mining jobs by outcome", {{"outcome", "cancelled"}});
+static MetricCounter& jobsFailed =
+    metrics.counter("ahmiyat_mining_jobs_total", "Mining jobs by outcome", {{"outcome", "failed"}});
+
+static MetricCounter& jobsTotal(MiningOutcome outcome) {
+    switch (outcome) {
+        case MiningOutcome::Won: return jobsWon;
+        case MiningOutcome::Stale: return jobsStale;
+        case MiningOutcome::Cancelled: return jobsCancelled;
+        default: return jobsFailed;
+    }
+}
+
+MiningScheduler::MiningScheduler(unsigned cpuSlots)
+    : slots(cpuSlots ? cpuSlots : std::max(1u, std::thread::hardware_concurrency())) {}
+
+std::shared_ptr<MiningJob> MiningScheduler::begin(const std::string& shardId) {
+    auto job = std::make_shared<MiningJob>();
+    job->shardId = shardId;
+    std::unique_lock<std::mutex> lock(schedulerMutex);
+    active.push_back(job);
+    slotFree.wait(lock, [&]() {
+        if (running >= slots) return false;
+        return std::none_of(active.begin(), active.end(), [&](const std::shared_ptr<MiningJob>& other) {
+            return other->holdsSlot && other->shardId == shardId;
+        });
+    });
+    running++;
+    job->holdsSlot = true;
+    stats.started++;
+    return job;
+}
+
+// Caller holds schedulerMutex.
+bool MiningScheduler::release(const std::shared_ptr<MiningJob>& job) {
+    auto it = std::find(active.begin(), active.end(), job);
+    if (it == active.end()) return false;
+    active.erase(it);
+    if (job->holdsSlot) running--;
+    job->holdsSlot = false;
+    return true;
+}
+
+void MiningScheduler::finish(const std::shared_ptr<MiningJob>& job, MiningOutcome outcome) {
+    uint64_t attempts = job->attempts;
+    {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        if (!release(job)) return;
+        stats.attempts += attempts;
+        switch (outcome) {
+            case MiningOutcome::Won: stats.won++; break;
+            case MiningOutcome::Stale: stats.stale++; break;
+            case MiningOutcome::Cancelled: stats.cancelled++; break;
+            case MiningOutcome::Failed: stats.failed++; break;
+        }
+        if (outcome != MiningOutcome::Won) stats.wastedAttempts += attempts;
+    }
+    slotFree.notify_all();
+    jobsTotal(outcome).inc();
+    if (outcome != MiningOutcome::Won) wastedAttemptsTotal.inc(attempts);
+}
+
+void MiningScheduler::abandon(const std::shared_ptr<MiningJob>& job) {
+    {
+        std::lock_guard<std::mutex> lock(schedulerMutex);
+        if (!release(job)) return;
+        stats.started--;
+    }
+    slotFree.notify_all();
+}
+
+void MiningScheduler::blockCommitted(const std::string& shardId, uint64_t height) {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    for (const auto& job : active) {
+        if (job->holdsSlot && job->shardId == shardId && job->height <= height) job->cancelled = true;
+    }
+}
+
+void MiningScheduler::cancelAll() {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    for (const auto& job : active) {
+        if (job->holdsSlot) job->cancelled = true;
+    }
+}
+
+void MiningScheduler::recordIneligible() {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    stats.ineligible++;
+}
+
+MiningStats MiningScheduler::getStats() const {
+    std::lock_guard<std::mutex> lock(schedulerMutex);
+    return stats;
+}
+
+std::string MiningScheduler::toJson() const {
+    MiningStats s = getStats();
+    std::stringstream ss;
+    ss << "{\"slots\":" << slots << ",\"started\":" << s.started << ",\"won\":" << s.won << ",\"stale\":" << s.stale
+       << ",\"cancelled\":" << s.cancelled << ",\"failed\":" << s.failed << ",\"ineligible\":" << s.ineligible
+       << ",\"attempts\":" << s.attempts << ",\"wastedAttempts\":" << s.wastedAttempts << "}";
+    return ss.str();
+}
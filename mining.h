@@ -0,0 +1,75 @@
+#ifndef MINING_H
+#define MINING_H
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+
+const int MAX_MINING_REBASES = 3;
+
+class MiningCancelled : public std::runtime_error {
+public:
+    MiningCancelled() : std::runtime_error("Mining cancelled") {}
+};
+
+// One proof-of-work search for a block in shardId. The producer sets height
+// under chainMutex once it has picked the parent; the miner polls `cancelled`
+// and counts its hash attempts here.
+struct MiningJob {
+    std::string shardId;
+    std::atomic<uint64_t> height{UINT64_MAX};
+    std::atomic<bool> cancelled{false};
+    std::atomic<uint64_t> attempts{0};
+    bool holdsSlot = false;
+};
+
+enum class MiningOutcome { Won, Stale, Cancelled, Failed };
+
+struct MiningStats {
+    uint64_t started = 0;
+    uint64_t won = 0;
+    uint64_t stale = 0;
+    uint64_t cancelled = 0;
+    uint64_t failed = 0;
+    // Blocks whose claimed stake was cut down to the miner's bonded stake.
+    uint64_t ineligible = 0;
+    uint64_t attempts = 0;
+    // Attempts spent on jobs that did not end in a committed block.
+    uint64_t wastedAttempts = 0;
+};
+
+// Runs at most one mining job per shard and at most `slots` jobs at once, so
+// concurrent producers for a shard queue instead of racing for the same
+// height. A block committed at or above a running job's height, e.g. one
+// imported from a peer, cancels the job.
+class MiningScheduler {
+private:
+    std::list<std::shared_ptr<MiningJob>> active;
+    unsigned slots;
+    unsigned running = 0;
+    MiningStats stats;
+    mutable std::mutex schedulerMutex;
+    std::condition_variable slotFree;
+    bool release(const std::shared_ptr<MiningJob>& job);
+
+public:
+    explicit MiningScheduler(unsigned cpuSlots = 0);
+    // Blocks until the shard has no running job and a CPU slot is free.
+    std::shared_ptr<MiningJob> begin(const std::string& shardId);
+    void finish(const std::shared_ptr<MiningJob>& job, MiningOutcome outcome);
+    // Releases a job that found nothing to mine; not counted in the stats.
+    void abandon(const std::shared_ptr<MiningJob>& job);
+    void blockCommitted(const std::string& shardId, uint64_t height);
+    void cancelAll();
+    void recordIneligible();
+    MiningStats getStats() const;
+    unsigned getSlots() const { return slots; }
+    std::string toJson() const;
+};
+
+#endif
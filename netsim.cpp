@@ -0,0 +1,395 @@
+#include "netsim.h"
+#include "loadgen.h"
+#include "utils.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <filesystem>
+#include <iomanip>
+#include <iostream>
+#include <set>
+#include <sstream>
+
+static const int SIM_SENDERS_PER_SHARD = 32;
+
+static std::string recordDigest(const std::string& record) {
+    Hash256 digest;
+    SHA256((const unsigned char*)record.data(), record.size(), digest.data());
+    return std::string(digest.begin(), digest.end());
+}
+
+static bool parseList(const std::string& value, std::vector<int>& out) {
+    out.clear();
+    std::stringstream ss(value);
+    std::string item;
+    while (std::getline(ss, item, ',')) {
+        int v = std::stoi(item);
+        if (v <= 0) return false;
+        out.push_back(v);
+    }
+    return !out.empty();
+}
+
+bool parseNetSimArgs(int argc, char* argv[], NetSimConfig& config) {
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        try {
+            if (arg == "--nodes") { if (!parseList(value, config.nodeCounts)) return false; }
+            else if (arg == "--shards") { if (!parseList(value, config.shardCounts)) return false; }
+            else if (arg == "--blocks") config.blocks = std::stoi(value);
+            else if (arg == "--txs-per-block") config.txsPerBlock = std::stoi(value);
+            else if (arg == "--block-interval") config.blockIntervalMs = std::stod(value);
+            else if (arg == "--latency") config.latencyMs = std::stod(value);
+            else if (arg == "--jitter") config.jitterMs = std::stod(value);
+            else if (arg == "--bandwidth") config.bandwidthMbps = std::stod(value);
+            else if (arg == "--loss") config.lossRate = std::stod(value);
+            else if (arg == "--peers") config.peers = std::stoi(value);
+            else if (arg == "--difficulty") config.difficulty = std::stoi(value);
+            else if (arg == "--seed") config.seed = std::stoull(value);
+            else if (arg == "--data-dir") config.dataDir = value;
+            else return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    for (int n : config.nodeCounts) if (n < 2) return false;
+    for (int s : config.shardCounts) if (s > INITIAL_SHARDS) return false;
+    return config.blocks > 0 && config.txsPerBlock > 0 && config.blockIntervalMs > 0 && config.latencyMs >= 0 &&
+           config.jitterMs >= 0 && config.bandwidthMbps > 0 && config.lossRate >= 0 && config.lossRate < 1 &&
+           config.peers > 0 && config.difficulty >= 0 && config.difficulty <= 4;
+}
+
+class SimTransport : public Transport {
+private:
+    NetworkSimulator& network;
+    int node;
+
+public:
+    SimTransport(NetworkSimulator& net, int index) : network(net), node(index) {}
+    void broadcast(const std::string& record, const std::string& fromPeer) override {
+        network.enqueueBroadcast(node, record, fromPeer);
+    }
+};
+
+std::string NetworkSimulator::peerName(int node) {
+    return "sim-" + std::to_string(node);
+}
+
+NetworkSimulator::NetworkSimulator(const NetSimConfig& cfg, int numNodes, int numShards)
+    : config(cfg), nodeCount(numNodes), shardCount(numShards), rng(cfg.seed) {
+    std::stringstream dir;
+    dir << config.dataDir << "/n" << nodeCount << "-s" << shardCount;
+    dataDir = dir.str();
+    std::filesystem::remove_all(dataDir);
+    std::filesystem::create_directories(dataDir);
+    for (int i = 0; i < nodeCount; i++) {
+        nodes.emplace_back(new AhmiyatChain(dataDir + "/node" + std::to_string(i)));
+        nodes.back()->setTransport(std::make_shared<SimTransport>(*this, i));
+        nodes.back()->setClock([this]() { return virtualTime(); });
+        nodes.back()->setSigningKey("netsim:" + std::to_string(config.seed) + ":" + std::to_string(i));
+        nodes.back()->setCommitListener([this, i](const std::string&, const std::vector<Transaction>& txs,
+                                                const std::vector<bool>&) {
+            if (i == producer) producedTxs += txs.size();
+        });
+        memories.emplace_back("text", dataDir + "/memory" + std::to_string(i) + ".txt", "Simulated block", peerName(i), 0);
+    }
+    for (const auto& range : nodes[0]->shardManager.currentMap()->getRanges()) {
+        if (static_cast<int>(activeShards.size()) == shardCount) break;
+        activeShards.push_back(range.shardId);
+    }
+    for (auto& node : nodes) {
+        for (const auto& shardId : activeShards) node->setShardDifficulty(shardId, config.difficulty);
+    }
+    buildTopology();
+    fundSenders();
+}
+
+uint64_t NetworkSimulator::virtualTime() const {
+    return GENESIS_TIMESTAMP + static_cast<uint64_t>(now * 1e6);
+}
+
+NetworkSimulator::~NetworkSimulator() {
+    nodes.clear();
+    std::filesystem::remove_all(dataDir);
+}
+
+// A ring keeps the graph connected; the remaining links are random.
+void NetworkSimulator::buildTopology() {
+    peers.assign(nodeCount, {});
+    auto link = [&](int a, int b) {
+        if (a == b || std::find(peers[a].begin(), peers[a].end(), b) != peers[a].end()) return;
+        peers[a].push_back(b);
+        peers[b].push_back(a);
+    };
+    for (int i = 0; i < nodeCount; i++) link(i, (i + 1) % nodeCount);
+    int degree = std::min(config.peers, nodeCount - 1);
+    std::uniform_int_distribution<int> pick(0, nodeCount - 1);
+    for (int i = 0; i < nodeCount; i++) {
+        for (int attempts = 0; static_cast<int>(peers[i].size()) < degree && attempts < 16 * nodeCount; attempts++) {
+            link(i, pick(rng));
+        }
+    }
+    for (auto& list : peers) std::sort(list.begin(), list.end());
+}
+
+// Senders are funded by real transfers mined on node 0. Every other node
+// imports those blocks directly, before the clock starts, so funding adds
+// nothing to the measured traffic.
+void NetworkSimulator::fundSenders() {
+    std::shared_ptr<const ShardMap> map = nodes[0]->shardManager.currentMap();
+    senders.assign(shardCount, {});
+    size_t filled = 0;
+    std::vector<std::string> addresses;
+    for (int k = 0; filled < activeShards.size(); k++) {
+        std::string address = "sim-account-" + std::to_string(k);
+        auto it = std::find(activeShards.begin(), activeShards.end(), map->lookup(address));
+        if (it == activeShards.end()) continue;
+        auto& list = senders[it - activeShards.begin()];
+        if (static_cast<int>(list.size()) == SIM_SENDERS_PER_SHARD) continue;
+        list.push_back(address);
+        addresses.push_back(address);
+        if (static_cast<int>(list.size()) == SIM_SENDERS_PER_SHARD) filled++;
+    }
+    // Twice what a sender is expected to spend over the run.
+    double funding = std::ceil(2.0 * config.blocks * config.txsPerBlock / (shardCount * SIM_SENDERS_PER_SHARD)) + 1.0;
+    if (!fundLoadGenWallets(*nodes[0], addresses, funding)) log("Network simulation: funding senders failed");
+
+    std::vector<Outgoing> funded;
+    {
+        std::lock_guard<std::mutex> lock(outboxMutex);
+        funded.swap(outbox);
+    }
+    for (int i = 1; i < nodeCount; i++) {
+        // A block crediting receipts needs its source blocks first, so retry until nothing more imports.
+        std::vector<const std::string*> left;
+        for (const auto& message : funded) left.push_back(&message.record);
+        for (bool progress = true; progress && !left.empty();) {
+            progress = false;
+            std::vector<const std::string*> retry;
+            for (const std::string* record : left) {
+                ImportResult outcome = nodes[i]->importBlock(*record, peerName(0));
+                if (outcome == ImportResult::Imported || outcome == ImportResult::Duplicate) progress = true;
+                else retry.push_back(record);
+            }
+            left.swap(retry);
+        }
+    }
+    {
+        std::lock_guard<std::mutex> lock(outboxMutex);
+        outbox.clear();
+    }
+    for (auto& node : nodes) fundingImports.push_back(node->getImportStats());
+    std::lock_guard<std::mutex> lock(nodes[0]->chainMutex);
+    for (const auto& shardId : nodes[0]->blockIndex.shardIds()) fundedHeights[shardId] = nodes[0]->blockIndex.height(shardId);
+}
+
+uint64_t NetworkSimulator::fundedHeight(const std::string& shardId) const {
+    auto it = fundedHeights.find(shardId);
+    return it != fundedHeights.end() ? std::max<uint64_t>(1, it->second) : 1;
+}
+
+void NetworkSimulator::enqueueBroadcast(int from, const std::string& record, const std::string& fromPeer) {
+    std::lock_guard<std::mutex> lock(outboxMutex);
+    outbox.push_back({from, record, fromPeer});
+}
+
+void NetworkSimulator::flushOutbox() {
+    std::vector<Outgoing> pending;
+    {
+        std::lock_guard<std::mutex> lock(outboxMutex);
+        pending.swap(outbox);
+    }
+    if (pending.size() > 1) {
+        // Per-shard block threads broadcast in arbitrary order; fix it before drawing from rng.
+        std::vector<std::pair<std::pair<std::string, int>, size_t>> order;
+        for (size_t i = 0; i < pending.size(); i++) {
+            AhmiyatBlock block = AhmiyatBlock::decode(pending[i].record);
+            order.push_back({{block.getShardId(), block.getIndex()}, i});
+        }
+        std::sort(order.begin(), order.end());
+        std::vector<Outgoing> sorted;
+        for (const auto& entry : order) sorted.push_back(std::move(pending[entry.second]));
+        pending.swap(sorted);
+    }
+    std::uniform_real_distribution<double> unit(0.0, 1.0);
+    for (auto& message : pending) {
+        std::string digest = recordDigest(message.record);
+        if (message.fromPeer.empty()) origins.emplace(digest, std::make_pair(now, 0));
+        auto shared = std::make_shared<const std::string>(std::move(message.record));
+        double transmitMs = shared->size() * 8.0 / (config.bandwidthMbps * 1000.0);
+        for (int to : peers[message.from]) {
+            if (peerName(to) == message.fromPeer) continue;
+            result.messages++;
+            double& busyUntil = linkFree[{message.from, to}];
+            double start = std::max(now, busyUntil);
+            busyUntil = start + transmitMs;
+            double jitter = config.jitterMs * (2.0 * unit(rng) - 1.0);
+            double arrival = busyUntil + std::max(0.0, config.latencyMs + jitter);
+            if (unit(rng) < config.lossRate) {
+                result.messagesLost++;
+                continue;
+            }
+            events.push({arrival, nextSeq++, to, message.from, -1, shared});
+        }
+    }
+}
+
+void NetworkSimulator::produce(int node, int shard) {
+    std::uniform_int_distribution<size_t> pickSender(0, SIM_SENDERS_PER_SHARD - 1);
+    std::uniform_int_distribution<int> pickShard(0, shardCount - 1);
+    std::vector<Transaction> txs;
+    txs.reserve(config.txsPerBlock);
+    for (int i = 0; i < config.txsPerBlock; i++) {
+        const std::string& sender = senders[shard][pickSender(rng)];
+        std::string receiver = senders[pickShard(rng)][pickSender(rng)];
+        if (receiver == sender) receiver = senders[shard][(pickSender(rng) + 1) % SIM_SENDERS_PER_SHARD];
+        if (receiver == sender) continue;
+        txs.emplace_back(sender, receiver, 1.0);
+        // Offset so two picks of the same pair stay distinct transactions.
+        txs.back().timestamp = virtualTime() + i;
+    }
+    producer = node;
+    uint64_t before = producedTxs;
+    nodes[node]->addBlock(std::move(txs), memories[node], peerName(node), 0.0);
+    producer = -1;
+    result.txsIncluded += producedTxs - before;
+}
+
+void NetworkSimulator::deliver(const Event& event) {
+    ImportResult outcome = nodes[event.node]->importBlock(*event.record, peerName(event.from));
+    if (outcome != ImportResult::Imported) return;
+    auto it = origins.find(recordDigest(*event.record));
+    if (it == origins.end()) return;
+    double delayMs = now - it->second.first;
+    result.propagation.record(static_cast<uint64_t>(delayMs * 1000.0) + 1);
+    if (++it->second.second == nodeCount - 1) {
+        result.fullPropagation.record(static_cast<uint64_t>(delayMs * 1000.0) + 1);
+        result.fullyPropagated++;
+    }
+}
+
+NetSimResult NetworkSimulator::run() {
+    result.nodes = nodeCount;
+    result.shards = shardCount;
+    std::exponential_distribution<double> interval(1.0 / config.blockIntervalMs);
+    std::uniform_int_distribution<int> pickNode(0, nodeCount - 1);
+    std::uniform_int_distribution<int> pickShard(0, shardCount - 1);
+    double at = 0.0;
+    for (int i = 0; i < config.blocks; i++) {
+        at += interval(rng);
+        events.push({at, nextSeq++, pickNode(rng), -1, pickShard(rng), nullptr});
+    }
+    auto wallStart = std::chrono::steady_clock::now();
+    while (!events.empty()) {
+        Event event = events.top();
+        events.pop();
+        now = event.time;
+        if (event.record) {
+            deliver(event);
+        } else {
+            produce(event.node, event.shard);
+        }
+        flushOutbox();
+    }
+    result.wallSeconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - wallStart).count();
+    result.virtualSeconds = now / 1000.0;
+    finish();
+    return result;
+}
+
+// Tallies imports, blocks produced and, per shard, how many nodes share the
+// most common tip. Canonical throughput counts transactions on that chain.
+void NetworkSimulator::finish() {
+    for (int i = 0; i < nodeCount; i++) {
+        ImportStats stats = nodes[i]->getImportStats();
+        const ImportStats& funding = fundingImports[i];
+        result.imports.imported += stats.imported - funding.imported;
+        result.imports.duplicates += stats.duplicates - funding.duplicates;
+        result.imports.orphans += stats.orphans - funding.orphans;
+        result.imports.forks += stats.forks - funding.forks;
+        result.imports.invalid += stats.invalid - funding.invalid;
+    }
+    result.blocksProduced = origins.size();
+    size_t agreeing = 0, tips = 0;
+    std::set<std::string> shardIds;
+    for (auto& node : nodes) {
+        std::lock_guard<std::mutex> lock(node->chainMutex);
+        for (const auto& shardId : node->blockIndex.shardIds()) {
+            if (node->blockIndex.height(shardId) > fundedHeight(shardId) || shardId == "0") shardIds.insert(shardId);
+        }
+    }
+    for (const auto& shardId : shardIds) {
+        std::map<std::string, std::vector<int>> byTip;
+        for (int i = 0; i < nodeCount; i++) {
+            std::lock_guard<std::mutex> lock(nodes[i]->chainMutex);
+            BlockHeader tip;
+            byTip[nodes[i]->blockIndex.tip(shardId, tip) ? hashToHex(tip.hash) : ""].push_back(i);
+        }
+        auto best = std::max_element(byTip.begin(), byTip.end(), [](const auto& a, const auto& b) {
+            return a.second.size() < b.second.size();
+        });
+        agreeing += best->second.size();
+        tips += nodeCount;
+        AhmiyatChain& reference = *nodes[best->second.front()];
+        size_t height;
+        {
+            std::lock_guard<std::mutex> lock(reference.chainMutex);
+            height = reference.blockIndex.height(shardId);
+        }
+        uint64_t from = fundedHeight(shardId);
+        for (const auto& header : reference.getHeaders(shardId, from, height)) {
+            auto block = reference.getBlock(hashToHex(header.hash));
+            if (block) result.canonicalTxs += block->getTransactions().size();
+        }
+    }
+    result.tipAgreement = tips ? static_cast<double>(agreeing) / tips : 1.0;
+}
+
+static std::string formatMs(const HdrHistogram& h) {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1) << "p50=" << h.valueAtPercentile(50.0) / 1e3 << "ms p90="
+       << h.valueAtPercentile(90.0) / 1e3 << "ms p99=" << h.valueAtPercentile(99.0) / 1e3 << "ms max="
+       << h.max() / 1e3 << "ms";
+    return ss.str();
+}
+
+void runNetSim(const NetSimConfig& config) {
+    setUploadBackend([](const std::string& filePath) {
+        Hash256 digest;
+        SHA256((const unsigned char*)filePath.data(), filePath.size(), digest.data());
+        return hashToHex(digest);
+    });
+    std::stringstream report;
+    report << std::fixed << std::setprecision(3);
+    report << "Network simulation: latency " << config.latencyMs << "ms +/- " << config.jitterMs << "ms, "
+           << config.bandwidthMbps << " Mbit/s, loss " << config.lossRate << ", " << config.peers
+           << " peers/node, mean block interval " << config.blockIntervalMs << "ms, seed " << config.seed << "\n";
+    for (int shardCount : config.shardCounts) {
+        for (int nodeCount : config.nodeCounts) {
+            NetSimResult r;
+            setLogEnabled(false);
+            {
+                NetworkSimulator sim(config, nodeCount, shardCount);
+                r = sim.run();
+            }
+            setLogEnabled(true);
+            uint64_t received = r.imports.imported + r.imports.orphans + r.imports.forks + r.imports.invalid;
+            auto rate = [&](uint64_t n) { return received ? static_cast<double>(n) / received : 0.0; };
+            report << "nodes=" << r.nodes << " shards=" << r.shards << ": " << r.blocksProduced << " blocks, "
+                   << r.txsIncluded / std::max(r.virtualSeconds, 1e-9) << " tx/s produced, "
+                   << r.canonicalTxs / std::max(r.virtualSeconds, 1e-9) << " tx/s canonical, "
+                   << r.txsIncluded / std::max(r.wallSeconds, 1e-9) << " tx/s wall\n"
+                   << "  propagation " << formatMs(r.propagation) << "; all nodes (" << r.fullyPropagated << "/"
+                   << r.blocksProduced << ") " << formatMs(r.fullPropagation) << "\n"
+                   << "  fork rate " << rate(r.imports.forks) << ", orphan rate " << rate(r.imports.orphans)
+                   << ", invalid " << r.imports.invalid << ", duplicates " << r.imports.duplicates
+                   << ", tip agreement " << r.tipAgreement << ", messages " << r.messages << " (" << r.messagesLost
+                   << " lost)\n";
+        }
+    }
+    std::cout << report.str();
+    log(report.str());
+}
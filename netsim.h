@@ -0,0 +1,123 @@
+#ifndef NETSIM_H
+#define NETSIM_H
+
+#include "blockchain.h"
+#include "histogram.h"
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <random>
+
+struct NetSimConfig {
+    std::vector<int> nodeCounts = {4};
+    std::vector<int> shardCounts = {1};
+    int blocks = 40;
+    int txsPerBlock = 50;
+    double blockIntervalMs = 1000.0;
+    double latencyMs = 50.0;
+    double jitterMs = 20.0;
+    double bandwidthMbps = 100.0;
+    double lossRate = 0.0;
+    int peers = 4;
+    int difficulty = 1;
+    uint64_t seed = 1;
+    std::string dataDir = "netsim_db";
+};
+
+bool parseNetSimArgs(int argc, char* argv[], NetSimConfig& config);
+
+struct NetSimResult {
+    int nodes = 0;
+    int shards = 0;
+    uint64_t blocksProduced = 0;
+    uint64_t txsIncluded = 0;
+    uint64_t canonicalTxs = 0;
+    uint64_t messages = 0;
+    uint64_t messagesLost = 0;
+    ImportStats imports;
+    // Microseconds of virtual time from a block's first broadcast to its
+    // import at each peer, and until the last node imported it.
+    HdrHistogram propagation;
+    HdrHistogram fullPropagation;
+    uint64_t fullyPropagated = 0;
+    double virtualSeconds = 0.0;
+    double wallSeconds = 0.0;
+    // Share of (node, shard) tips that match the most common tip of their shard.
+    double tipAgreement = 0.0;
+};
+
+// Discrete-event simulation of N full nodes in one process. Nodes are real
+// AhmiyatChain instances whose broadcasts go through a simulated transport:
+// every link has latency, jitter, serialization delay at a fixed bandwidth
+// and independent loss. Blocks are produced at random nodes on a Poisson
+// schedule; all randomness comes from one seeded generator. Nodes read the
+// virtual clock and sign with keys derived from the seed, and mining and
+// signing are deterministic, so a run is reproducible from its seed.
+class NetworkSimulator {
+private:
+    struct Event {
+        double time;
+        uint64_t seq;
+        int node;
+        int from;
+        int shard;
+        std::shared_ptr<const std::string> record;
+        bool operator>(const Event& other) const {
+            return time != other.time ? time > other.time : seq > other.seq;
+        }
+    };
+    struct Outgoing {
+        int from;
+        std::string record;
+        std::string fromPeer;
+    };
+
+    NetSimConfig config;
+    int nodeCount;
+    int shardCount;
+    std::string dataDir;
+    std::mt19937_64 rng;
+    std::vector<std::unique_ptr<AhmiyatChain>> nodes;
+    std::vector<MemoryFragment> memories;
+    std::vector<std::vector<int>> peers;
+    std::vector<std::string> activeShards;
+    std::vector<std::vector<std::string>> senders;
+    std::map<std::pair<int, int>, double> linkFree;
+    std::priority_queue<Event, std::vector<Event>, std::greater<Event>> events;
+    uint64_t nextSeq = 0;
+    double now = 0.0;
+    std::mutex outboxMutex;
+    std::vector<Outgoing> outbox;
+    std::unordered_map<std::string, std::pair<double, int>> origins;
+    int producer = -1;
+    std::atomic<uint64_t> producedTxs{0};
+    // Import counts and shard heights once funding is done; the results leave them out.
+    std::vector<ImportStats> fundingImports;
+    std::map<std::string, uint64_t> fundedHeights;
+    NetSimResult result;
+
+    // The virtual clock in the chain's nanosecond ticks, starting at genesis.
+    uint64_t virtualTime() const;
+    void buildTopology();
+    void fundSenders();
+    uint64_t fundedHeight(const std::string& shardId) const;
+    void produce(int node, int shard);
+    void deliver(const Event& event);
+    void flushOutbox();
+    void finish();
+
+public:
+    NetworkSimulator(const NetSimConfig& config, int nodeCount, int shardCount);
+    ~NetworkSimulator();
+    // Called by a node's transport; queued until the current event completes.
+    void enqueueBroadcast(int from, const std::string& record, const std::string& fromPeer);
+    NetSimResult run();
+    static std::string peerName(int node);
+};
+
+// Runs every (nodes, shards) combination in config and prints one row each.
+void runNetSim(const NetSimConfig& config);
+
+#endif
@@ -0,0 +1,209 @@
+#include "receipts.h"
+#include <algorithm>
+
+void CrossShardReceipt::encode(ByteWriter& writer) const {
+    writer.putBytes(id);
+    writer.putBytes(fromShard);
+    writer.putBytes(toShard);
+    writer.putBytes(receiver);
+    writer.putF64(amount);
+    writer.putU64(sourceHeight);
+}
+
+bool CrossShardReceipt::matches(const CrossShardReceipt& other) const {
+    return id == other.id && fromShard == other.fromShard && receiver == other.receiver && amount == other.amount &&
+           sourceHeight == other.sourceHeight;
+}
+
+CrossShardReceipt CrossShardReceipt::decode(ByteReader& reader, bool withSourceHeight) {
+    CrossShardReceipt receipt;
+    receipt.id = reader.getBytes();
+    receipt.fromShard = reader.getBytes();
+    receipt.toShard = reader.getBytes();
+    receipt.receiver = reader.getBytes();
+    receipt.amount = reader.getF64();
+    if (withSourceHeight) receipt.sourceHeight = reader.getU64();
+    return receipt;
+}
+
+ReceiptRouter::Inbox& ReceiptRouter::inbox(const std::string& shardId) {
+    {
+        std::shared_lock<std::shared_mutex> lock(routerMutex);
+        auto it = inboxes.find(shardId);
+        if (it != inboxes.end()) return *it->second;
+    }
+    std::unique_lock<std::shared_mutex> lock(routerMutex);
+    auto& slot = inboxes[shardId];
+    if (!slot) slot.reset(new Inbox());
+    return *slot;
+}
+
+void ReceiptRouter::deliver(const std::string& toShard, const std::vector<CrossShardReceipt>& batch) {
+    enqueue(toShard, batch, false);
+}
+
+void ReceiptRouter::enqueue(const std::string& toShard, const std::vector<CrossShardReceipt>& batch, bool rerouted) {
+    Inbox& box = inbox(toShard);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    std::unordered_set<std::string> touched;
+    for (const auto& receipt : batch) {
+        bool known = rerouted ? box.applied.count(receipt.id) > 0 : settled(box, receipt);
+        SourceProgress& source = box.sources[receipt.fromShard];
+        source.deliveredEnd = std::max(source.deliveredEnd, receipt.sourceHeight + 1);
+        if (!known) {
+            box.pending.push_back(receipt);
+            countPending(box, receipt);
+        }
+        touched.insert(receipt.fromShard);
+    }
+    for (const auto& fromShard : touched) advanceWatermark(box, fromShard);
+}
+
+bool ReceiptRouter::settled(Inbox& box, const CrossShardReceipt& receipt) {
+    if (box.applied.count(receipt.id)) return true;
+    auto source = box.sources.find(receipt.fromShard);
+    return source != box.sources.end() && receipt.sourceHeight < source->second.watermark;
+}
+
+void ReceiptRouter::countPending(Inbox& box, const CrossShardReceipt& receipt) {
+    box.sources[receipt.fromShard].pendingHeights[receipt.sourceHeight]++;
+}
+
+void ReceiptRouter::uncountPending(Inbox& box, const CrossShardReceipt& receipt) {
+    auto& heights = box.sources[receipt.fromShard].pendingHeights;
+    auto it = heights.find(receipt.sourceHeight);
+    if (it != heights.end() && --it->second == 0) heights.erase(it);
+}
+
+void ReceiptRouter::advanceWatermark(Inbox& box, const std::string& fromShard) {
+    auto found = box.sources.find(fromShard);
+    if (found == box.sources.end()) return;
+    SourceProgress& source = found->second;
+    uint64_t lowest = source.pendingHeights.empty() ? source.deliveredEnd : source.pendingHeights.begin()->first;
+    source.watermark = std::max(source.watermark, lowest);
+    auto& appliedHeights = source.appliedHeights;
+    while (!appliedHeights.empty() && appliedHeights.begin()->first < source.watermark) {
+        box.applied.erase(appliedHeights.begin()->second);
+        appliedHeights.erase(appliedHeights.begin());
+    }
+}
+
+std::vector<CrossShardReceipt> ReceiptRouter::peek(const std::string& shardId, size_t max) {
+    Inbox& box = inbox(shardId);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    std::vector<CrossShardReceipt> out;
+    std::unordered_set<std::string> seen;
+    for (const auto& receipt : box.pending) {
+        if (out.size() >= max) break;
+        if (box.applied.count(receipt.id) || !seen.insert(receipt.id).second) continue;
+        out.push_back(receipt);
+    }
+    return out;
+}
+
+std::vector<ReceiptStatus> ReceiptRouter::status(const std::string& shardId,
+                                                 const std::vector<CrossShardReceipt>& receipts) {
+    Inbox& box = inbox(shardId);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    std::unordered_map<std::string, const CrossShardReceipt*> pending;
+    for (const auto& receipt : box.pending) pending.emplace(receipt.id, &receipt);
+    std::vector<ReceiptStatus> out;
+    out.reserve(receipts.size());
+    for (const auto& receipt : receipts) {
+        auto it = pending.find(receipt.id);
+        if (box.applied.count(receipt.id) || (it == pending.end() && settled(box, receipt))) {
+            out.push_back(ReceiptStatus::Settled);
+        } else {
+            out.push_back(it != pending.end() && it->second->matches(receipt) ? ReceiptStatus::Pending
+                                                                              : ReceiptStatus::Unknown);
+        }
+    }
+    return out;
+}
+
+std::vector<bool> ReceiptRouter::markApplied(const std::string& shardId, const std::vector<CrossShardReceipt>& receipts) {
+    Inbox& box = inbox(shardId);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    std::unordered_set<std::string> pendingIds;
+    for (const auto& receipt : box.pending) pendingIds.insert(receipt.id);
+    std::vector<bool> fresh;
+    fresh.reserve(receipts.size());
+    std::unordered_set<std::string> touched;
+    for (const auto& receipt : receipts) {
+        bool credit = pendingIds.count(receipt.id) ? !box.applied.count(receipt.id) : !settled(box, receipt);
+        if (credit) {
+            box.applied.emplace(receipt.id, std::make_pair(receipt.fromShard, receipt.sourceHeight));
+            box.sources[receipt.fromShard].appliedHeights.emplace(receipt.sourceHeight, receipt.id);
+            touched.insert(receipt.fromShard);
+        }
+        fresh.push_back(credit);
+    }
+    box.pending.erase(std::remove_if(box.pending.begin(), box.pending.end(),
+                                     [&](const CrossShardReceipt& r) {
+                                         if (!box.applied.count(r.id)) return false;
+                                         uncountPending(box, r);
+                                         touched.insert(r.fromShard);
+                                         return true;
+                                     }),
+                      box.pending.end());
+    for (const auto& fromShard : touched) advanceWatermark(box, fromShard);
+    return fresh;
+}
+
+void ReceiptRouter::reroute(const std::string& shardId,
+                            const std::function<std::string(const CrossShardReceipt&)>& destination) {
+    std::unordered_map<std::string, std::vector<CrossShardReceipt>> moved;
+    {
+        Inbox& box = inbox(shardId);
+        std::lock_guard<std::mutex> lock(box.inboxMutex);
+        std::deque<CrossShardReceipt> kept;
+        std::unordered_set<std::string> touched;
+        for (auto& receipt : box.pending) {
+            std::string toShard = destination(receipt);
+            if (toShard == shardId) {
+                kept.push_back(std::move(receipt));
+                continue;
+            }
+            uncountPending(box, receipt);
+            touched.insert(receipt.fromShard);
+            receipt.toShard = toShard;
+            moved[toShard].push_back(std::move(receipt));
+        }
+        box.pending.swap(kept);
+        for (const auto& fromShard : touched) advanceWatermark(box, fromShard);
+    }
+    for (const auto& [toShard, batch] : moved) enqueue(toShard, batch, true);
+}
+
+// Inboxes are emptied rather than erased, so references handed out by inbox() stay valid.
+void ReceiptRouter::clear() {
+    std::shared_lock<std::shared_mutex> lock(routerMutex);
+    for (auto& [shardId, box] : inboxes) {
+        std::lock_guard<std::mutex> inboxLock(box->inboxMutex);
+        box->pending.clear();
+        box->applied.clear();
+        box->sources.clear();
+    }
+}
+
+size_t ReceiptRouter::pendingCount(const std::string& shardId) {
+    Inbox& box = inbox(shardId);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    return box.pending.size();
+}
+
+size_t ReceiptRouter::appliedCount(const std::string& shardId) {
+    Inbox& box = inbox(shardId);
+    std::lock_guard<std::mutex> lock(box.inboxMutex);
+    return box.applied.size();
+}
+
+std::vector<std::string> ReceiptRouter::shardsWithPending() {
+    std::vector<std::string> shards;
+    std::shared_lock<std::shared_mutex> lock(routerMutex);
+    for (const auto& [shardId, box] : inboxes) {
+        std::lock_guard<std::mutex> inboxLock(box->inboxMutex);
+        if (!box->pending.empty()) shards.push_back(shardId);
+    }
+    return shards;
+}
@@ -0,0 +1,97 @@
+#ifndef RECEIPTS_H
+#define RECEIPTS_H
+
+#include <string>
+#include <vector>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <unordered_set>
+#include <functional>
+#include "codec.h"
+
+const size_t MAX_RECEIPTS_PER_BLOCK = 1024;
+
+// Proof that the source shard debited `amount` for `receiver`; the
+// destination shard credits it exactly once in a later block.
+struct CrossShardReceipt {
+    std::string id;
+    std::string fromShard;
+    std::string toShard;
+    std::string receiver;
+    double amount = 0.0;
+    // Height of the source-shard block that debited the sender.
+    uint64_t sourceHeight = 0;
+    // Same transfer; toShard is ignored because reroutes change it.
+    bool matches(const CrossShardReceipt& other) const;
+    void encode(ByteWriter& writer) const;
+    static CrossShardReceipt decode(ByteReader& reader, bool withSourceHeight = true);
+};
+
+enum class ReceiptStatus { Unknown, Pending, Settled };
+
+// Per-destination inbound queues. Block commits deliver and drain receipts
+// under the chain lock; each inbox's own lock lets readers outside it, such as
+// the miner looking for shards with pending receipts, run without waiting on
+// the chain or on other shards.
+//
+// Applied receipt ids are only kept until they fall below their source
+// shard's watermark: the source height below which every receipt delivered
+// to this inbox has been credited. Source blocks commit in height order, so
+// a receipt below the watermark that is not pending has already been
+// credited and is treated as applied.
+class ReceiptRouter {
+private:
+    struct SourceProgress {
+        // One past the highest source height delivered.
+        uint64_t deliveredEnd = 0;
+        uint64_t watermark = 0;
+        // Pending receipts per source height; the lowest bounds the watermark.
+        std::map<uint64_t, size_t> pendingHeights;
+        // Applied ids by source height, pruned from the front as the watermark passes them.
+        std::multimap<uint64_t, std::string> appliedHeights;
+    };
+    struct Inbox {
+        std::mutex inboxMutex;
+        std::deque<CrossShardReceipt> pending;
+        // Receipt id -> source shard and height.
+        std::unordered_map<std::string, std::pair<std::string, uint64_t>> applied;
+        std::unordered_map<std::string, SourceProgress> sources;
+    };
+    std::unordered_map<std::string, std::unique_ptr<Inbox>> inboxes;
+    mutable std::shared_mutex routerMutex;
+
+    Inbox& inbox(const std::string& shardId);
+    // True for receipts this inbox has already credited; inboxMutex held.
+    static bool settled(Inbox& box, const CrossShardReceipt& receipt);
+    // Pending bookkeeping for one receipt entering or leaving box.pending; inboxMutex held.
+    static void countPending(Inbox& box, const CrossShardReceipt& receipt);
+    static void uncountPending(Inbox& box, const CrossShardReceipt& receipt);
+    // Advances one source's watermark and prunes applied ids below it; inboxMutex held.
+    static void advanceWatermark(Inbox& box, const std::string& fromShard);
+    // Rerouted receipts may sit below the new inbox's watermark and are only checked against applied ids.
+    void enqueue(const std::string& toShard, const std::vector<CrossShardReceipt>& batch, bool rerouted);
+
+public:
+    void deliver(const std::string& toShard, const std::vector<CrossShardReceipt>& batch);
+    std::vector<CrossShardReceipt> peek(const std::string& shardId, size_t max);
+    // Per receipt: Pending if an identical receipt waits in shardId's inbox,
+    // Settled if shardId has already credited it.
+    std::vector<ReceiptStatus> status(const std::string& shardId, const std::vector<CrossShardReceipt>& receipts);
+    // Marks receipts as credited and drops them from the inbox. The result
+    // flags which receipts had not been applied before.
+    std::vector<bool> markApplied(const std::string& shardId, const std::vector<CrossShardReceipt>& receipts);
+    // Re-delivers pending receipts whose destination changed after a shard
+    // map update.
+    void reroute(const std::string& shardId, const std::function<std::string(const CrossShardReceipt&)>& destination);
+    // Empties every inbox, e.g. before replay rebuilds them from the block store.
+    void clear();
+    size_t pendingCount(const std::string& shardId);
+    size_t appliedCount(const std::string& shardId);
+    std::vector<std::string> shardsWithPending();
+};
+
+#endif
@@ -0,0 +1,36 @@
+#include "recenttxs.h"
+#include <algorithm>
+
+bool RecentTxs::contains(const std::string& signature) const {
+    return signatures.count(signature) > 0;
+}
+
+void RecentTxs::insert(uint64_t expiry, Entry entry) {
+    if (!signatures.insert(entry.signature).second) return;
+    byExpiry[expiry].push_back(std::move(entry));
+}
+
+void RecentTxs::expire(uint64_t seconds) {
+    auto end = byExpiry.lower_bound(seconds);
+    for (auto it = byExpiry.begin(); it != end; ++it) {
+        for (const auto& entry : it->second) signatures.erase(entry.signature);
+    }
+    byExpiry.erase(byExpiry.begin(), end);
+}
+
+std::vector<std::pair<uint64_t, RecentTxs::Entry>> RecentTxs::extract(
+    const std::function<bool(const std::string&)>& leaving) {
+    std::vector<std::pair<uint64_t, Entry>> out;
+    for (auto it = byExpiry.begin(); it != byExpiry.end();) {
+        auto& entries = it->second;
+        auto kept = std::stable_partition(entries.begin(), entries.end(),
+                                          [&](const Entry& entry) { return !leaving(entry.sender); });
+        for (auto moved = kept; moved != entries.end(); ++moved) {
+            signatures.erase(moved->signature);
+            out.emplace_back(it->first, std::move(*moved));
+        }
+        entries.erase(kept, entries.end());
+        it = entries.empty() ? byExpiry.erase(it) : std::next(it);
+    }
+    return out;
+}
@@ -0,0 +1,40 @@
+#ifndef RECENTTXS_H
+#define RECENTTXS_H
+
+#include <cstdint>
+#include <functional>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+// How long after its timestamp a transaction may still be included in a block.
+const uint64_t TX_EXPIRY_SECONDS = 3600;
+
+// Signatures of the transactions a shard committed that a block on its tip
+// could still include again. Blocks reject expired transactions, so the set
+// forgets them and holds recent volume instead of every transaction ever
+// committed.
+class RecentTxs {
+public:
+    struct Entry {
+        std::string signature;
+        std::string sender;
+    };
+
+private:
+    std::unordered_set<std::string> signatures;
+    // Entries by the Unix second their transaction expires.
+    std::map<uint64_t, std::vector<Entry>> byExpiry;
+
+public:
+    bool contains(const std::string& signature) const;
+    void insert(uint64_t expiry, Entry entry);
+    // Forgets transactions that expired before `seconds`.
+    void expire(uint64_t seconds);
+    // Removes and returns, with their expiry, the entries whose sender `leaving` selects.
+    std::vector<std::pair<uint64_t, Entry>> extract(const std::function<bool(const std::string&)>& leaving);
+    size_t size() const { return signatures.size(); }
+};
+
+#endif
@@ -0,0 +1,538 @@
+#include "reindex.h"
+#include "utils.h"
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <sstream>
+#include <thread>
+#include <tuple>
+#include <unordered_set>
+#include <leveldb/write_batch.h>
+
+namespace {
+
+// Hand-off between two pipeline stages. close() wakes both sides: push then
+// fails and pop drains what is left.
+template <typename T>
+class StageQueue {
+private:
+    std::deque<T> items;
+    size_t capacity;
+    bool closed = false;
+    std::mutex mutex;
+    std::condition_variable notEmpty;
+    std::condition_variable notFull;
+
+public:
+    explicit StageQueue(size_t cap) : capacity(cap) {}
+    bool push(T item) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notFull.wait(lock, [&] { return closed || items.size() < capacity; });
+        if (closed) return false;
+        items.push_back(std::move(item));
+        notEmpty.notify_one();
+        return true;
+    }
+    bool pop(T& out) {
+        std::unique_lock<std::mutex> lock(mutex);
+        notEmpty.wait(lock, [&] { return closed || !items.empty(); });
+        if (items.empty()) return false;
+        out = std::move(items.front());
+        items.pop_front();
+        notFull.notify_one();
+        return true;
+    }
+    void close() {
+        std::lock_guard<std::mutex> lock(mutex);
+        closed = true;
+        notEmpty.notify_all();
+        notFull.notify_all();
+    }
+};
+
+struct ReindexItem {
+    uint64_t height = 0;
+    std::string hash;
+    std::string record;
+    std::shared_ptr<const AhmiyatBlock> block;
+};
+
+const std::string HEIGHT_PREFIX = "hgt:";
+const std::string HISTORY_PREFIX = "h:";
+
+}
+
+bool parseReindexArgs(int argc, char* argv[], ReindexConfig& config) {
+    for (int i = 0; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--verify-only") {
+            config.verifyOnly = true;
+            continue;
+        }
+        if (i + 1 >= argc) return false;
+        std::string value = argv[++i];
+        try {
+            if (arg == "--db") config.dbPath = value;
+            else if (arg == "--threads") config.threads = static_cast<unsigned>(std::stoul(value));
+            else return false;
+        } catch (const std::exception&) {
+            return false;
+        }
+    }
+    return true;
+}
+
+std::string ReindexReport::toString() const {
+    std::stringstream ss;
+    ss << std::fixed << std::setprecision(1);
+    ss << "Reindex: " << blocks << " blocks, " << txs << " txs, " << bytes / (1024.0 * 1024.0) << " MiB in "
+       << seconds << "s (" << (seconds > 0 ? blocks / seconds : 0.0) << " blocks/s, "
+       << (seconds > 0 ? txs / seconds : 0.0) << " tx/s, "
+       << (seconds > 0 ? bytes / (1024.0 * 1024.0) / seconds : 0.0) << " MiB/s)\n";
+    for (const auto& [shardId, height] : heights) ss << "  shard " << shardId << ": " << height << " blocks\n";
+    if (consistent) {
+        ss << "  consistent\n";
+    } else {
+        ss << "  first inconsistency: shard " << failedShard << " height " << failedHeight << ": " << error << "\n";
+    }
+    return ss.str();
+}
+
+ChainReindexer::ChainReindexer(AhmiyatChain& c, const ReindexConfig& cfg) : chain(c), config(cfg) {}
+
+std::vector<std::string> ChainReindexer::listShards() {
+    std::vector<std::string> shards;
+    std::unique_ptr<leveldb::Iterator> it(chain.db->NewIterator(leveldb::ReadOptions()));
+    it->Seek(HEIGHT_PREFIX);
+    while (it->Valid() && it->key().starts_with(HEIGHT_PREFIX)) {
+        std::string key = it->key().ToString();
+        if (key.size() < HEIGHT_PREFIX.size() + 1 + 8) {
+            it->Next();
+            continue;
+        }
+        std::string shardId = key.substr(HEIGHT_PREFIX.size(), key.size() - HEIGHT_PREFIX.size() - 1 - 8);
+        shards.push_back(shardId);
+        // ';' sorts right after ':', so this skips the rest of the shard's heights.
+        it->Seek(HEIGHT_PREFIX + shardId + ";");
+    }
+    return shards;
+}
+
+void ChainReindexer::reset() {
+    std::lock_guard<std::mutex> lock(chain.chainMutex);
+    chain.fragmentUnlocks.clear();
+    chain.blockIndex.clear();
+    chain.shardBalances.clear();
+    chain.stateTrees.clear();
+    chain.recentTxs.clear();
+    chain.shardStakes.clear();
+    chain.migratingShards.clear();
+    chain.proposedShardMap.reset();
+    chain.blocksSinceReshard = 0;
+    chain.totalMined = 0.0;
+    chain.receiptRouter.clear();
+    sentReceipts.clear();
+    creditedReceipts.clear();
+}
+
+bool ChainReindexer::loadShardMaps() {
+    maps.clear();
+    auto initial = std::make_shared<const ShardMap>();
+    maps[initial->getVersion()] = initial;
+    std::string prefix = HEIGHT_PREFIX + "0:";
+    std::unique_ptr<leveldb::Iterator> it(chain.db->NewIterator(leveldb::ReadOptions()));
+    for (it->Seek(prefix); it->Valid() && it->key().starts_with(prefix); it->Next()) {
+        if (it->key().size() != prefix.size() + 8) continue;
+        std::string record;
+        if (!chain.db->Get(leveldb::ReadOptions(), blockKey(it->value().ToString()), &record).ok()) break;
+        // Broken records are left for the shard 0 pipeline to report.
+        std::shared_ptr<const AhmiyatBlock> block;
+        try {
+            block = std::make_shared<const AhmiyatBlock>(AhmiyatBlock::decode(record));
+        } catch (const std::exception&) {
+            break;
+        }
+        if (block->getShardMapChange().empty()) continue;
+        uint64_t height = static_cast<uint64_t>(block->getIndex());
+        std::shared_ptr<const ShardMap> map;
+        try {
+            map = std::make_shared<const ShardMap>(ShardMap::decode(block->getShardMapChange()));
+        } catch (const std::exception& e) {
+            fail("0", height, "undecodable shard map change: " + std::string(e.what()));
+            return false;
+        }
+        if (map->getVersion() <= maps.rbegin()->first) {
+            fail("0", height, "shard map change to version " + std::to_string(map->getVersion()) +
+                                  " does not advance version " + std::to_string(maps.rbegin()->first));
+            return false;
+        }
+        maps[map->getVersion()] = map;
+    }
+    {
+        std::lock_guard<std::mutex> lock(chain.chainMutex);
+        configuredDifficulty = chain.shardDifficulties;
+    }
+    // As on install, a new shard starts at the difficulty of the shard that owned its range.
+    std::shared_ptr<const ShardMap> previous;
+    for (const auto& [version, map] : maps) {
+        for (const auto& range : map->getRanges()) {
+            if (previous && !configuredDifficulty.count(range.shardId)) {
+                configuredDifficulty[range.shardId] = configuredDifficulty[previous->lookupKey(range.start)];
+            }
+        }
+        previous = map;
+    }
+    return true;
+}
+
+void ChainReindexer::clearHistory() {
+    std::unique_ptr<leveldb::Iterator> it(chain.db->NewIterator(leveldb::ReadOptions()));
+    leveldb::WriteBatch batch;
+    size_t pending = 0;
+    for (it->Seek(HISTORY_PREFIX); it->Valid() && it->key().starts_with(HISTORY_PREFIX); it->Next()) {
+        batch.Delete(it->key());
+        if (++pending == 4096) {
+            chain.db->Write(leveldb::WriteOptions(), &batch);
+            batch.Clear();
+            pending = 0;
+        }
+    }
+    if (pending) chain.db->Write(leveldb::WriteOptions(), &batch);
+}
+
+void ChainReindexer::fail(const std::string& shardId, uint64_t height, const std::string& error) {
+    std::lock_guard<std::mutex> lock(reportMutex);
+    if (failed.exchange(true)) return;
+    report.consistent = false;
+    report.failedShard = shardId;
+    report.failedHeight = height;
+    report.error = error;
+}
+
+void ChainReindexer::runShard(const std::string& shardId) {
+    StageQueue<ReindexItem> read(REINDEX_QUEUE_DEPTH), hashed(REINDEX_QUEUE_DEPTH), verified(REINDEX_QUEUE_DEPTH);
+    auto configured = configuredDifficulty.find(shardId);
+    int difficulty = configured != configuredDifficulty.end() ? configured->second : 0;
+    // Shards added by a split inherited whatever their owner had reached, and
+    // unconfigured shards whatever the writing node had; neither is on chain.
+    const auto& initialRanges = maps.begin()->second->getRanges();
+    bool split = std::none_of(initialRanges.begin(), initialRanges.end(),
+                              [&](const ShardRange& range) { return range.shardId == shardId; });
+    bool unknownGenesis = split || configured == configuredDifficulty.end();
+
+    std::thread reader([&]() {
+        std::string prefix = HEIGHT_PREFIX + shardId + ":";
+        std::unique_ptr<leveldb::Iterator> it(chain.db->NewIterator(leveldb::ReadOptions()));
+        uint64_t expected = 0;
+        for (it->Seek(prefix); !failed && it->Valid() && it->key().starts_with(prefix); it->Next()) {
+            if (it->key().size() != prefix.size() + 8) continue;
+            ReindexItem item;
+            const char* height = it->key().data() + prefix.size();
+            for (int i = 0; i < 8; i++) item.height = (item.height << 8) | static_cast<uint8_t>(height[i]);
+            if (item.height != expected) {
+                fail(shardId, expected, "no block stored at this height");
+                break;
+            }
+            item.hash = it->value().ToString();
+            if (!chain.db->Get(leveldb::ReadOptions(), blockKey(item.hash), &item.record).ok()) {
+                fail(shardId, item.height, "block record " + item.hash.substr(0, 16) + " missing");
+                break;
+            }
+            expected++;
+            if (!read.push(std::move(item))) break;
+        }
+        read.close();
+    });
+
+    std::thread hasher([&]() {
+        ReindexItem item;
+        while (!failed && read.pop(item)) {
+            try {
+                item.block = std::make_shared<const AhmiyatBlock>(AhmiyatBlock::decode(item.record));
+            } catch (const std::exception& e) {
+                fail(shardId, item.height, "undecodable record: " + std::string(e.what()));
+                break;
+            }
+            if (item.block->getHash() != item.hash) {
+                fail(shardId, item.height, "record hash differs from the height index");
+                break;
+            }
+            if (!item.block->validate()) {
+                fail(shardId, item.height, "hash, proof of work or transaction check failed");
+                break;
+            }
+            if (!hashed.push(std::move(item))) break;
+        }
+        read.close();
+        hashed.close();
+    });
+
+    std::thread verifier([&]() {
+        ReindexItem item;
+        std::string parent = "0";
+        uint64_t parentTime = 0;
+        int parentDifficulty = 0;
+        // What retargetedDifficulty reads from the block index: the last
+        // DIFFICULTY_WINDOW timestamps and the stake summed over the shard.
+        std::deque<uint64_t> window;
+        double stakeSum = 0.0;
+        uint64_t mapVersion = maps.begin()->first;
+        while (!failed && hashed.pop(item)) {
+            const AhmiyatBlock& block = *item.block;
+            if (block.getShardId() != shardId || static_cast<uint64_t>(block.getIndex()) != item.height) {
+                fail(shardId, item.height, "block claims shard " + block.getShardId() + " height " +
+                                               std::to_string(block.getIndex()));
+                break;
+            }
+            if (block.getPreviousHash() != parent) {
+                fail(shardId, item.height, "previous hash does not link to height " + std::to_string(item.height - 1));
+                break;
+            }
+            if (block.getTimestamp() < parentTime) {
+                fail(shardId, item.height, "timestamp precedes the parent block's");
+                break;
+            }
+            int claimed = block.getDifficulty();
+            bool allowed = claimed == difficulty;
+            if (item.height == 0) {
+                allowed |= unknownGenesis || (shardId == "0" && claimed == INITIAL_DIFFICULTY);
+            } else {
+                int retargeted = item.height <= DIFFICULTY_WINDOW
+                                     ? parentDifficulty
+                                     : retargetDifficulty(parentDifficulty, window.back() - window.front(),
+                                                          stakeSum / item.height);
+                allowed |= claimed == parentDifficulty || claimed == retargeted;
+            }
+            if (!allowed) {
+                fail(shardId, item.height, "difficulty " + std::to_string(claimed) +
+                                               " is neither the configured, the parent's nor the retargeted one");
+                break;
+            }
+            // Shard 0 builds each block under the map its last change installed;
+            // other shards may lag behind it, but never go back.
+            uint64_t version = block.getShardMapVersion();
+            if (shardId == "0" ? version != mapVersion : (version < mapVersion || !maps.count(version))) {
+                fail(shardId, item.height, "built under shard map version " + std::to_string(version) +
+                                               " after version " + std::to_string(mapVersion));
+                break;
+            }
+            mapVersion = version;
+            if (!block.getShardMapChange().empty()) {
+                auto next = maps.upper_bound(version);
+                if (next == maps.end()) {
+                    fail(shardId, item.height, "shard map change was not loaded");
+                    break;
+                }
+                mapVersion = next->first;
+            }
+            parent = block.getHash();
+            parentTime = block.getTimestamp();
+            parentDifficulty = claimed;
+            window.push_back(block.getTimestamp());
+            if (window.size() > DIFFICULTY_WINDOW) window.pop_front();
+            stakeSum += block.getStakeWeight();
+            if (!verified.push(std::move(item))) break;
+        }
+        hashed.close();
+        verified.close();
+    });
+
+    // Applier: re-executes each block against the state rebuilt so far.
+    ReindexItem item;
+    leveldb::WriteBatch historyBatch;
+    size_t batched = 0;
+    uint64_t blocks = 0, txs = 0, bytes = 0;
+    // Shards replay in parallel, so a tx may already sit in another shard's window.
+    auto committed = [&](const std::string& signature) {
+        for (const auto& [id, recent] : chain.recentTxs) {
+            if (recent.contains(signature)) return true;
+        }
+        return false;
+    };
+    while (!failed && verified.pop(item)) {
+        const AhmiyatBlock& block = *item.block;
+        std::string error;
+        std::vector<bool> applied(block.getTransactions().size(), true), credited;
+        std::shared_ptr<const ShardMap> map = maps.at(block.getShardMapVersion());
+        {
+            std::lock_guard<std::mutex> lock(chain.chainMutex);
+            if (shardId == "0" && item.height == 0) {
+                std::vector<std::string> touched;
+                for (const auto& tx : block.getTransactions()) {
+                    chain.shardBalances[shardId][tx.receiver] += tx.amount;
+                    chain.totalMined += tx.amount;
+                    touched.push_back(tx.receiver);
+                }
+                chain.appendHeader(block);
+                chain.publishSnapshot(shardId, touched);
+                if (hashToHex(chain.stateTrees[shardId].rootHash()) != block.getStateRoot()) error = "genesis state root mismatch";
+            } else {
+                for (const auto& tx : block.getTransactions()) {
+                    if (committed(tx.signature)) error = "transaction " + tx.getHash().substr(0, 16) + " replayed";
+                    else if (map->lookup(tx.sender) != shardId) error = "transaction " + tx.getHash().substr(0, 16) + " from another shard's sender";
+                }
+                if (error.empty()) error = creditReceipts(shardId, block, *map);
+                BlockExecution execution;
+                if (error.empty()) {
+                    execution = chain.executeBlock(shardId, block.getTransactions(), block.getMemory().owner,
+                                                   block.getStakeWeight(), block.getTimestamp(),
+                                                   &block.getIncomingReceipts(), map);
+                    bool sameReceipts = execution.outgoing.size() == block.getOutgoingReceipts().size();
+                    for (size_t i = 0; sameReceipts && i < execution.outgoing.size(); i++) {
+                        sameReceipts = execution.outgoing[i].id == block.getOutgoingReceipts()[i].id;
+                    }
+                    if (!sameReceipts) error = "outgoing receipts differ on re-execution";
+                    else if (hashToHex(execution.stateRoot) != block.getStateRoot()) error = "state root mismatch on re-execution";
+                }
+                if (error.empty()) {
+                    chain.appendHeader(block);
+                    chain.recordTxs(block);
+                    credited = chain.applyBlock(shardId, execution, false);
+                    applied = execution.applied;
+                    for (const auto& receipt : block.getOutgoingReceipts()) {
+                        if (!creditedReceipts.count(receipt.id)) sentReceipts.emplace(receipt.id, receipt);
+                    }
+                }
+            }
+        }
+        if (!error.empty()) {
+            fail(shardId, item.height, error);
+            break;
+        }
+        chain.updateReward(shardId);
+        if (!config.verifyOnly) {
+            HistoryIndex::indexBlock(historyBatch, block, applied, credited, *map);
+            if (++batched == REINDEX_HISTORY_BATCH_BLOCKS) {
+                chain.db->Write(leveldb::WriteOptions(), &historyBatch);
+                historyBatch.Clear();
+                batched = 0;
+            }
+        }
+        blocks++;
+        txs += block.getTransactions().size();
+        bytes += item.record.size();
+    }
+    verified.close();
+    reader.join();
+    hasher.join();
+    verifier.join();
+    if (batched) chain.db->Write(leveldb::WriteOptions(), &historyBatch);
+
+    std::lock_guard<std::mutex> lock(reportMutex);
+    report.blocks += blocks;
+    report.txs += txs;
+    report.bytes += bytes;
+    report.heights[shardId] = blocks;
+}
+
+ReindexReport ChainReindexer::run() {
+    auto start = std::chrono::steady_clock::now();
+    std::vector<std::string> shardIds = listShards();
+    reset();
+    if (!loadShardMaps()) {
+        report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        return report;
+    }
+    if (!config.verifyOnly) clearHistory();
+    unsigned threads = config.threads ? config.threads : std::max(1u, std::thread::hardware_concurrency());
+    threads = std::min<unsigned>(threads, std::max<size_t>(1, shardIds.size()));
+    std::atomic<size_t> next{0};
+    std::vector<std::thread> workers;
+    for (unsigned t = 0; t < threads; t++) {
+        workers.emplace_back([&]() {
+            for (size_t i = next++; i < shardIds.size() && !failed; i = next++) runShard(shardIds[i]);
+        });
+    }
+    for (auto& t : workers) t.join();
+    if (!failed) finish(shardIds);
+    report.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    return report;
+}
+
+// Shards replay in any order, so the router's inboxes are not rebuilt as
+// blocks apply: a receipt is checked against its stored source block, and
+// credited at most once across all shards.
+std::string ChainReindexer::creditReceipts(const std::string& shardId, const AhmiyatBlock& block, const ShardMap& map) {
+    const auto& incoming = block.getIncomingReceipts();
+    if (incoming.size() > MAX_RECEIPTS_PER_BLOCK) return "too many incoming receipts";
+    for (const auto& receipt : incoming) {
+        if (creditedReceipts.count(receipt.id)) return "receipt " + receipt.id.substr(0, 16) + " credited twice";
+        if (map.lookup(receipt.receiver) != shardId || !chain.sentBySource(receipt)) {
+            return "incoming receipts not sent by their source blocks";
+        }
+        creditedReceipts.emplace(receipt.id, std::make_pair(shardId, receipt));
+        sentReceipts.erase(receipt.id);
+    }
+    return "";
+}
+
+// Receipts sent and not credited wait in their receivers' current shards;
+// credited ones are marked applied where they were credited, so they are
+// settled if a peer offers them again.
+void ChainReindexer::rebuildReceipts(const ShardMap& latest) {
+    auto bySource = [](const CrossShardReceipt& a, const CrossShardReceipt& b) {
+        return std::tie(a.fromShard, a.sourceHeight, a.id) < std::tie(b.fromShard, b.sourceHeight, b.id);
+    };
+    std::map<std::string, std::vector<CrossShardReceipt>> pending, credited;
+    for (auto receipt : sentReceipts) {
+        receipt.second.toShard = latest.lookup(receipt.second.receiver);
+        pending[receipt.second.toShard].push_back(receipt.second);
+    }
+    for (const auto& [id, entry] : creditedReceipts) credited[entry.first].push_back(entry.second);
+    for (auto* inboxes : {&pending, &credited}) {
+        for (auto& [shardId, receipts] : *inboxes) {
+            std::sort(receipts.begin(), receipts.end(), bySource);
+            chain.receiptRouter.deliver(shardId, receipts);
+        }
+    }
+    for (const auto& [shardId, receipts] : credited) chain.receiptRouter.markApplied(shardId, receipts);
+}
+
+// Leaves the chain where its blocks do: under the newest committed map, with
+// pending receipts in their receivers' current shards, stakes in their
+// owners', each shard resuming at its tip's difficulty, and shards whose range
+// changed since their tip due a migration block.
+void ChainReindexer::finish(const std::vector<std::string>& shardIds) {
+    std::lock_guard<std::mutex> lock(chain.chainMutex);
+    std::shared_ptr<const ShardMap> latest = maps.rbegin()->second;
+    chain.shardManager.installMap(latest);
+    auto bounds = [](const ShardMap& map, const std::string& shardId) {
+        for (const auto& range : map.getRanges()) {
+            if (range.shardId == shardId) return std::make_pair(range.start, range.end);
+        }
+        return std::make_pair(uint32_t(1), uint32_t(0));
+    };
+    for (const auto& [shardId, difficulty] : configuredDifficulty) chain.shardDifficulties[shardId] = difficulty;
+    rebuildReceipts(*latest);
+    for (const auto& shardId : shardIds) {
+        BlockHeader tip;
+        if (!chain.blockIndex.tip(shardId, tip)) continue;
+        chain.shardDifficulties[shardId] = tip.difficulty;
+        chain.migrateStakes(shardId, *latest);
+        chain.migrateRecentTxs(shardId, *latest);
+        if (bounds(*maps.at(tip.shardMapVersion), shardId) != bounds(*latest, shardId)) chain.migratingShards.insert(shardId);
+    }
+}
+
+bool runReindex(const ReindexConfig& config) {
+    ReindexReport report;
+    {
+        AhmiyatChain chain(config.dbPath);
+        report = ChainReindexer(chain, config).run();
+    }
+    std::cout << report.toString();
+    log(report.toString());
+    return report.consistent;
+}
+
+bool restoreChain(AhmiyatChain& chain) {
+    ReindexConfig config;
+    config.verifyOnly = true;
+    ReindexReport report = ChainReindexer(chain, config).run();
+    log(report.toString());
+    if (!report.consistent) log("Block store is inconsistent; refusing to start. See ./ahmiyat reindex --verify-only");
+    return report.consistent;
+}
@@ -0,0 +1,93 @@
+#ifndef REINDEX_H
+#define REINDEX_H
+
+#include "blockchain.h"
+#include <atomic>
+#include <map>
+#include <mutex>
+#include <unordered_map>
+
+const size_t REINDEX_QUEUE_DEPTH = 64;
+const size_t REINDEX_HISTORY_BATCH_BLOCKS = 256;
+
+struct ReindexConfig {
+    std::string dbPath = "ahmiyat_db";
+    // Shards replayed at once; each runs its own four-stage pipeline.
+    unsigned threads = 0;
+    // Checks the store and rebuilds in-memory state without writing to LevelDB.
+    bool verifyOnly = false;
+};
+
+bool parseReindexArgs(int argc, char* argv[], ReindexConfig& config);
+
+struct ReindexReport {
+    uint64_t blocks = 0;
+    uint64_t txs = 0;
+    uint64_t bytes = 0;
+    double seconds = 0.0;
+    std::map<std::string, uint64_t> heights;
+    bool consistent = true;
+    std::string failedShard;
+    uint64_t failedHeight = 0;
+    std::string error;
+    std::string toString() const;
+};
+
+// Rebuilds a chain's state from its block store. Every shard is scanned in
+// height order through a reader -> hasher -> verifier -> applier pipeline:
+// the reader pulls records from LevelDB, the hasher decodes them and checks
+// hashes and proof of work, the verifier checks heights, parent links,
+// timestamps, difficulty and shard map versions, and the applier checks
+// receipts, re-executes each block under chainMutex and compares its
+// receipts and state root with the stored ones. Shards run in parallel, and
+// the first inconsistency in any shard stops all of them.
+//
+// Shard 0's map changes are read before replay, so each block runs under
+// the map it was built under. A block's difficulty must be the configured
+// one, its parent's, or the retarget rule applied to its shard's chain.
+// Receipts are checked against the stored source block, which its own
+// shard's replay verifies, and the receipt router is rebuilt once every
+// shard is done. Stakes are bonded on chain but follow their accounts to
+// new shards only as maps install, which replay does at the end, so a
+// block's claimed stake is not checked.
+class ChainReindexer {
+private:
+    AhmiyatChain& chain;
+    ReindexConfig config;
+    std::atomic<bool> failed{false};
+    std::mutex reportMutex;
+    ReindexReport report;
+    // Every map shard 0 committed, by version, and the difficulty each shard
+    // was configured with. Both are fixed before the shards start.
+    std::map<uint64_t, std::shared_ptr<const ShardMap>> maps;
+    std::unordered_map<std::string, int> configuredDifficulty;
+    // Receipts replayed blocks sent that no replayed block has credited yet,
+    // and the credited ones with the shard that credited them; chainMutex held.
+    std::unordered_map<std::string, CrossShardReceipt> sentReceipts;
+    std::unordered_map<std::string, std::pair<std::string, CrossShardReceipt>> creditedReceipts;
+
+    std::vector<std::string> listShards();
+    bool loadShardMaps();
+    void reset();
+    void clearHistory();
+    void runShard(const std::string& shardId);
+    void fail(const std::string& shardId, uint64_t height, const std::string& error);
+    // Checks a block's incoming receipts against the store and records them; chainMutex held.
+    std::string creditReceipts(const std::string& shardId, const AhmiyatBlock& block, const ShardMap& map);
+    void rebuildReceipts(const ShardMap& latest);
+    void finish(const std::vector<std::string>& shardIds);
+
+public:
+    ChainReindexer(AhmiyatChain& chain, const ReindexConfig& config);
+    ReindexReport run();
+};
+
+// Opens config.dbPath, reindexes it and prints the report. Returns false if
+// the store is inconsistent.
+bool runReindex(const ReindexConfig& config);
+
+// Loads a node's state at startup by replaying its store without writing to
+// it. Returns false, after logging the report, if the store is inconsistent.
+bool restoreChain(AhmiyatChain& chain);
+
+#endif
@@ -0,0 +1,281 @@
+#include "script.h"
+#include <openssl/sha.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <openssl/ec.h>
+#include <cstdlib>
+#include <cctype>
+#include <cmath>
+#include <sstream>
+#include <variant>
+#include <mutex>
+
+typedef std::variant<double, std::string> ScriptValue;
+
+static const std::unordered_map<std::string, ScriptOp> OPCODES = {
+    {"SENDER", ScriptOp::Sender}, {"RECEIVER", ScriptOp::Receiver}, {"AMOUNT", ScriptOp::Amount},
+    {"FEE", ScriptOp::Fee}, {"NOW", ScriptOp::Now}, {"BALANCE", ScriptOp::Balance},
+    {"ADD", ScriptOp::Add}, {"SUB", ScriptOp::Sub}, {"GE", ScriptOp::Ge}, {"GT", ScriptOp::Gt},
+    {"LE", ScriptOp::Le}, {"LT", ScriptOp::Lt}, {"EQ", ScriptOp::Eq}, {"AND", ScriptOp::And},
+    {"OR", ScriptOp::Or}, {"NOT", ScriptOp::Not}, {"DUP", ScriptOp::Dup}, {"DROP", ScriptOp::Drop},
+    {"VERIFY", ScriptOp::Verify}, {"CHECKLOCKTIME", ScriptOp::CheckLockTime}, {"UNLOCKTIME", ScriptOp::UnlockTime},
+    {"CHECKMULTISIG", ScriptOp::CheckMultisig},
+};
+
+static uint64_t gasCost(ScriptOp op) {
+    switch (op) {
+        case ScriptOp::Balance: return 5;
+        case ScriptOp::CheckMultisig: return 10;
+        default: return 1;
+    }
+}
+
+static bool isKeyword(const std::string& token) {
+    for (char c : token) {
+        if (!std::isupper(static_cast<unsigned char>(c)) && c != '_') return false;
+    }
+    return true;
+}
+
+static bool parseNumber(const std::string& token, double& value) {
+    char* end = nullptr;
+    value = std::strtod(token.c_str(), &end);
+    // strtod also reads "nan" and "inf", which no comparison handles sanely.
+    return end && *end == '\0' && end != token.c_str() && std::isfinite(value);
+}
+
+CompiledScript ScriptEngine::compile(const std::string& source) {
+    CompiledScript script;
+    if (source.size() > MAX_SCRIPT_SIZE) {
+        script.error = "Script too large";
+        return script;
+    }
+    auto pushNumber = [&](double value) {
+        script.code.push_back({ScriptOp::PushNumber, static_cast<uint32_t>(script.numbers.size())});
+        script.numbers.push_back(value);
+    };
+    auto emit = [&](ScriptOp op) { script.code.push_back({op, 0}); };
+
+    std::istringstream tokens(source);
+    std::string token;
+    while (tokens >> token) {
+        double number;
+        // Legacy form: BALANCE_CHECK=<amount> requires the sender to hold at least amount.
+        if (token.compare(0, 14, "BALANCE_CHECK=") == 0) {
+            if (!parseNumber(token.substr(14), number)) {
+                script.error = "Invalid BALANCE_CHECK amount";
+                return script;
+            }
+            emit(ScriptOp::Sender);
+            emit(ScriptOp::Balance);
+            pushNumber(number);
+            emit(ScriptOp::Ge);
+            emit(ScriptOp::Verify);
+        } else if (parseNumber(token, number)) {
+            pushNumber(number);
+        } else if (OPCODES.count(token)) {
+            emit(OPCODES.at(token));
+        } else if (isKeyword(token)) {
+            script.error = "Unknown opcode " + token;
+            return script;
+        } else {
+            script.code.push_back({ScriptOp::PushBytes, static_cast<uint32_t>(script.constants.size())});
+            script.constants.push_back(token);
+        }
+    }
+    script.valid = true;
+    return script;
+}
+
+ScriptEngine& ScriptEngine::instance() {
+    static ScriptEngine engine;
+    return engine;
+}
+
+std::shared_ptr<const CompiledScript> ScriptEngine::prepare(const std::string& source) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256((const unsigned char*)source.data(), source.size(), digest);
+    std::string key(reinterpret_cast<const char*>(digest), sizeof(digest));
+    {
+        std::shared_lock<std::shared_mutex> lock(cacheMutex);
+        auto it = cache.find(key);
+        if (it != cache.end()) return it->second;
+    }
+    auto compiled = std::make_shared<const CompiledScript>(compile(source));
+    std::unique_lock<std::shared_mutex> lock(cacheMutex);
+    if (cache.size() >= SCRIPT_CACHE_ENTRIES) cache.erase(cache.begin());
+    return cache.emplace(key, compiled).first->second;
+}
+
+std::vector<std::shared_ptr<const CompiledScript>> ScriptEngine::prepareBatch(const std::vector<const std::string*>& sources) {
+    std::vector<std::shared_ptr<const CompiledScript>> programs(sources.size());
+    std::unordered_map<std::string, std::shared_ptr<const CompiledScript>> seen;
+    for (size_t i = 0; i < sources.size(); i++) {
+        if (!sources[i] || sources[i]->empty()) continue;
+        auto it = seen.find(*sources[i]);
+        if (it == seen.end()) it = seen.emplace(*sources[i], prepare(*sources[i])).first;
+        programs[i] = it->second;
+    }
+    return programs;
+}
+
+size_t ScriptEngine::cacheSize() const {
+    std::shared_lock<std::shared_mutex> lock(cacheMutex);
+    return cache.size();
+}
+
+static std::string hexToBytes(const std::string& hex) {
+    std::string out;
+    if (hex.size() % 2) return out;
+    out.reserve(hex.size() / 2);
+    for (size_t i = 0; i < hex.size(); i += 2) {
+        char byte[3] = {hex[i], hex[i + 1], 0};
+        char* end = nullptr;
+        long v = std::strtol(byte, &end, 16);
+        if (*end != '\0') return std::string();
+        out.push_back(static_cast<char>(v));
+    }
+    return out;
+}
+
+static bool verifySignature(const std::string& publicKeyHex, const std::string& signatureHex,
+                            const unsigned char* messageHash) {
+    std::string pub = hexToBytes(publicKeyHex);
+    std::string sig = hexToBytes(signatureHex);
+    if (pub.empty() || sig.empty()) return false;
+    EC_KEY* key = EC_KEY_new_by_curve_name(NID_secp256k1);
+    if (!key) return false;
+    const unsigned char* p = reinterpret_cast<const unsigned char*>(pub.data());
+    bool ok = o2i_ECPublicKey(&key, &p, static_cast<long>(pub.size())) &&
+              ECDSA_verify(0, messageHash, SHA256_DIGEST_LENGTH, reinterpret_cast<const unsigned char*>(sig.data()),
+                           static_cast<int>(sig.size()), key) == 1;
+    EC_KEY_free(key);
+    return ok;
+}
+
+ScriptResult ScriptEngine::run(const CompiledScript& script, const ScriptContext& context, const AccountView& accounts,
+                               uint64_t gasLimit) {
+    ScriptResult result{false, 0, ""};
+    if (!script.valid) {
+        result.error = script.error;
+        return result;
+    }
+    std::vector<ScriptValue> stack;
+    stack.reserve(16);
+    auto fail = [&](const std::string& error) {
+        result.error = error;
+        return result;
+    };
+    auto popNumber = [&](double& out) {
+        if (stack.empty() || !std::holds_alternative<double>(stack.back())) return false;
+        out = std::get<double>(stack.back());
+        stack.pop_back();
+        return true;
+    };
+    auto popBytes = [&](std::string& out) {
+        if (stack.empty() || !std::holds_alternative<std::string>(stack.back())) return false;
+        out = std::move(std::get<std::string>(stack.back()));
+        stack.pop_back();
+        return true;
+    };
+
+    for (const auto& ins : script.code) {
+        result.gasUsed += gasCost(ins.op);
+        if (result.gasUsed > gasLimit) return fail("Out of gas");
+        if (stack.size() >= MAX_SCRIPT_STACK) return fail("Stack overflow");
+        double a, b;
+        std::string bytes;
+        switch (ins.op) {
+            case ScriptOp::PushNumber: stack.emplace_back(script.numbers[ins.arg]); break;
+            case ScriptOp::PushBytes: stack.emplace_back(script.constants[ins.arg]); break;
+            case ScriptOp::Sender: stack.emplace_back(*context.sender); break;
+            case ScriptOp::Receiver: stack.emplace_back(*context.receiver); break;
+            case ScriptOp::Amount: stack.emplace_back(context.amount); break;
+            case ScriptOp::Fee: stack.emplace_back(context.fee); break;
+            case ScriptOp::Now: stack.emplace_back(static_cast<double>(context.now)); break;
+            case ScriptOp::Balance:
+                if (!popBytes(bytes)) return fail("BALANCE expects an address");
+                stack.emplace_back(accounts.balanceOf(bytes));
+                break;
+            case ScriptOp::Add: case ScriptOp::Sub: case ScriptOp::Ge: case ScriptOp::Gt: case ScriptOp::Le:
+            case ScriptOp::Lt: case ScriptOp::Eq: case ScriptOp::And: case ScriptOp::Or: {
+                if (!popNumber(b) || !popNumber(a)) return fail("Arithmetic expects two numbers");
+                double r = 0;
+                switch (ins.op) {
+                    case ScriptOp::Add: r = a + b; break;
+                    case ScriptOp::Sub: r = a - b; break;
+                    case ScriptOp::Ge: r = a >= b; break;
+                    case ScriptOp::Gt: r = a > b; break;
+                    case ScriptOp::Le: r = a <= b; break;
+                    case ScriptOp::Lt: r = a < b; break;
+                    case ScriptOp::Eq: r = a == b; break;
+                    case ScriptOp::And: r = a != 0 && b != 0; break;
+                    default: r = a != 0 || b != 0; break;
+                }
+                if (!std::isfinite(r)) return fail("Arithmetic overflow");
+                stack.emplace_back(r);
+                break;
+            }
+            case ScriptOp::Not:
+                if (!popNumber(a)) return fail("NOT expects a number");
+                stack.emplace_back(a == 0 ? 1.0 : 0.0);
+                break;
+            case ScriptOp::Dup:
+                if (stack.empty()) return fail("DUP on empty stack");
+                stack.push_back(stack.back());
+                break;
+            case ScriptOp::Drop:
+                if (stack.empty()) return fail("DROP on empty stack");
+                stack.pop_back();
+                break;
+            case ScriptOp::Verify:
+                if (!popNumber(a)) return fail("VERIFY expects a number");
+                if (a == 0) return fail("VERIFY failed");
+                break;
+            case ScriptOp::CheckLockTime:
+                if (!popNumber(a)) return fail("CHECKLOCKTIME expects a time");
+                if (static_cast<double>(context.now) < a) return fail("Time lock not expired");
+                break;
+            case ScriptOp::UnlockTime:
+                if (!popNumber(a) || a < 0 || a != std::floor(a)) return fail("UNLOCKTIME expects a block height");
+                if (!context.fragmentUnlocks || a >= static_cast<double>(context.fragmentUnlocks->size())) {
+                    return fail("UNLOCKTIME height not in this shard");
+                }
+                stack.emplace_back(static_cast<double>((*context.fragmentUnlocks)[static_cast<size_t>(a)]));
+                break;
+            case ScriptOp::CheckMultisig: {
+                // m <key 1> ... <key n> n CHECKMULTISIG
+                double n, m;
+                if (!popNumber(n) || n < 0 || n > 16 || n != std::floor(n)) return fail("Invalid key count");
+                std::vector<std::string> keys(static_cast<size_t>(n));
+                for (size_t i = keys.size(); i-- > 0;) {
+                    if (!popBytes(keys[i])) return fail("CHECKMULTISIG expects public keys");
+                }
+                if (!popNumber(m) || m < 0 || m > n || m != std::floor(m)) return fail("Invalid signature threshold");
+                int matched = 0;
+                std::vector<bool> used(context.witness ? context.witness->size() : 0, false);
+                for (const auto& key : keys) {
+                    if (matched >= m) break;
+                    for (size_t s = 0; s < used.size(); s++) {
+                        if (used[s]) continue;
+                        result.gasUsed += 50;
+                        if (result.gasUsed > gasLimit) return fail("Out of gas");
+                        if (verifySignature(key, (*context.witness)[s], context.messageHash)) {
+                            used[s] = true;
+                            matched++;
+                            break;
+                        }
+                    }
+                }
+                stack.emplace_back(matched >= m ? 1.0 : 0.0);
+                break;
+            }
+        }
+    }
+    if (!stack.empty()) {
+        const ScriptValue& top = stack.back();
+        if (std::holds_alternative<double>(top) && std::get<double>(top) == 0) return fail("Script returned false");
+    }
+    result.ok = true;
+    return result;
+}
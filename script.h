@@ -0,0 +1,87 @@
+#ifndef SCRIPT_H
+#define SCRIPT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <shared_mutex>
+#include <unordered_map>
+#include <cstdint>
+
+const uint64_t DEFAULT_SCRIPT_GAS = 10000;
+const size_t MAX_SCRIPT_SIZE = 4096;
+const size_t MAX_SCRIPT_STACK = 256;
+const size_t SCRIPT_CACHE_ENTRIES = 16384;
+
+enum class ScriptOp : uint8_t {
+    PushNumber, PushBytes,
+    Sender, Receiver, Amount, Fee, Now,
+    Balance,
+    Add, Sub, Ge, Gt, Le, Lt, Eq, And, Or, Not,
+    Dup, Drop, Verify,
+    CheckLockTime, UnlockTime, CheckMultisig
+};
+
+struct ScriptInstruction {
+    ScriptOp op;
+    uint32_t arg;
+};
+
+// Bytecode produced once per distinct script. Literals live in side tables
+// indexed by the instruction argument.
+struct CompiledScript {
+    bool valid = false;
+    std::string error;
+    std::vector<ScriptInstruction> code;
+    std::vector<double> numbers;
+    std::vector<std::string> constants;
+};
+
+// Read-only access to the balances of the shard executing the script.
+class AccountView {
+public:
+    virtual ~AccountView() {}
+    virtual double balanceOf(const std::string& address) const = 0;
+};
+
+struct ScriptContext {
+    const std::string* sender;
+    const std::string* receiver;
+    double amount;
+    double fee;
+    // Unix seconds of the block being executed, not of the executing node.
+    uint64_t now;
+    // SHA-256 of the signed transaction body; witness entries are hex DER
+    // ECDSA signatures over it.
+    const unsigned char* messageHash;
+    const std::vector<std::string>* witness;
+    // Unix seconds at which the memory fragment of each block of the
+    // executing shard unlocks, indexed by height.
+    const std::vector<uint64_t>* fragmentUnlocks = nullptr;
+};
+
+struct ScriptResult {
+    bool ok;
+    uint64_t gasUsed;
+    std::string error;
+};
+
+class ScriptEngine {
+private:
+    std::unordered_map<std::string, std::shared_ptr<const CompiledScript>> cache;
+    mutable std::shared_mutex cacheMutex;
+    ScriptEngine() = default;
+
+public:
+    static ScriptEngine& instance();
+    static CompiledScript compile(const std::string& source);
+    // Returns the cached bytecode for source, compiling it on first use.
+    std::shared_ptr<const CompiledScript> prepare(const std::string& source);
+    // Resolves a block's scripts in one pass; empty scripts map to nullptr.
+    std::vector<std::shared_ptr<const CompiledScript>> prepareBatch(const std::vector<const std::string*>& sources);
+    static ScriptResult run(const CompiledScript& script, const ScriptContext& context, const AccountView& accounts,
+                            uint64_t gasLimit = DEFAULT_SCRIPT_GAS);
+    size_t cacheSize() const;
+};
+
+#endif
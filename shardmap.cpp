@@ -0,0 +1,109 @@
+#include "shardmap.h"
+#include "codec.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <set>
+#include <stdexcept>
+
+ShardMap::ShardMap(int initialShards) : version(1) {
+    if (initialShards < 1) throw std::runtime_error("Shard map needs at least one shard");
+    uint64_t span = (uint64_t(1) << 32) / initialShards;
+    for (int i = 0; i < initialShards; i++) {
+        uint32_t start = static_cast<uint32_t>(span * i);
+        uint32_t end = i == initialShards - 1 ? UINT32_MAX : static_cast<uint32_t>(span * (i + 1) - 1);
+        ranges.push_back({start, end, std::to_string(i)});
+    }
+}
+
+uint32_t ShardMap::keyFor(const std::string& address) {
+    unsigned char hash[SHA256_DIGEST_LENGTH];
+    SHA256((unsigned char*)address.c_str(), address.length(), hash);
+    return (uint32_t(hash[0]) << 24) | (uint32_t(hash[1]) << 16) | (uint32_t(hash[2]) << 8) | uint32_t(hash[3]);
+}
+
+std::string ShardMap::lookup(const std::string& address) const {
+    return lookupKey(keyFor(address));
+}
+
+std::string ShardMap::lookupKey(uint32_t key) const {
+    auto it = std::upper_bound(ranges.begin(), ranges.end(), key,
+                               [](uint32_t k, const ShardRange& r) { return k < r.start; });
+    return std::prev(it)->shardId;
+}
+
+int ShardMap::indexOf(const std::string& shardId) const {
+    for (size_t i = 0; i < ranges.size(); i++) {
+        if (ranges[i].shardId == shardId) return static_cast<int>(i);
+    }
+    return -1;
+}
+
+bool ShardMap::split(const std::string& shardId, const std::string& newShardId) {
+    int i = indexOf(shardId);
+    if (i < 0 || newShardId.empty() || indexOf(newShardId) >= 0) return false;
+    ShardRange& range = ranges[i];
+    if (range.start == range.end) return false;
+    uint32_t mid = range.start + (range.end - range.start) / 2;
+    ShardRange upper{mid + 1, range.end, newShardId};
+    range.end = mid;
+    ranges.insert(ranges.begin() + i + 1, upper);
+    version++;
+    return true;
+}
+
+bool ShardMap::mergeNext(const std::string& shardId) {
+    int i = indexOf(shardId);
+    if (i < 0 || i + 1 >= static_cast<int>(ranges.size())) return false;
+    ranges[i].end = ranges[i + 1].end;
+    ranges.erase(ranges.begin() + i + 1);
+    version++;
+    return true;
+}
+
+std::string ShardMap::nextShard(const std::string& shardId) const {
+    int i = indexOf(shardId);
+    if (i < 0 || i + 1 >= static_cast<int>(ranges.size())) return "";
+    return ranges[i + 1].shardId;
+}
+
+std::string ShardMap::unusedShardId(int maxShards) const {
+    std::set<std::string> used;
+    for (const auto& range : ranges) used.insert(range.shardId);
+    for (int i = 0; i < maxShards; i++) {
+        if (!used.count(std::to_string(i))) return std::to_string(i);
+    }
+    return "";
+}
+
+std::string ShardMap::encode() const {
+    std::string record;
+    ByteWriter writer(record);
+    writer.putU64(version);
+    writer.putU32(static_cast<uint32_t>(ranges.size()));
+    for (const auto& range : ranges) {
+        writer.putU32(range.start);
+        writer.putU32(range.end);
+        writer.putBytes(range.shardId);
+    }
+    return record;
+}
+
+ShardMap ShardMap::decode(const std::string& record) {
+    ByteReader reader(record);
+    ShardMap map(1);
+    map.version = reader.getU64();
+    uint32_t count = reader.getU32();
+    if (count == 0 || count > reader.remaining()) throw std::runtime_error("Corrupt shard map");
+    map.ranges.clear();
+    for (uint32_t i = 0; i < count; i++) {
+        ShardRange range;
+        range.start = reader.getU32();
+        range.end = reader.getU32();
+        range.shardId = reader.getBytes();
+        bool contiguous = i == 0 ? range.start == 0 : range.start == map.ranges.back().end + 1;
+        if (!contiguous || range.end < range.start) throw std::runtime_error("Corrupt shard map");
+        map.ranges.push_back(range);
+    }
+    if (map.ranges.back().end != UINT32_MAX) throw std::runtime_error("Corrupt shard map");
+    return map;
+}
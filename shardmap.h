@@ -0,0 +1,45 @@
+#ifndef SHARDMAP_H
+#define SHARDMAP_H
+
+#include <string>
+#include <vector>
+#include <cstdint>
+
+const int INITIAL_SHARDS = 16;
+
+// Contiguous, inclusive range of 32-bit address-hash prefixes owned by a shard.
+struct ShardRange {
+    uint32_t start;
+    uint32_t end;
+    std::string shardId;
+};
+
+// Versioned assignment of address-hash prefixes to shards. The ranges always
+// cover the whole key space; every split or merge bumps the version, and the
+// version is recorded in each block so nodes can tell which map produced it.
+class ShardMap {
+private:
+    uint64_t version;
+    std::vector<ShardRange> ranges;
+
+    int indexOf(const std::string& shardId) const;
+
+public:
+    explicit ShardMap(int initialShards = INITIAL_SHARDS);
+    static uint32_t keyFor(const std::string& address);
+    std::string lookup(const std::string& address) const;
+    std::string lookupKey(uint32_t key) const;
+    // Moves the upper half of shardId's range to newShardId.
+    bool split(const std::string& shardId, const std::string& newShardId);
+    // Folds the range immediately after shardId into shardId.
+    bool mergeNext(const std::string& shardId);
+    std::string nextShard(const std::string& shardId) const;
+    std::string unusedShardId(int maxShards) const;
+    uint64_t getVersion() const { return version; }
+    const std::vector<ShardRange>& getRanges() const { return ranges; }
+    size_t shardCount() const { return ranges.size(); }
+    std::string encode() const;
+    static ShardMap decode(const std::string& record);
+};
+
+#endif
@@ -0,0 +1,214 @@
+#include "smt.h"
+#include <openssl/sha.h>
+#include <algorithm>
+#include <cstring>
+
+static const Hash256 EMPTY_HASH{};
+
+static int bitAt(const Hash256& key, int depth) {
+    return (key[depth / 8] >> (7 - depth % 8)) & 1;
+}
+
+Hash256 SparseMerkleTree::keyFor(const std::string& address) {
+    Hash256 key;
+    SHA256((const unsigned char*)address.data(), address.size(), key.data());
+    return key;
+}
+
+Hash256 SparseMerkleTree::leafHash(const Hash256& key, double value) {
+    unsigned char input[1 + 32 + 8];
+    input[0] = 0x00;
+    std::memcpy(input + 1, key.data(), key.size());
+    uint64_t bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    for (int i = 0; i < 8; i++) input[33 + i] = static_cast<unsigned char>((bits >> (8 * i)) & 0xff);
+    Hash256 out;
+    SHA256(input, sizeof(input), out.data());
+    return out;
+}
+
+Hash256 SparseMerkleTree::branchHash(const Hash256& left, const Hash256& right) {
+    unsigned char input[1 + 32 + 32];
+    input[0] = 0x01;
+    std::memcpy(input + 1, left.data(), left.size());
+    std::memcpy(input + 33, right.data(), right.size());
+    Hash256 out;
+    SHA256(input, sizeof(input), out.data());
+    return out;
+}
+
+void SparseMerkleTree::insert(std::unique_ptr<Node>& node, int depth, const Hash256& key, double value) {
+    if (!node) {
+        node.reset(new Node());
+        node->leaf = true;
+        node->key = key;
+        node->value = value;
+        leafCount++;
+        return;
+    }
+    if (node->leaf) {
+        if (node->key == key) {
+            node->value = value;
+            node->dirty = true;
+            return;
+        }
+        std::unique_ptr<Node> existing = std::move(node);
+        node.reset(new Node());
+        int side = bitAt(existing->key, depth);
+        node->child[side] = std::move(existing);
+    }
+    node->dirty = true;
+    insert(node->child[bitAt(key, depth)], depth + 1, key, value);
+}
+
+bool SparseMerkleTree::erase(std::unique_ptr<Node>& node, int depth, const Hash256& key) {
+    if (!node) return false;
+    if (node->leaf) {
+        if (node->key != key) return false;
+        node.reset();
+        leafCount--;
+        return true;
+    }
+    if (!erase(node->child[bitAt(key, depth)], depth + 1, key)) return false;
+    node->dirty = true;
+    Node* left = node->child[0].get();
+    Node* right = node->child[1].get();
+    if (!left && !right) {
+        node.reset();
+    } else if (!left && right->leaf) {
+        node = std::move(node->child[1]);
+    } else if (!right && left->leaf) {
+        node = std::move(node->child[0]);
+    }
+    return true;
+}
+
+void SparseMerkleTree::rehash(Node* node) {
+    if (!node || !node->dirty) return;
+    if (node->leaf) {
+        node->hash = leafHash(node->key, node->value);
+    } else {
+        rehash(node->child[0].get());
+        rehash(node->child[1].get());
+        node->hash = branchHash(node->child[0] ? node->child[0]->hash : EMPTY_HASH,
+                                node->child[1] ? node->child[1]->hash : EMPTY_HASH);
+    }
+    node->dirty = false;
+}
+
+void SparseMerkleTree::update(const Updates& updates) {
+    for (const auto& [address, value] : updates) {
+        Hash256 key = keyFor(address);
+        if (value == 0.0) {
+            erase(root, 0, key);
+        } else {
+            insert(root, 0, key, value);
+        }
+    }
+    rehash(root.get());
+}
+
+Hash256 SparseMerkleTree::rootHash() const {
+    return root ? root->hash : EMPTY_HASH;
+}
+
+SparseMerkleTree::Summary SparseMerkleTree::combine(const Summary& left, const Summary& right) {
+    if (left.leaves == 0 && right.leaves <= 1) return right;
+    if (right.leaves == 0 && left.leaves == 1) return left;
+    return {branchHash(left.hash, right.hash), 2};
+}
+
+SparseMerkleTree::Summary SparseMerkleTree::hashLeaves(const KeyedValue* first, const KeyedValue* last, int depth) {
+    if (first == last) return {EMPTY_HASH, 0};
+    if (last - first == 1) return {leafHash(first->first, first->second), 1};
+    auto mid = std::partition_point(first, last, [&](const KeyedValue& e) { return bitAt(e.first, depth) == 0; });
+    return combine(hashLeaves(first, mid, depth + 1), hashLeaves(mid, last, depth + 1));
+}
+
+SparseMerkleTree::Summary SparseMerkleTree::previewNode(const Node* node, int depth, const KeyedValue* first,
+                                                        const KeyedValue* last) const {
+    if (first == last) {
+        if (!node) return {EMPTY_HASH, 0};
+        return {node->hash, node->leaf ? 1 : 2};
+    }
+    if (!node || node->leaf) {
+        std::vector<KeyedValue> leaves;
+        leaves.reserve((last - first) + 1);
+        bool replaced = false;
+        for (auto it = first; it != last; ++it) {
+            if (node && it->first == node->key) replaced = true;
+            if (it->second != 0.0) leaves.push_back(*it);
+        }
+        if (node && !replaced) {
+            leaves.emplace_back(node->key, node->value);
+            std::sort(leaves.begin(), leaves.end());
+        }
+        return hashLeaves(leaves.data(), leaves.data() + leaves.size(), depth);
+    }
+    auto mid = std::partition_point(first, last, [&](const KeyedValue& e) { return bitAt(e.first, depth) == 0; });
+    Summary left = previewNode(node->child[0].get(), depth + 1, first, mid);
+    Summary right = previewNode(node->child[1].get(), depth + 1, mid, last);
+    return combine(left, right);
+}
+
+Hash256 SparseMerkleTree::previewRoot(const Updates& updates) const {
+    std::vector<KeyedValue> keyed;
+    keyed.reserve(updates.size());
+    for (const auto& [address, value] : updates) keyed.emplace_back(keyFor(address), value);
+    // Later updates to the same account win, matching update().
+    std::stable_sort(keyed.begin(), keyed.end(),
+                     [](const KeyedValue& a, const KeyedValue& b) { return a.first < b.first; });
+    std::vector<KeyedValue> unique;
+    unique.reserve(keyed.size());
+    for (const auto& entry : keyed) {
+        if (!unique.empty() && unique.back().first == entry.first) {
+            unique.back().second = entry.second;
+        } else {
+            unique.push_back(entry);
+        }
+    }
+    return previewNode(root.get(), 0, unique.data(), unique.data() + unique.size()).hash;
+}
+
+StateProof SparseMerkleTree::prove(const std::string& address) const {
+    StateProof proof;
+    Hash256 key = keyFor(address);
+    const Node* node = root.get();
+    int depth = 0;
+    while (node && !node->leaf) {
+        int side = bitAt(key, depth);
+        const Node* sibling = node->child[1 - side].get();
+        proof.siblings.push_back(sibling ? sibling->hash : EMPTY_HASH);
+        node = node->child[side].get();
+        depth++;
+    }
+    if (node) {
+        proof.hasLeaf = true;
+        proof.leafKey = node->key;
+        proof.leafValue = node->value;
+    }
+    return proof;
+}
+
+bool SparseMerkleTree::verify(const Hash256& root, const std::string& address, double balance, const StateProof& proof) {
+    Hash256 key = keyFor(address);
+    if (proof.siblings.size() > 256) return false;
+    Hash256 current = EMPTY_HASH;
+    if (proof.hasLeaf) {
+        if (proof.leafKey == key) {
+            if (proof.leafValue != balance) return false;
+        } else {
+            if (balance != 0.0) return false;
+            for (size_t i = 0; i < proof.siblings.size(); i++) {
+                if (bitAt(proof.leafKey, i) != bitAt(key, i)) return false;
+            }
+        }
+        current = leafHash(proof.leafKey, proof.leafValue);
+    } else if (balance != 0.0) {
+        return false;
+    }
+    for (size_t i = proof.siblings.size(); i-- > 0;) {
+        current = bitAt(key, i) ? branchHash(proof.siblings[i], current) : branchHash(current, proof.siblings[i]);
+    }
+    return current == root;
+}
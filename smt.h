@@ -0,0 +1,67 @@
+#ifndef SMT_H
+#define SMT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <array>
+#include <cstdint>
+
+typedef std::array<uint8_t, 32> Hash256;
+
+// Inclusion (or exclusion) proof for one account. siblings[i] is the hash
+// beside the path at depth i; the path ends at `leafKey` when hasLeaf is
+// set, otherwise at an empty subtree.
+struct StateProof {
+    std::vector<Hash256> siblings;
+    bool hasLeaf = false;
+    Hash256 leafKey{};
+    double leafValue = 0.0;
+};
+
+// Binary Merkle tree over SHA-256(address) with compact leaves: a subtree
+// holding a single account hashes to that account's leaf hash, so only
+// branching nodes are stored. Zero balances are absent. Node hashes are
+// cached and updates rehash only the paths they touch.
+class SparseMerkleTree {
+private:
+    struct Node {
+        bool leaf = false;
+        Hash256 key{};
+        double value = 0.0;
+        Hash256 hash{};
+        bool dirty = true;
+        std::unique_ptr<Node> child[2];
+    };
+    std::unique_ptr<Node> root;
+    size_t leafCount = 0;
+
+    // Hash of a subtree and whether it holds zero, one or several leaves.
+    struct Summary {
+        Hash256 hash;
+        int leaves;
+    };
+    typedef std::pair<Hash256, double> KeyedValue;
+    static Summary combine(const Summary& left, const Summary& right);
+    static Summary hashLeaves(const KeyedValue* first, const KeyedValue* last, int depth);
+    void insert(std::unique_ptr<Node>& node, int depth, const Hash256& key, double value);
+    bool erase(std::unique_ptr<Node>& node, int depth, const Hash256& key);
+    void rehash(Node* node);
+    Summary previewNode(const Node* node, int depth, const KeyedValue* first, const KeyedValue* last) const;
+
+public:
+    typedef std::vector<std::pair<std::string, double>> Updates;
+    static Hash256 keyFor(const std::string& address);
+    static Hash256 leafHash(const Hash256& key, double value);
+    static Hash256 branchHash(const Hash256& left, const Hash256& right);
+
+    void update(const Updates& updates);
+    // Root the tree would have after update(updates), without modifying it.
+    Hash256 previewRoot(const Updates& updates) const;
+    Hash256 rootHash() const;
+    size_t size() const { return leafCount; }
+    StateProof prove(const std::string& address) const;
+    static bool verify(const Hash256& root, const std::string& address, double balance, const StateProof& proof);
+};
+
+#endif
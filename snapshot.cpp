@@ -0,0 +1,179 @@
+#include "snapshot.h"
+#include <limits>
+#include <algorithm>
+#include <unordered_set>
+
+double ShardSnapshot::balanceOf(const std::string& address) const {
+    for (auto layer = layers.rbegin(); layer != layers.rend(); ++layer) {
+        auto it = (*layer)->find(address);
+        if (it != (*layer)->end()) return it->second;
+    }
+    auto baseIt = base->find(address);
+    return baseIt != base->end() ? baseIt->second : 0.0;
+}
+
+size_t ShardSnapshot::accountCount() const {
+    std::unordered_set<std::string> added;
+    for (const auto& layer : layers) {
+        for (const auto& [addr, bal] : *layer) {
+            if (!base->count(addr)) added.insert(addr);
+        }
+    }
+    return base->size() + added.size();
+}
+
+struct ThreadSlot {
+    int slot = -1;
+    int depth = 0;
+    ~ThreadSlot() {
+        if (slot >= 0) EpochManager::instance().releaseSlot(slot);
+    }
+};
+
+static thread_local ThreadSlot threadSlot;
+
+EpochManager& EpochManager::instance() {
+    static EpochManager manager;
+    return manager;
+}
+
+EpochManager::~EpochManager() {
+    for (const auto& entry : retired) delete entry.second;
+}
+
+int EpochManager::acquireSlot() {
+    for (int i = 0; i < MAX_READERS; i++) {
+        bool expected = false;
+        if (!slots[i].used.load(std::memory_order_relaxed) &&
+            slots[i].used.compare_exchange_strong(expected, true)) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+void EpochManager::releaseSlot(int slot) {
+    slots[slot].epoch.store(0);
+    slots[slot].used.store(false);
+}
+
+uint64_t EpochManager::minActiveEpoch() const {
+    if (overflowReaders.load() > 0) return 0;
+    uint64_t minEpoch = std::numeric_limits<uint64_t>::max();
+    for (int i = 0; i < MAX_READERS; i++) {
+        uint64_t epoch = slots[i].epoch.load();
+        if (epoch != 0 && epoch < minEpoch) minEpoch = epoch;
+    }
+    return minEpoch;
+}
+
+void EpochManager::retire(const ShardSnapshot* snapshot) {
+    {
+        std::lock_guard<std::mutex> lock(retireMutex);
+        retired.emplace_back(globalEpoch.fetch_add(1), snapshot);
+    }
+    reclaim();
+}
+
+void EpochManager::reclaim() {
+    std::lock_guard<std::mutex> lock(retireMutex);
+    uint64_t minEpoch = minActiveEpoch();
+    auto keep = std::partition(retired.begin(), retired.end(),
+                               [&](const std::pair<uint64_t, const ShardSnapshot*>& r) { return r.first >= minEpoch; });
+    for (auto it = keep; it != retired.end(); ++it) delete it->second;
+    retired.erase(keep, retired.end());
+}
+
+EpochGuard::EpochGuard() {
+    if (threadSlot.depth++ > 0) return;
+    EpochManager& manager = EpochManager::instance();
+    // A thread without a slot tries again on its next outermost guard.
+    if (threadSlot.slot < 0) threadSlot.slot = manager.acquireSlot();
+    if (threadSlot.slot >= 0) {
+        manager.slots[threadSlot.slot].epoch.store(manager.globalEpoch.load());
+    } else {
+        manager.overflowReaders++;
+    }
+}
+
+EpochGuard::~EpochGuard() {
+    if (--threadSlot.depth > 0) return;
+    EpochManager& manager = EpochManager::instance();
+    if (threadSlot.slot >= 0) {
+        manager.slots[threadSlot.slot].epoch.store(0);
+    } else {
+        manager.overflowReaders--;
+    }
+}
+
+SnapshotRegistry::SnapshotRegistry(int cap)
+    : capacity(cap), current(new std::atomic<const ShardSnapshot*>[cap]) {
+    for (int i = 0; i < capacity; i++) current[i].store(nullptr);
+}
+
+SnapshotRegistry::~SnapshotRegistry() {
+    for (int i = 0; i < capacity; i++) delete current[i].load();
+}
+
+int SnapshotRegistry::slotFor(const std::string& shardId) const {
+    if (shardId.empty() || shardId.size() > 9) return -1;
+    int slot = 0;
+    for (char c : shardId) {
+        if (c < '0' || c > '9') return -1;
+        slot = slot * 10 + (c - '0');
+    }
+    return slot < capacity ? slot : -1;
+}
+
+void SnapshotRegistry::publish(const std::string& shardId, const std::vector<std::pair<std::string, double>>& touched,
+                               uint64_t blockCount, int difficulty, const std::string& tipHash,
+                               const std::string& stateRoot) {
+    int slot = slotFor(shardId);
+    if (slot < 0) return;
+    const ShardSnapshot* prev = current[slot].load(std::memory_order_acquire);
+
+    ShardSnapshot* next = new ShardSnapshot();
+    if (prev) {
+        next->base = prev->base;
+        next->layers = prev->layers;
+        next->totalBalance = prev->totalBalance;
+    } else {
+        next->base = std::make_shared<const BalanceMap>();
+    }
+    auto layer = std::make_shared<BalanceMap>();
+    layer->reserve(touched.size());
+    for (const auto& [addr, bal] : touched) {
+        next->totalBalance += bal - (prev ? prev->balanceOf(addr) : 0.0);
+        (*layer)[addr] = bal;
+    }
+    auto& layers = next->layers;
+    if (!layer->empty()) layers.push_back(std::move(layer));
+    // A layer at least half the size of the one below it is merged into it.
+    while (layers.size() >= 2 && 2 * layers.back()->size() >= layers[layers.size() - 2]->size()) {
+        auto merged = std::make_shared<BalanceMap>(*layers[layers.size() - 2]);
+        for (const auto& [addr, bal] : *layers.back()) (*merged)[addr] = bal;
+        layers.pop_back();
+        layers.back() = std::move(merged);
+    }
+    if (!layers.empty() && layers.front()->size() > std::max<size_t>(1024, next->base->size() / 8)) {
+        auto merged = std::make_shared<BalanceMap>(*next->base);
+        for (const auto& delta : layers) {
+            for (const auto& [addr, bal] : *delta) (*merged)[addr] = bal;
+        }
+        next->base = merged;
+        layers.clear();
+    }
+    next->blockCount = blockCount;
+    next->difficulty = difficulty;
+    next->tipHash = tipHash;
+    next->stateRoot = stateRoot;
+
+    current[slot].store(next, std::memory_order_release);
+    if (prev) EpochManager::instance().retire(prev);
+}
+
+const ShardSnapshot* SnapshotRegistry::acquire(const std::string& shardId) const {
+    int slot = slotFor(shardId);
+    if (slot < 0) return nullptr;
+    return current[slot].load(std::memory_order_acquire);
+}
@@ -0,0 +1,89 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <unordered_map>
+
+typedef std::unordered_map<std::string, double> BalanceMap;
+
+// Immutable view of one shard, published after every committed block.
+// Balances are a shared base map plus a stack of delta layers, oldest first,
+// that snapshots share instead of copying. Publishing adds one layer of the
+// touched accounts and merges layers like a binary counter, so an entry is
+// copied O(log n) times before the stack is folded into a new base.
+struct ShardSnapshot {
+    std::shared_ptr<const BalanceMap> base;
+    std::vector<std::shared_ptr<const BalanceMap>> layers;
+    uint64_t blockCount = 0;
+    double totalBalance = 0.0;
+    int difficulty = 0;
+    std::string tipHash;
+    std::string stateRoot;
+
+    double balanceOf(const std::string& address) const;
+    size_t accountCount() const;
+};
+
+// Epoch-based reclamation for snapshots. Readers announce the epoch they
+// entered in a per-thread slot; retired snapshots are freed once every
+// active reader has moved past the epoch they were retired in. Readers that
+// find every slot taken are counted instead, and nothing is freed while any
+// of them is inside a guard.
+class EpochManager {
+private:
+    static const int MAX_READERS = 256;
+    struct alignas(64) ReaderSlot {
+        std::atomic<uint64_t> epoch{0};
+        std::atomic<bool> used{false};
+    };
+    ReaderSlot slots[MAX_READERS];
+    std::atomic<uint64_t> globalEpoch{1};
+    std::atomic<int> overflowReaders{0};
+    std::mutex retireMutex;
+    std::vector<std::pair<uint64_t, const ShardSnapshot*>> retired;
+
+    EpochManager() = default;
+    ~EpochManager();
+    // Returns -1 when every slot is in use.
+    int acquireSlot();
+    void releaseSlot(int slot);
+    uint64_t minActiveEpoch() const;
+    friend class EpochGuard;
+    friend struct ThreadSlot;
+
+public:
+    static EpochManager& instance();
+    void retire(const ShardSnapshot* snapshot);
+    void reclaim();
+};
+
+class EpochGuard {
+public:
+    EpochGuard();
+    ~EpochGuard();
+    EpochGuard(const EpochGuard&) = delete;
+    EpochGuard& operator=(const EpochGuard&) = delete;
+};
+
+class SnapshotRegistry {
+private:
+    int capacity;
+    std::unique_ptr<std::atomic<const ShardSnapshot*>[]> current;
+    int slotFor(const std::string& shardId) const;
+
+public:
+    explicit SnapshotRegistry(int capacity);
+    ~SnapshotRegistry();
+    // Writers must be serialized by the caller (the chain holds chainMutex).
+    void publish(const std::string& shardId, const std::vector<std::pair<std::string, double>>& touched,
+                 uint64_t blockCount, int difficulty, const std::string& tipHash,
+                 const std::string& stateRoot = "");
+    // Caller must hold an EpochGuard for as long as the returned pointer is used.
+    const ShardSnapshot* acquire(const std::string& shardId) const;
+};
+
+#endif
@@ -1,5 +1,18 @@
 #include "blockchain.h"
+#include "histogram.h"
+#include "metrics.h"
+#include "trace.h"
+#include "executor.h"
+#include "ingest.h"
+#include "reindex.h"
+#include <openssl/ec.h>
+#include <openssl/ecdsa.h>
+#include <openssl/obj_mac.h>
+#include <algorithm>
+#include <atomic>
 #include <cassert>
+#include <chrono>
+#include <thread>
 #include <iostream>
 
 void testTransactionValidation() {
@@ -21,7 +34,7 @@ void testMemoryFragment() {
 void testShardManager() {
     ShardManager sm;
     Transaction tx("sender", "receiver", 10.0);
-    std::string shardId = sm.assignShard(tx, MAX_SHARDS);
+    std::string shardId = sm.assignShard(tx);
     assert(!shardId.empty());
     sm.updateLoad(shardId, 1);
     std::cout << "Shard manager test passed\n";
@@ -33,6 +46,810 @@ void testChainBalance() {
     std::cout << "Chain balance test passed\n";
 }
 
+void testShardSnapshot() {
+    SnapshotRegistry registry(MAX_SHARDS);
+    registry.publish("3", {{"alice", 10.0}, {"bob", 5.0}}, 1, INITIAL_DIFFICULTY, "h1");
+    registry.publish("3", {{"alice", 4.0}, {"carol", 6.0}}, 2, INITIAL_DIFFICULTY, "h2");
+    EpochGuard guard;
+    const ShardSnapshot* snapshot = registry.acquire("3");
+    assert(snapshot != nullptr);
+    assert(snapshot->balanceOf("alice") == 4.0);
+    assert(snapshot->balanceOf("bob") == 5.0);
+    assert(snapshot->totalBalance == 15.0);
+    assert(snapshot->blockCount == 2);
+    assert(registry.acquire("7") == nullptr);
+    assert(registry.acquire("x") == nullptr);
+
+    // Many small publishes keep a short layer stack and fold into the base.
+    for (int i = 0; i < 5000; i++) {
+        registry.publish("4", {{"acct" + std::to_string(i), 1.0}, {"alice", double(i)}}, i + 1, INITIAL_DIFFICULTY, "h");
+        assert(registry.acquire("4")->layers.size() <= 16);
+    }
+    snapshot = registry.acquire("4");
+    assert(snapshot->balanceOf("acct1234") == 1.0);
+    assert(snapshot->balanceOf("alice") == 4999.0);
+    assert(snapshot->accountCount() == 5001);
+    assert(snapshot->base->size() > 0);
+
+    // Readers beyond the slot table still get in and hold reclamation back.
+    std::atomic<int> inside{0};
+    std::atomic<bool> release{false};
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 300; i++) {
+        readers.emplace_back([&]() {
+            EpochGuard readerGuard;
+            assert(registry.acquire("3") != nullptr);
+            inside++;
+            while (!release) std::this_thread::yield();
+        });
+    }
+    while (inside < 300) std::this_thread::yield();
+    release = true;
+    for (auto& t : readers) t.join();
+    std::cout << "Shard snapshot test passed\n";
+}
+
+void testHdrHistogram() {
+    HdrHistogram h(1000000, 3);
+    for (uint64_t v = 1; v <= 10000; v++) h.record(v);
+    assert(h.totalCount() == 10000);
+    uint64_t p50 = h.valueAtPercentile(50.0);
+    uint64_t p99 = h.valueAtPercentile(99.0);
+    assert(p50 >= 4995 && p50 <= 5005);
+    assert(p99 >= 9890 && p99 <= 9910);
+    assert(h.valueAtPercentile(100.0) == 10000);
+    assert(h.min() == 1);
+    std::cout << "HDR histogram test passed\n";
+}
+
+void testMetricsExposition() {
+    MetricsRegistry& registry = MetricsRegistry::instance();
+    MetricCounter& counter = registry.counter("test_events_total", "Test events", {{"shard", "1"}});
+    counter.inc();
+    counter.inc(2);
+    assert(counter.value() == 3);
+    assert(&registry.counter("test_events_total", "Test events", {{"shard", "1"}}) == &counter);
+    MetricHistogram& latency = registry.histogram("test_latency_seconds", "Test latency", {}, {0.1, 1.0});
+    latency.observe(0.05);
+    latency.observe(0.5);
+    latency.observe(5.0);
+    std::string text = registry.exposition();
+    assert(text.find("test_events_total{shard=\"1\"} 3") != std::string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"0.1\"} 1") != std::string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"1\"} 2") != std::string::npos);
+    assert(text.find("test_latency_seconds_bucket{le=\"+Inf\"} 3") != std::string::npos);
+    std::cout << "Metrics exposition test passed\n";
+}
+
+void testTraceSpans() {
+    Tracer& tracer = Tracer::instance();
+    tracer.setSampleRate(1);
+    {
+        TraceContext trace(tracer.shouldSample(), "5", 42);
+        TraceSpan span("testSpan");
+    }
+    {
+        TraceContext trace(false, "5", 43);
+        TraceSpan span("unsampledSpan");
+    }
+    // Short-lived threads reuse the buffers of threads that have exited.
+    for (int i = 0; i < 100; i++) {
+        std::thread([]() {
+            TraceContext trace(true, "5", 44);
+            TraceSpan span("threadSpan");
+        }).join();
+    }
+    assert(tracer.bufferCount() <= 2);
+    tracer.setSampleRate(0);
+    std::string json = tracer.dumpChromeJson();
+    assert(json.find("\"name\":\"threadSpan\"") != std::string::npos);
+    assert(json.find("\"name\":\"testSpan\"") != std::string::npos);
+    assert(json.find("\"shard\":\"5\",\"height\":42") != std::string::npos);
+    assert(json.find("unsampledSpan") == std::string::npos);
+    std::cout << "Trace span test passed\n";
+}
+
+void testBlockRecordAndCache() {
+    std::vector<Transaction> txs = {Transaction("sender", "receiver", 10.0)};
+    txs[0].script = "BALANCE_CHECK=5";
+    MemoryFragment mem("text", "memories/codec.txt", "Codec test", "owner", 60);
+    auto block = std::make_shared<const AhmiyatBlock>(1, txs, mem, std::string(64, 'a'), 1, 0.0, "2");
+    std::string record = block->encode();
+    AhmiyatBlock decoded = AhmiyatBlock::decode(record);
+    assert(decoded.getHash() == block->getHash());
+    assert(decoded.getPreviousHash() == block->getPreviousHash());
+    assert(decoded.getTransactions().size() == 1);
+    assert(decoded.getTransactions()[0].script == "BALANCE_CHECK=5");
+    assert(decoded.getTransactions()[0].timestamp == txs[0].timestamp);
+    assert(decoded.getMemory().lockTime == 60);
+    assert(decoded.validate());
+    assert(hashToHex(block->header().hash) == block->getHash());
+    assert(hexToHash("0") == Hash256{});
+    ShardMap nextMap;
+    nextMap.split("0", "16");
+    AhmiyatBlock reshaped(1, txs, mem, std::string(64, 'a'), 1, 0.0, "0", 1, {}, {}, "", nextMap.encode());
+    AhmiyatBlock reshapedDecoded = AhmiyatBlock::decode(reshaped.encode());
+    assert(reshapedDecoded.getShardMapChange() == nextMap.encode());
+    assert(reshapedDecoded.getHash() == reshaped.getHash());
+
+    CompactBlock compact(*block);
+    assert(compact.encode() == record);
+    assert(compact.calculateHash() == block->getHash());
+    assert(compact.expand().encode() == record);
+    std::vector<Transaction> witnessed = txs;
+    witnessed[0].signature = "3045022100ab";
+    witnessed[0].witness = {"first", std::string("\0bin", 4)};
+    AhmiyatBlock witnessedBlock(2, witnessed, mem, block->getHash(), 1, 0.0, "2");
+    CompactBlock compactWitnessed(witnessedBlock);
+    assert(compactWitnessed.encode() == witnessedBlock.encode());
+    assert(compactWitnessed.calculateHash() == witnessedBlock.getHash());
+
+    BlockCache cache(2 * compact.bytes());
+    cache.put("a", *block);
+    cache.put("b", *block);
+    assert(cache.get("a") != nullptr);
+    cache.put("c", *block);
+    assert(cache.get("b") == nullptr && cache.getRecord("b").empty());
+    assert(cache.get("a") != nullptr && cache.get("c")->getHash() == block->getHash());
+    assert(cache.getRecord("a") == record);
+    assert(cache.bytes() <= 2 * compact.bytes());
+    std::cout << "Block record and cache test passed\n";
+}
+
+void testCrossShardReceipts() {
+    ReceiptRouter router;
+    CrossShardReceipt receipt;
+    receipt.id = "r1";
+    receipt.fromShard = "0";
+    receipt.toShard = "3";
+    receipt.receiver = "bob";
+    receipt.amount = 5.0;
+    router.deliver("3", {receipt, receipt});
+    std::vector<CrossShardReceipt> inbound = router.peek("3", MAX_RECEIPTS_PER_BLOCK);
+    assert(inbound.size() == 1 && inbound[0].amount == 5.0);
+    assert(router.markApplied("3", inbound) == std::vector<bool>{true});
+    assert(router.markApplied("3", inbound) == std::vector<bool>{false});
+    router.deliver("3", {receipt});
+    assert(router.pendingCount("3") == 0 && router.shardsWithPending().empty());
+    assert(router.appliedCount("3") == 0);
+
+    // Applied ids are kept while receipts from the same source height are
+    // still pending, and pruned once the watermark passes that height.
+    CrossShardReceipt second = receipt, third = receipt;
+    second.id = "r2";
+    second.sourceHeight = 1;
+    third.id = "r3";
+    third.sourceHeight = 1;
+    router.deliver("3", {second, third});
+    assert(router.markApplied("3", {second}) == std::vector<bool>{true});
+    assert(router.appliedCount("3") == 1);
+    assert(router.markApplied("3", {second}) == std::vector<bool>{false});
+    assert(router.markApplied("3", {third}) == std::vector<bool>{true});
+    assert(router.appliedCount("3") == 0);
+    assert((router.markApplied("3", {second, third}) == std::vector<bool>{false, false}));
+
+    // A receipt rerouted in below the new inbox's watermark is still credited once.
+    CrossShardReceipt moved = receipt;
+    moved.id = "r4";
+    moved.toShard = "5";
+    router.deliver("5", {moved});
+    router.deliver("4", {second});
+    router.markApplied("4", {second});
+    router.reroute("5", [](const CrossShardReceipt&) { return std::string("4"); });
+    assert(router.pendingCount("4") == 1);
+    assert(router.markApplied("4", {moved}) == std::vector<bool>{true});
+    assert(router.markApplied("4", {moved}) == std::vector<bool>{false});
+
+    std::vector<Transaction> txs = {Transaction("sender", "receiver", 10.0)};
+    MemoryFragment mem("text", "memories/receipts.txt", "Receipt test", "owner", 0);
+    AhmiyatBlock block(1, txs, mem, std::string(64, 'a'), 1, 0.0, "0", 1, {receipt}, {});
+    AhmiyatBlock decoded = AhmiyatBlock::decode(block.encode());
+    assert(decoded.getOutgoingReceipts().size() == 1 && decoded.getOutgoingReceipts()[0].receiver == "bob");
+    assert(decoded.getOutgoingReceipts()[0].sourceHeight == receipt.sourceHeight);
+    assert(decoded.getIncomingReceipts().empty());
+    assert(decoded.validate());
+    std::cout << "Cross-shard receipt test passed\n";
+}
+
+void testShardMap() {
+    ShardMap map;
+    assert(map.shardCount() == INITIAL_SHARDS && map.getVersion() == 1);
+    std::string shardId = map.lookup("alice");
+    uint32_t key = ShardMap::keyFor("alice");
+    std::string child = map.unusedShardId(MAX_SHARDS);
+    assert(child == std::to_string(INITIAL_SHARDS));
+    assert(map.split(shardId, child));
+    assert(map.getVersion() == 2 && map.shardCount() == INITIAL_SHARDS + 1);
+    assert(map.lookupKey(key) == shardId || map.lookupKey(key) == child);
+    assert(map.nextShard(shardId) == child);
+    assert(map.mergeNext(shardId) && map.lookup("alice") == shardId);
+    assert(!map.split(shardId, "0"));
+
+    ShardMap decoded = ShardMap::decode(map.encode());
+    assert(decoded.getVersion() == 3 && decoded.shardCount() == INITIAL_SHARDS);
+    for (const auto& addr : {"alice", "bob", "carol"}) assert(decoded.lookup(addr) == map.lookup(addr));
+    std::cout << "Shard map test passed\n";
+}
+
+struct FixedAccounts : AccountView {
+    std::unordered_map<std::string, double> balances;
+    double balanceOf(const std::string& address) const override {
+        auto it = balances.find(address);
+        return it != balances.end() ? it->second : 0.0;
+    }
+};
+
+static std::string toHex(const unsigned char* data, size_t len) {
+    static const char digits[] = "0123456789abcdef";
+    std::string hex;
+    for (size_t i = 0; i < len; i++) {
+        hex.push_back(digits[data[i] >> 4]);
+        hex.push_back(digits[data[i] & 0x0f]);
+    }
+    return hex;
+}
+
+void testScriptEngine() {
+    FixedAccounts accounts;
+    accounts.balances["alice"] = 20.0;
+    Transaction tx("alice", "bob", 5.0);
+    tx.script = "BALANCE_CHECK=10";
+    assert(tx.executeScript(accounts, 0));
+    tx.script = "BALANCE_CHECK=50";
+    assert(!tx.executeScript(accounts, 0));
+    tx.script = "SENDER BALANCE AMOUNT FEE ADD GE";
+    assert(tx.executeScript(accounts, 0));
+    tx.script = "1700000000 CHECKLOCKTIME";
+    assert(!tx.executeScript(accounts, 1699999999) && tx.executeScript(accounts, 1700000000));
+    assert(!ScriptEngine::compile("BOGUS_OP").valid);
+
+    auto first = ScriptEngine::instance().prepare("SENDER BALANCE 1 GE");
+    assert(first == ScriptEngine::instance().prepare("SENDER BALANCE 1 GE"));
+    unsigned char digest[32] = {0};
+    ScriptContext context{&tx.sender, &tx.receiver, tx.amount, tx.fee, 0, digest, &tx.witness};
+    assert(!ScriptEngine::run(*first, context, accounts, 3).ok);
+    assert(ScriptEngine::run(*first, context, accounts).gasUsed == 8);
+    tx.script = "nan CHECKLOCKTIME";
+    assert(!tx.executeScript(accounts, 2000000000));
+    tx.script = "1e308 1e308 ADD CHECKLOCKTIME";
+    assert(!tx.executeScript(accounts, 2000000000));
+    std::vector<uint64_t> unlocks = {100, 200};
+    context.fragmentUnlocks = &unlocks;
+    auto unlockAt = ScriptEngine::instance().prepare("1 UNLOCKTIME CHECKLOCKTIME");
+    context.now = 199;
+    assert(!ScriptEngine::run(*unlockAt, context, accounts).ok);
+    context.now = 200;
+    assert(ScriptEngine::run(*unlockAt, context, accounts).ok);
+    assert(!ScriptEngine::run(*ScriptEngine::instance().prepare("2 UNLOCKTIME"), context, accounts).ok);
+    assert(!ScriptEngine::run(*ScriptEngine::instance().prepare("0.5 UNLOCKTIME"), context, accounts).ok);
+
+    std::vector<EC_KEY*> keys;
+    std::string script = "2";
+    for (int i = 0; i < 3; i++) {
+        EC_KEY* key = EC_KEY_new_by_curve_name(NID_secp256k1);
+        assert(EC_KEY_generate_key(key));
+        unsigned char* pub = nullptr;
+        int len = i2o_ECPublicKey(key, &pub);
+        script += " " + toHex(pub, len);
+        OPENSSL_free(pub);
+        keys.push_back(key);
+    }
+    tx.script = script + " 3 CHECKMULTISIG";
+    tx.messageHash(digest);
+    auto sign = [&](EC_KEY* key) {
+        unsigned char sig[256];
+        unsigned int sigLen = 0;
+        assert(ECDSA_sign(0, digest, 32, sig, &sigLen, key));
+        return toHex(sig, sigLen);
+    };
+    tx.witness = {sign(keys[2])};
+    assert(!tx.executeScript(accounts, 0));
+    tx.witness.push_back(sign(keys[0]));
+    assert(tx.executeScript(accounts, 0));
+    // A fractional threshold is rejected even when enough keys signed.
+    tx.script = "1.5" + script.substr(1) + " 3 CHECKMULTISIG";
+    tx.messageHash(digest);
+    tx.witness = {sign(keys[2]), sign(keys[0])};
+    assert(!tx.executeScript(accounts, 0));
+    for (EC_KEY* key : keys) EC_KEY_free(key);
+    std::cout << "Script engine test passed\n";
+}
+
+void testSparseMerkleTree() {
+    SparseMerkleTree tree;
+    assert(tree.rootHash() == Hash256{});
+    SparseMerkleTree::Updates updates;
+    for (int i = 0; i < 200; i++) updates.emplace_back("acct" + std::to_string(i), i + 1.0);
+    Hash256 preview = tree.previewRoot(updates);
+    tree.update(updates);
+    assert(tree.rootHash() == preview && tree.size() == 200);
+
+    SparseMerkleTree::Updates changes = {{"acct3", 0.0}, {"acct7", 70.0}, {"fresh", 5.0}, {"acct9", 0.0}, {"fresh", 6.0}};
+    preview = tree.previewRoot(changes);
+    tree.update(changes);
+    assert(tree.rootHash() == preview && tree.size() == 199);
+
+    SparseMerkleTree rebuilt;
+    SparseMerkleTree::Updates state = {{"fresh", 6.0}};
+    for (int i = 199; i >= 0; i--) {
+        if (i == 3 || i == 9) continue;
+        state.emplace_back("acct" + std::to_string(i), i == 7 ? 70.0 : i + 1.0);
+    }
+    rebuilt.update(state);
+    assert(rebuilt.rootHash() == tree.rootHash());
+
+    StateProof proof = tree.prove("acct7");
+    assert(SparseMerkleTree::verify(tree.rootHash(), "acct7", 70.0, proof));
+    assert(!SparseMerkleTree::verify(tree.rootHash(), "acct7", 8.0, proof));
+    StateProof absent = tree.prove("acct3");
+    assert(SparseMerkleTree::verify(tree.rootHash(), "acct3", 0.0, absent));
+    assert(!SparseMerkleTree::verify(tree.rootHash(), "acct3", 4.0, absent));
+    std::cout << "Sparse Merkle tree test passed\n";
+}
+
+void testHistoryIndex() {
+    leveldb::DB* db;
+    leveldb::Options options;
+    options.create_if_missing = true;
+    assert(leveldb::DB::Open(options, "history_test_db", &db).ok());
+    ShardMap map;
+    std::string shardId = map.lookup("alice");
+    std::vector<Transaction> txs;
+    for (int i = 0; i < 5; i++) txs.emplace_back("alice", "bob" + std::to_string(i), 1.0 + i);
+    std::string remote = "bob_remote";
+    for (int i = 0; map.lookup(remote) == shardId; i++) remote = "bob_remote" + std::to_string(i);
+    txs.emplace_back("alice", remote, 1.0);
+    CrossShardReceipt credited{"r_credited", "9", shardId, "carol", 2.0, 1};
+    CrossShardReceipt settled{"r_settled", "9", shardId, "carol", 3.0, 1};
+    MemoryFragment mem("text", "memories/history.txt", "History test", "owner", 0);
+    leveldb::WriteBatch batch;
+    for (int height = 1; height <= 3; height++) {
+        AhmiyatBlock block(height, txs, mem, std::string(64, 'a'), 1, 0.0, shardId, 1, {}, {credited, settled});
+        // The first transfer of the last block was rejected and must not show up.
+        std::vector<bool> applied(txs.size(), true);
+        if (height == 3) applied.front() = false;
+        HistoryIndex::indexBlock(batch, block, applied, {true, false}, map);
+    }
+    assert(db->Write(leveldb::WriteOptions(), &batch).ok());
+
+    HistoryIndex index(db);
+    std::string cursor;
+    size_t seen = 0;
+    uint64_t lastHeight = 0;
+    do {
+        HistoryPage page = index.query("alice", cursor, 4);
+        assert(page.entries.size() <= 4);
+        for (const auto& entry : page.entries) {
+            assert(entry.kind == HistoryKind::Sent && entry.shardId == shardId && entry.height >= lastHeight);
+            lastHeight = entry.height;
+            seen++;
+        }
+        cursor = page.nextCursor;
+    } while (!cursor.empty());
+    assert(seen == 17);
+    auto rows = [&](const std::string& address) { return index.query(address, "", 0).entries; };
+    assert(rows("bob0").size() == (map.lookup("bob0") == shardId ? 2u : 0u));
+    // The receiver's own shard indexes a cross-shard transfer when it credits the receipt.
+    assert(rows(remote).empty());
+    std::vector<HistoryEntry> carol = rows("carol");
+    assert(carol.size() == 3 && carol[0].kind == HistoryKind::ReceiptCredited && carol[0].amount == 2.0);
+    assert(rows("bob").empty());
+    delete db;
+    std::cout << "History index test passed\n";
+}
+
+void testBlockIndex() {
+    BlockIndex index;
+    std::vector<Transaction> txs = {Transaction("sender", "receiver", 1.0)};
+    MemoryFragment mem("text", "memories/index.txt", "Index test", "owner", 0);
+    std::string prev = "0";
+    std::vector<BlockHeader> headers;
+    for (int height = 0; height < 4; height++) {
+        AhmiyatBlock block(height, txs, mem, prev, 1, 0.0, "5");
+        headers.push_back(block.header());
+        assert(index.add("5", headers.back()));
+        prev = block.getHash();
+    }
+    assert(!index.add("5", headers[1]));
+    assert(index.size() == 4);
+    BlockLocation location;
+    assert(index.find(headers[2].hash, location) && location.shardId == "5" && location.height == 2);
+    assert(!index.find(Hash256{}, location));
+    BlockHeader header;
+    assert(index.headerAt("5", 3, header) && header.hash == headers[3].hash && !index.headerAt("5", 4, header));
+    std::vector<BlockHeader> range = index.range("5", 1, 10);
+    assert(range.size() == 3 && range[0].previousHash == headers[0].hash);
+    assert(index.height("5") == 4 && index.height("6") == 0);
+    assert(index.tip("5", header) && header.hash == headers[3].hash && !index.tip("6", header));
+    assert(index.shardIds() == std::vector<std::string>{"5"});
+    std::string encoded;
+    ByteWriter writer(encoded);
+    headers[0].encode(writer);
+    assert(encoded.size() == BlockHeader::ENCODED_SIZE);
+    std::cout << "Block index test passed\n";
+}
+
+void testBlockImport() {
+    AhmiyatChain producer("import_producer_db");
+    AhmiyatChain peer("import_peer_db");
+    BlockHeader producerGenesis, peerGenesis;
+    assert(producer.getHeader("0", 0, producerGenesis) && peer.getHeader("0", 0, peerGenesis));
+    assert(producerGenesis.hash == peerGenesis.hash);
+    std::string shardId = producer.homeShard("alice");
+    MemoryFragment mem("text", "memories/import.txt", "Import test", "miner", 0);
+    producer.addBlock({Transaction("alice", "bob", 1.0)}, mem, "miner", 0.0);
+    std::vector<BlockHeader> headers = producer.getHeaders(shardId, 0, 16);
+    assert(!headers.empty());
+    std::string record = producer.getBlockRecord(hashToHex(headers.back().hash));
+    assert(peer.importBlock(record, "producer") == ImportResult::Imported);
+    assert(peer.importBlock(record, "producer") == ImportResult::Duplicate);
+    assert(peer.getBalance("miner", shardId) == producer.getBalance("miner", shardId));
+    assert(peer.importBlock("not a block") == ImportResult::Invalid);
+    AhmiyatBlock stray(7, {Transaction("alice", "bob", 1.0)}, mem, std::string(64, 'a'), 1, 0.0, shardId);
+    assert(peer.importBlock(stray.encode()) == ImportResult::Orphan);
+    ImportStats stats = peer.getImportStats();
+    assert(stats.imported == 1 && stats.duplicates == 1 && stats.invalid == 1 && stats.orphans == 1);
+    std::cout << "Block import test passed\n";
+}
+
+void testImportChecks() {
+    AhmiyatChain producer("import_checks_producer_db");
+    AhmiyatChain peer("import_checks_peer_db");
+    std::string minerShard = producer.homeShard("miner");
+    std::string carol = "carol";
+    for (int i = 0; producer.homeShard(carol) == minerShard; i++) carol = "carol" + std::to_string(i);
+    std::string carolShard = producer.homeShard(carol);
+    producer.setShardDifficulty(minerShard, 1);
+    MemoryFragment mem("text", "memories/import_checks.txt", "Import checks test", "miner", 0);
+    producer.addBlock({Transaction("miner", "bob", 1.0)}, mem, "miner", 0.0);
+    producer.addBlock({Transaction("miner", carol, 10.0)}, mem, "miner", 0.0);
+    producer.addBlock({}, mem, "miner", 0.0);
+    // Only shard 0 starts with a genesis block.
+    std::vector<BlockHeader> minerBlocks = producer.getHeaders(minerShard, minerShard == "0", 2);
+    std::vector<BlockHeader> carolBlocks = producer.getHeaders(carolShard, carolShard == "0", 1);
+    assert(minerBlocks.size() == 2 && carolBlocks.size() == 1);
+    auto record = [&](const BlockHeader& header) { return producer.getBlockRecord(hashToHex(header.hash)); };
+
+    // Mined at difficulty 1 where the peer expects its own default.
+    assert(peer.importBlock(record(minerBlocks[0])) == ImportResult::Invalid);
+    peer.setShardDifficulty(minerShard, 1);
+    // The receipt's source block is not committed here yet.
+    assert(peer.importBlock(record(carolBlocks[0])) == ImportResult::Invalid);
+    assert(peer.importBlock(record(minerBlocks[0])) == ImportResult::Imported);
+    assert(peer.importBlock(record(minerBlocks[1])) == ImportResult::Imported);
+    assert(peer.importBlock(record(carolBlocks[0])) == ImportResult::Imported);
+    assert(peer.getBalance(carol, carolShard) == 10.0);
+
+    // The retarget rule works on milliseconds of chain time, whatever the clock's ticks.
+    const uint64_t second = 1000000000ULL;
+    assert(retargetDifficulty(3, 30 * second, 0.0) == 4);
+    assert(retargetDifficulty(3, 90 * second, 0.0) == 3);
+    assert(retargetDifficulty(3, 90 * second, 2000.0) == 4);
+    assert(retargetDifficulty(3, 200 * second, 0.0) == 2);
+    assert(retargetDifficulty(1, 200 * second, 0.0) == 1);
+    std::cout << "Import checks test passed\n";
+}
+
+void testMiningScheduler() {
+    MiningScheduler scheduler(2);
+    auto job = scheduler.begin("1");
+    job->height = 5;
+    scheduler.blockCommitted("1", 4);
+    scheduler.blockCommitted("2", 9);
+    assert(!job->cancelled);
+    std::atomic<bool> started{false};
+    std::thread second([&]() {
+        auto queued = scheduler.begin("1");
+        started = true;
+        scheduler.abandon(queued);
+    });
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    assert(!started);
+    scheduler.blockCommitted("1", 5);
+    assert(job->cancelled);
+
+    std::vector<Transaction> txs = {Transaction("sender", "receiver", 1.0)};
+    MemoryFragment mem("text", "memories/mining.txt", "Mining test", "owner", 0);
+    bool cancelled = false;
+    std::vector<Transaction> pending = txs;
+    try {
+        AhmiyatBlock block(0, std::move(pending), mem, "0", 64, 0.0, "1", 1, {}, {}, "", "", 0, job.get());
+    } catch (const MiningCancelled&) {
+        cancelled = true;
+    }
+    assert(cancelled && pending.size() == 1 && pending[0].getHash() == txs[0].getHash());
+    unsigned char reused[32], fresh[32];
+    std::string scratch = "stale contents";
+    txs[0].messageHash(reused, scratch);
+    txs[0].messageHash(fresh);
+    assert(std::equal(reused, reused + 32, fresh));
+    scheduler.finish(job, MiningOutcome::Cancelled);
+    second.join();
+    assert(started);
+
+    AhmiyatBlock staked(0, txs, mem, "0", 1, 2.0, "1");
+    bool rejected = false;
+    try {
+        staked.mineBlock(1.0);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected);
+    MiningStats stats = scheduler.getStats();
+    assert(stats.started == 1 && stats.cancelled == 1 && stats.won == 0 && stats.wastedAttempts == stats.attempts);
+
+    // A block that cannot be mined hands its txs back to the mempool.
+    AhmiyatChain chain("mining_requeue_db");
+    chain.setShardDifficulty(chain.homeShard("requeue_sender"), 64);
+    chain.addBlock({Transaction("requeue_sender", "requeue_receiver", 1.0)}, mem, "requeue_sender", 0.0);
+    assert(chain.getMempoolSize() == 1);
+    std::cout << "Mining scheduler test passed\n";
+}
+
+static std::vector<std::pair<std::string, double>> runTransfers(const BalanceMap& base, size_t count, int accounts,
+                                                                ParallelExecutor& executor, ExecutionStats& stats,
+                                                                const std::string& sink = "") {
+    std::vector<std::pair<std::string, double>> committed;
+    auto task = [&](size_t i, const AccountView& view, TxEffects& effects) {
+        std::string sender = "acct" + std::to_string(i % accounts);
+        std::string receiver = sink.empty() ? "acct" + std::to_string((i * 7 + 1) % (accounts + 10)) : sink;
+        double amount = 1.0 + static_cast<double>(i % 5) / 3.0;
+        if (view.balanceOf(sender) < amount) return;
+        effects.writes.emplace_back(sender, -amount);
+        effects.writes.emplace_back(receiver, amount);
+    };
+    auto commit = [&](size_t, const TxEffects& effects) {
+        for (const auto& write : effects.writes) committed.push_back(write);
+    };
+    stats = executor.run(count, base, task, commit);
+    return committed;
+}
+
+void testParallelExecutor() {
+    BalanceMap base;
+    for (int i = 0; i < 50; i++) base["acct" + std::to_string(i)] = (i % 3) * 2.5;
+    ParallelExecutor serialExecutor(1), executor(4);
+    ExecutionStats serial, parallel;
+    auto expected = runTransfers(base, 400, 50, serialExecutor, serial);
+    auto actual = runTransfers(base, 400, 50, executor, parallel);
+    assert(serial.workers == 0 && parallel.workers == 4);
+    assert(actual == expected);
+    assert(parallel.reexecuted > 0 && parallel.reexecuted < 400);
+
+    // One transaction per sender, all paying one account: credits are blind
+    // writes, so nothing reads what another wrote.
+    ExecutionStats disjoint;
+    runTransfers(base, 64, 1000, executor, disjoint, "sink");
+    assert(disjoint.workers == 2 && disjoint.reexecuted == 0);
+
+    // The pool outlives a run, so later blocks reuse the same threads.
+    ExecutionStats again;
+    assert(runTransfers(base, 400, 50, executor, again) == expected && again.workers == 4);
+
+    // Below the threshold the block runs serially.
+    ExecutionStats small;
+    runTransfers(base, PARALLEL_EXECUTION_MIN_TXS - 1, 50, executor, small);
+    assert(small.workers == 0 && small.reexecuted == 0);
+    std::cout << "Parallel executor test passed\n";
+}
+
+void testMpscQueue() {
+    MpscQueue<std::pair<int, int>> queue;
+    std::vector<std::thread> producers;
+    for (int p = 0; p < 4; p++) {
+        producers.emplace_back([&queue, p]() {
+            for (int i = 0; i < 10000; i++) queue.push({p, i});
+        });
+    }
+    std::vector<int> next(4, 0);
+    int popped = 0;
+    std::pair<int, int> item;
+    while (popped < 40000) {
+        if (!queue.pop(item)) continue;
+        assert(item.second == next[item.first]++);
+        popped++;
+    }
+    for (auto& t : producers) t.join();
+    assert(!queue.pop(item));
+    std::cout << "MPSC queue test passed\n";
+}
+
+void testIngest() {
+    AhmiyatChain chain("ingest_test_db");
+    chain.setShardDifficulty(chain.homeShard("ingest_sender0"), 1);
+    IngestConfig config;
+    config.unixPath = "ingest_test.sock";
+    config.window = 4;
+    config.mempoolCapacity = 6;
+    IngestServer server(chain, config);
+    assert(server.start());
+    IngestClient client;
+    assert(client.connectUnix(config.unixPath));
+    std::vector<Transaction> sent;
+    auto tx = [&](int i) {
+        sent.emplace_back("ingest_sender" + std::to_string(i), "ingest_receiver", 1.0);
+        return sent.back();
+    };
+    assert(client.sendRaw("not a transaction", 2000));
+    for (int i = 0; i < 3; i++) assert(client.send(tx(i), 2000));
+    // The window is spent; further credits arrive only as the mempool has room.
+    for (int i = 3; i < 6; i++) assert(client.send(tx(i), 2000));
+    assert(!client.send(tx(6), 300));
+    assert(chain.getMempoolSize() == 6);
+    chain.processPendingTxs();
+    assert(client.send(tx(6), 2000));
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (server.getStats().accepted < 7 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    // Resending a committed or a pending tx queues nothing.
+    assert(client.send(sent[1], 2000) && client.send(sent.back(), 2000));
+    deadline = std::chrono::steady_clock::now() + std::chrono::seconds(2);
+    while (server.getStats().frames < 10 && std::chrono::steady_clock::now() < deadline) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    }
+    server.stop();
+    IngestStats stats = server.getStats();
+    assert(stats.connections == 1 && stats.frames == 10 && stats.invalid == 1 && stats.accepted == 7);
+    assert(stats.duplicates == 2 && stats.dropped == 0 && stats.protocolErrors == 0);
+    std::cout << "Ingest test passed\n";
+}
+
+void testReindex() {
+    std::string blockShard, aliceShard;
+    double minerBalance, aliceBalance;
+    {
+        AhmiyatChain chain("reindex_test_db");
+        blockShard = chain.homeShard("miner");
+        aliceShard = chain.homeShard("alice");
+        chain.setShardDifficulty(blockShard, 1);
+        chain.setShardDifficulty(aliceShard, 1);
+        MemoryFragment mem("text", "memories/reindex.txt", "Reindex test", "miner", 0);
+        chain.addBlock({Transaction("miner", "bob", 1.0)}, mem, "miner", 0.0);
+        chain.addBlock({Transaction("miner", "alice", 10.0)}, mem, "miner", 0.0);
+        chain.addBlock({Transaction("miner", "bob", 5.0)}, mem, "miner", 0.0);
+        minerBalance = chain.getBalance("miner", blockShard);
+        aliceBalance = chain.getBalance("alice", aliceShard);
+        assert(minerBalance > 0);
+    }
+    ReindexConfig config;
+    config.dbPath = "reindex_test_db";
+    config.threads = 2;
+    {
+        AhmiyatChain chain(config.dbPath);
+        chain.setShardDifficulty(blockShard, 1);
+        chain.setShardDifficulty(aliceShard, 1);
+        ReindexReport report = ChainReindexer(chain, config).run();
+        assert(report.consistent && report.heights["0"] == 1 && report.heights[blockShard] >= 3);
+        assert(chain.getBalance("miner", blockShard) == minerBalance);
+        assert(chain.getBalance("alice", aliceShard) == aliceBalance);
+        assert(chain.getHistory("bob", "").find("\"kind\":\"received\"") != std::string::npos);
+    }
+    // A restarted node extends its stored chain instead of starting over at genesis.
+    {
+        AhmiyatChain chain(config.dbPath);
+        chain.setShardDifficulty(blockShard, 1);
+        chain.setShardDifficulty(aliceShard, 1);
+        assert(restoreChain(chain) && chain.getBalance("miner", blockShard) == minerBalance);
+        size_t height = chain.getHeaders(blockShard, 0, 100).size();
+        MemoryFragment mem("text", "memories/reindex.txt", "Reindex restart", "miner", 0);
+        chain.addBlock({Transaction("miner", "bob", 2.0)}, mem, "miner", 0.0);
+        assert(chain.getHeaders(blockShard, 0, 100).size() == height + 1);
+    }
+    // A node restarts after its difficulty retargeted below the configured
+    // one, and after bonding stake on chain.
+    {
+        std::string dropShard, bobShard;
+        double minerBalanceBefore, bobBalanceBefore;
+        const uint64_t step =
+            std::chrono::duration_cast<std::chrono::system_clock::duration>(std::chrono::seconds(150)).count();
+        uint64_t now = 0;
+        MemoryFragment mem("text", "memories/reindex.txt", "Reindex difficulty drop", "miner", 0);
+        {
+            AhmiyatChain chain("reindex_drop_db");
+            now = chain.currentTime();
+            chain.setClock([&now]() { return now; });
+            dropShard = chain.homeShard("miner");
+            bobShard = chain.homeShard("bob");
+            chain.setShardDifficulty(bobShard, 1);
+            chain.setShardDifficulty(dropShard, 2);
+            for (uint64_t i = 0; i <= DIFFICULTY_WINDOW; i++) {
+                now += step;
+                chain.addBlock({Transaction("miner", "bob", 0.5)}, mem, "miner", 0.0);
+            }
+            chain.adjustDifficulty(dropShard);
+            chain.stakeCoins("miner", 5.0);
+            now += step;
+            chain.processPendingTxs();
+            now += step;
+            chain.addBlock({Transaction("miner", "bob", 0.5)}, mem, "miner", 5.0);
+            BlockHeader tip = chain.getHeaders(dropShard, 0, 100).back();
+            assert(tip.difficulty == 1 && tip.stakeWeight == 5.0);
+            minerBalanceBefore = chain.getBalance("miner", dropShard);
+            bobBalanceBefore = chain.getBalance("bob", bobShard);
+        }
+        AhmiyatChain chain("reindex_drop_db");
+        chain.setClock([&now]() { return now; });
+        chain.setShardDifficulty(bobShard, 1);
+        chain.setShardDifficulty(dropShard, 2);
+        assert(restoreChain(chain));
+        assert(chain.getBalance("miner", dropShard) == minerBalanceBefore);
+        assert(chain.getBalance("bob", bobShard) == bobBalanceBefore);
+        size_t height = chain.getHeaders(dropShard, 0, 100).size();
+        now += step;
+        chain.addBlock({Transaction("miner", "bob", 0.5)}, mem, "miner", 5.0);
+        std::vector<BlockHeader> headers = chain.getHeaders(dropShard, 0, 100);
+        assert(headers.size() == height + 1 && headers.back().difficulty == 1 && headers.back().stakeWeight == 5.0);
+    }
+    // Credit the reward of a stored block to someone else. The owner is not
+    // hashed, so only re-execution against the state root catches it.
+    {
+        leveldb::DB* db;
+        leveldb::Options options;
+        assert(leveldb::DB::Open(options, config.dbPath, &db).ok());
+        std::string hash, record;
+        assert(db->Get(leveldb::ReadOptions(), heightKey(blockShard, 1), &hash).ok());
+        assert(db->Get(leveldb::ReadOptions(), blockKey(hash), &record).ok());
+        record.replace(record.find("miner"), 5, "mined");
+        db->Put(leveldb::WriteOptions(), blockKey(hash), record);
+        delete db;
+    }
+    config.verifyOnly = true;
+    {
+        AhmiyatChain chain(config.dbPath);
+        chain.setShardDifficulty(blockShard, 1);
+        ReindexReport report = ChainReindexer(chain, config).run();
+        assert(!report.consistent && report.failedShard == blockShard && report.failedHeight == 1);
+        assert(report.error.find("state root") != std::string::npos);
+    }
+    std::cout << "Reindex test passed\n";
+}
+
+void testCompactTx() {
+    Transaction tx("compact_sender", "compact_receiver", 2.5, 0.01, "3");
+    tx.script = "BALANCE_CHECK=1";
+    tx.signature = "3045022100ab";
+    tx.witness = {"first", std::string("\0bin", 4)};
+    Transaction unsigned_("compact_receiver", "compact_sender", 1.0);
+    unsigned_.signature = "genesis";
+    CompactTxBatch batch;
+    batch.push(tx);
+    batch.push(unsigned_);
+    assert(batch.size() == 2 && batch[0].sender == batch[1].receiver && batch[0].shard == 3);
+    assert(batch[0].signature.size() == 6);
+    Transaction back = batch.unpack(0);
+    assert(back.getHash() == tx.getHash() && back.signature == tx.signature && back.witness == tx.witness);
+    assert(batch.unpack(1).signature == "genesis" && batch.unpack(1).shardId == "0");
+    assert(batch.addresses().lookup(batch[0].receiver) == "compact_receiver" && batch.addresses().size() == 2);
+    Transaction badShard("a", "b", 1.0, 0.001, "01");
+    bool rejected = false;
+    try {
+        batch.push(badShard);
+    } catch (const std::runtime_error&) {
+        rejected = true;
+    }
+    assert(rejected && batch.size() == 2);
+    CompactTxBatch large;
+    for (int i = 0; i < 1000; i++) large.push(tx);
+    assert(large.bytes() < 1000 * sizeof(Transaction));
+    std::cout << "Compact transaction test passed\n";
+}
+
+void testRecentTxs() {
+    RecentTxs recent;
+    recent.insert(100, {"sig_a", "alice"});
+    recent.insert(200, {"sig_b", "bob"});
+    recent.insert(200, {"sig_c", "alice"});
+    recent.expire(150);
+    assert(!recent.contains("sig_a") && recent.contains("sig_b") && recent.size() == 2);
+    auto moved = recent.extract([](const std::string& sender) { return sender == "alice"; });
+    assert(moved.size() == 1 && moved[0].first == 200 && moved[0].second.signature == "sig_c");
+    assert(!recent.contains("sig_c") && recent.contains("sig_b"));
+    recent.expire(201);
+    assert(recent.size() == 0);
+    std::cout << "Recent transactions test passed\n";
+}
+
 void testTransactionCreation() {
     Wallet wallet;
     Transaction tx(wallet.publicKey, "test", 10.0);
@@ -46,6 +863,26 @@ int main() {
     testShardManager();
     testChainBalance();
     testTransactionCreation();
+    testShardSnapshot();
+    testHdrHistogram();
+    testMetricsExposition();
+    testTraceSpans();
+    testBlockRecordAndCache();
+    testCrossShardReceipts();
+    testShardMap();
+    testScriptEngine();
+    testSparseMerkleTree();
+    testHistoryIndex();
+    testBlockIndex();
+    testBlockImport();
+    testImportChecks();
+    testMiningScheduler();
+    testCompactTx();
+    testRecentTxs();
+    testParallelExecutor();
+    testMpscQueue();
+    testIngest();
+    testReindex();
     std::cout << "All tests passed!\n";
     return 0;
 }
@@ -0,0 +1,136 @@
+#include "trace.h"
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <sstream>
+
+struct ThreadTraceState {
+    bool sampled = false;
+    std::string shardId;
+    int64_t height = -1;
+};
+
+static thread_local ThreadTraceState traceState;
+
+Tracer& Tracer::instance() {
+    static Tracer tracer;
+    return tracer;
+}
+
+uint64_t Tracer::nowUs() {
+    static const auto origin = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - origin).count();
+}
+
+void Tracer::setSampleRate(int oneIn) {
+    sampleRate.store(std::max(0, oneIn));
+}
+
+bool Tracer::shouldSample() {
+    int rate = sampleRate.load(std::memory_order_relaxed);
+    if (rate <= 0) return false;
+    return sampleCounter.fetch_add(1, std::memory_order_relaxed) % rate == 0;
+}
+
+// Hands the thread's buffer back to the pool when the thread exits.
+struct ThreadBufferOwner {
+    Tracer::ThreadBuffer* buffer = nullptr;
+    ~ThreadBufferOwner() {
+        if (buffer) Tracer::instance().releaseBuffer(buffer);
+    }
+};
+
+Tracer::ThreadBuffer& Tracer::threadBuffer() {
+    static thread_local ThreadBufferOwner owner;
+    if (!owner.buffer) {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        if (!freeBuffers.empty()) {
+            owner.buffer = freeBuffers.back();
+            freeBuffers.pop_back();
+        } else {
+            buffers.push_back(std::make_unique<ThreadBuffer>());
+            owner.buffer = buffers.back().get();
+        }
+        std::lock_guard<std::mutex> bufferLock(owner.buffer->bufferMutex);
+        owner.buffer->threadId = nextThreadId.fetch_add(1);
+    }
+    return *owner.buffer;
+}
+
+void Tracer::releaseBuffer(ThreadBuffer* buffer) {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    freeBuffers.push_back(buffer);
+}
+
+size_t Tracer::bufferCount() {
+    std::lock_guard<std::mutex> lock(buffersMutex);
+    return buffers.size();
+}
+
+void Tracer::record(const char* name, uint64_t startUs, uint64_t durationUs) {
+    ThreadBuffer& buffer = threadBuffer();
+    std::lock_guard<std::mutex> lock(buffer.bufferMutex);
+    TraceEvent event{name, startUs, durationUs, buffer.threadId, traceState.shardId, traceState.height};
+    if (buffer.events.size() < bufferCapacity) {
+        buffer.events.push_back(std::move(event));
+    } else {
+        buffer.events[buffer.next] = std::move(event);
+        buffer.next = (buffer.next + 1) % bufferCapacity;
+    }
+}
+
+std::string Tracer::dumpChromeJson() {
+    std::vector<TraceEvent> events;
+    {
+        std::lock_guard<std::mutex> lock(buffersMutex);
+        for (const auto& buffer : buffers) {
+            std::lock_guard<std::mutex> bufferLock(buffer->bufferMutex);
+            events.insert(events.end(), buffer->events.begin(), buffer->events.end());
+        }
+    }
+    std::sort(events.begin(), events.end(), [](const TraceEvent& a, const TraceEvent& b) { return a.startUs < b.startUs; });
+
+    std::stringstream ss;
+    ss << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+    for (size_t i = 0; i < events.size(); i++) {
+        const TraceEvent& e = events[i];
+        if (i) ss << ",";
+        ss << "{\"name\":\"" << e.name << "\",\"ph\":\"X\",\"pid\":1,\"tid\":" << e.threadId
+           << ",\"ts\":" << e.startUs << ",\"dur\":" << e.durationUs
+           << ",\"args\":{\"shard\":\"" << e.shardId << "\",\"height\":" << e.height << "}}";
+    }
+    ss << "]}";
+    return ss.str();
+}
+
+bool Tracer::dumpToFile(const std::string& path) {
+    std::ofstream file(path);
+    if (!file.is_open()) return false;
+    file << dumpChromeJson();
+    return true;
+}
+
+TraceContext::TraceContext(bool sampled, const std::string& shardId, int64_t height)
+    : prevSampled(traceState.sampled), prevShard(traceState.shardId), prevHeight(traceState.height) {
+    traceState.sampled = sampled;
+    traceState.shardId = shardId;
+    traceState.height = height;
+}
+
+TraceContext::~TraceContext() {
+    traceState.sampled = prevSampled;
+    traceState.shardId = prevShard;
+    traceState.height = prevHeight;
+}
+
+bool TraceContext::active() { return traceState.sampled; }
+const std::string& TraceContext::shardId() { return traceState.shardId; }
+int64_t TraceContext::height() { return traceState.height; }
+
+TraceSpan::TraceSpan(const char* n) : name(n), start(0), enabled(traceState.sampled) {
+    if (enabled) start = Tracer::nowUs();
+}
+
+TraceSpan::~TraceSpan() {
+    if (enabled) Tracer::instance().record(name, start, Tracer::nowUs() - start);
+}
@@ -0,0 +1,86 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <string>
+#include <vector>
+#include <memory>
+#include <atomic>
+#include <mutex>
+#include <cstdint>
+
+struct TraceEvent {
+    const char* name;
+    uint64_t startUs;
+    uint64_t durationUs;
+    int threadId;
+    std::string shardId;
+    int64_t height;
+};
+
+// Spans are appended to per-thread ring buffers and only collected when a
+// dump is requested, so recording never contends with other threads. A
+// thread's buffer goes back to a free list when the thread exits and is
+// reused, events and all, by the next thread that records, so the pool is
+// bounded by the peak number of threads tracing at once.
+class Tracer {
+private:
+    struct ThreadBuffer {
+        std::mutex bufferMutex;
+        std::vector<TraceEvent> events;
+        size_t next = 0;
+        int threadId;
+    };
+    std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+    std::vector<ThreadBuffer*> freeBuffers;
+    std::mutex buffersMutex;
+    std::atomic<int> sampleRate{0};
+    std::atomic<uint64_t> sampleCounter{0};
+    std::atomic<int> nextThreadId{1};
+    size_t bufferCapacity = 8192;
+
+    Tracer() = default;
+    ThreadBuffer& threadBuffer();
+    void releaseBuffer(ThreadBuffer* buffer);
+    friend struct ThreadBufferOwner;
+
+public:
+    static Tracer& instance();
+    static uint64_t nowUs();
+    // Trace one in every `oneIn` blocks; 0 disables tracing.
+    void setSampleRate(int oneIn);
+    int getSampleRate() const { return sampleRate.load(); }
+    bool shouldSample();
+    void record(const char* name, uint64_t startUs, uint64_t durationUs);
+    size_t bufferCount();
+    std::string dumpChromeJson();
+    bool dumpToFile(const std::string& path);
+};
+
+// Marks the block the current thread is working on. Spans opened on this
+// thread are recorded only while a sampled context is active.
+class TraceContext {
+private:
+    bool prevSampled;
+    std::string prevShard;
+    int64_t prevHeight;
+
+public:
+    TraceContext(bool sampled, const std::string& shardId, int64_t height);
+    ~TraceContext();
+    static bool active();
+    static const std::string& shardId();
+    static int64_t height();
+};
+
+class TraceSpan {
+private:
+    const char* name;
+    uint64_t start;
+    bool enabled;
+
+public:
+    explicit TraceSpan(const char* name);
+    ~TraceSpan();
+};
+
+#endif
@@ -0,0 +1,16 @@
+#ifndef TRANSPORT_H
+#define TRANSPORT_H
+
+#include <string>
+
+// Outbound block propagation. The chain's default is a TCP connection per
+// DHT peer; a Transport replaces it without touching block production.
+class Transport {
+public:
+    virtual ~Transport() {}
+    // Sends an encoded block record to every peer except fromPeer, the node
+    // it was received from (empty for locally produced blocks).
+    virtual void broadcast(const std::string& record, const std::string& fromPeer) = 0;
+};
+
+#endif
@@ -1,8 +1,15 @@
 #include "utils.h"
+#include "metrics.h"
 #include <curl/curl.h>
 #include <fstream>
 #include <sstream>
 #include <openssl/sha.h>
+#include <atomic>
+
+static std::atomic<bool> logEnabled{true};
+static UploadBackend uploadBackend;
+static MetricHistogram& ipfsUploadLatency =
+    MetricsRegistry::instance().histogram("ahmiyat_ipfs_upload_seconds", "Memory fragment upload time");
 
 size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* data) {
     data->append((char*)contents, size * nmemb);
@@ -10,11 +17,22 @@ size_t writeCallback(void* contents, size_t size, size_t nmemb, std::string* dat
 }
 
 void log(const std::string& message) {
+    if (!logEnabled.load(std::memory_order_relaxed)) return;
     std::ofstream logFile("ahmiyat.log", std::ios::app);
     logFile << "[" << time(nullptr) << "] " << message << std::endl;
 }
 
+void setLogEnabled(bool enabled) {
+    logEnabled.store(enabled);
+}
+
+void setUploadBackend(UploadBackend backend) {
+    uploadBackend = backend;
+}
+
 std::string uploadToIPFS(const std::string& filePath) {
+    ScopedTimer timer(ipfsUploadLatency);
+    if (uploadBackend) return uploadBackend(filePath);
     CURL* curl = curl_easy_init();
     if (!curl) {
         log("CURL initialization failed");
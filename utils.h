@@ -2,9 +2,14 @@
 #define UTILS_H
 
 #include <string>
+#include <functional>
+
+typedef std::function<std::string(const std::string&)> UploadBackend;
 
 void log(const std::string& message);
+void setLogEnabled(bool enabled);
 std::string uploadToIPFS(const std::string& filePath);
+void setUploadBackend(UploadBackend backend);
 std::string generateZKProof(const std::string& data);
 
 #endif